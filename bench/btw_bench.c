@@ -0,0 +1,656 @@
+/*
+ * btw_bench - encode and decode throughput of btw.h over a corpus.
+ *
+ * Every case is generated (sine, noise or silence at each requested bit
+ * depth and channel count) or read from a PCM WAV file given on the command
+ * line. Each runs in its own process so its peak RSS is its own, and is
+ * encoded and decoded "reps" times keeping the fastest run. The decoded
+ * samples are compared with the input, and a mismatch makes the exit status
+ * 1. Built with -DBTW_BENCH_FLAC and libFLAC, FLAC at its default level is
+ * measured alongside.
+ *
+ *   btw_bench [-b bits,...] [-c channels,...] [-k kinds] [-s seconds]
+ *       [-r rate] [-n reps] [-B block_size] [-m min_block_size] [file.wav...]
+ *
+ * Rates are in MB of PCM per second and millions of samples per second,
+ * counting every channel.
+ */
+
+#define BTW_IMPLEMENTATION
+#include "../btw.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#ifdef BTW_BENCH_FLAC
+#include <FLAC/stream_decoder.h>
+#include <FLAC/stream_encoder.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define BENCH_MAX_LIST 16
+
+typedef struct {
+	char name[64];
+	btw_format fmt;
+	btw_def def;
+	unsigned char *pcm;
+	unsigned long long bytes;
+} bench_case;
+
+typedef struct {
+	double enc, dec;	/* Best times in seconds */
+	unsigned long long len;
+	const char *error;	/* What failed, NULL if nothing did */
+} bench_result;
+
+static double
+now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t
+rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static btw_format
+bits_format(unsigned int bits)
+{
+	if (bits <= 8) {
+		return BTW_FMT_U8;
+	} else if (bits <= 16) {
+		return BTW_FMT_S16;
+	} else if (bits <= 24) {
+		return BTW_FMT_S24;
+	}
+	return BTW_FMT_S32;
+}
+
+static unsigned int
+format_bytes(btw_format fmt)
+{
+	static const unsigned int size[] = { 1, 2, 3, 4, 4 };
+
+	return size[fmt];
+}
+
+/* Store sample v, signed and fitting in the case's bits, at index i */
+static void
+put_sample(bench_case *c, unsigned long long i, long long v)
+{
+	unsigned char *p = c->pcm + i * format_bytes(c->fmt);
+
+	switch (c->fmt) {
+	case BTW_FMT_U8:
+		/* 8-bit PCM is unsigned, as in WAV */
+		*p = (uint8_t)(v + (1 << (c->def.bits_per_sample - 1)));
+		break;
+	case BTW_FMT_S16:
+		*(int16_t *)p = (int16_t)v;
+		break;
+	case BTW_FMT_S24:
+		p[0] = v & 0xff;
+		p[1] = (v >> 8) & 0xff;
+		p[2] = (v >> 16) & 0xff;
+		break;
+	default:
+		*(int32_t *)p = (int32_t)v;
+		break;
+	}
+}
+
+static int
+make_case(bench_case *c, char kind, unsigned int bits, unsigned int channels,
+		unsigned long rate, double seconds)
+{
+	static const char *kinds[] = { "sine", "noise", "silence" };
+	long long peak = (1LL << (bits - 1)) - 1, v;
+	unsigned long long frames = seconds * rate, i;
+	unsigned int chan;
+
+	memset(c, 0, sizeof(*c));
+	c->fmt = bits_format(bits);
+	c->def.channels = channels;
+	c->def.bits_per_sample = bits;
+	c->def.sample_rate = rate;
+	c->def.sample_count = frames;
+	c->bytes = frames * channels * format_bytes(c->fmt);
+	c->pcm = (unsigned char *)malloc(c->bytes);
+	if (!c->pcm) {
+		return 0;
+	}
+	snprintf(c->name, sizeof(c->name), "%s",
+		kinds[kind == 's' ? 0 : kind == 'n' ? 1 : 2]);
+
+	for (i = 0; i < frames; i++) {
+		for (chan = 0; chan < channels; chan++) {
+			switch (kind) {
+			case 's':
+				/* A tone per channel at half scale */
+				v = (long long)(peak / 2 * sin(2 * M_PI * i
+					* (220.0 + 110 * chan) / rate));
+				break;
+			case 'n':
+				v = (long long)(rng() % (2ULL * peak + 1)) - peak;
+				break;
+			default:
+				v = 0;
+				break;
+			}
+			put_sample(c, i * channels + chan, v);
+		}
+	}
+	return 1;
+}
+
+static uint32_t
+le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t
+le32(const unsigned char *p)
+{
+	return le16(p) | (uint32_t)le16(p + 2) << 16;
+}
+
+/* Read a PCM WAV file, whose samples BTW takes in the same layout */
+static int
+read_wav(bench_case *c, const char *path)
+{
+	unsigned char *file = NULL, *p, *end;
+	const char *base = strrchr(path, '/');
+	unsigned int bits = 0, channels = 0, format = 0;
+	unsigned long rate = 0;
+	long size;
+	FILE *f;
+
+	memset(c, 0, sizeof(*c));
+	if (!(f = fopen(path, "rb"))) {
+		return 0;
+	}
+	if (!fseek(f, 0, SEEK_END) && (size = ftell(f)) > 12
+			&& !fseek(f, 0, SEEK_SET)
+			&& (file = (unsigned char *)malloc(size))
+			&& fread(file, 1, size, f) != (unsigned long)size) {
+		free(file);
+		file = NULL;
+	}
+	fclose(f);
+	if (!file) {
+		return 0;
+	}
+
+	if (memcmp(file, "RIFF", 4) || memcmp(file + 8, "WAVE", 4)) {
+		free(file);
+		return 0;
+	}
+	end = file + size;
+	for (p = file + 12; p + 8 <= end; p += 8 + ((le32(p + 4) + 1) & ~1u)) {
+		if (!memcmp(p, "fmt ", 4) && p + 24 <= end) {
+			format = le16(p + 8);
+			channels = le16(p + 10);
+			rate = le32(p + 12);
+			bits = le16(p + 22);
+			/* WAVE_FORMAT_EXTENSIBLE keeps the real tag later */
+			if (format == 0xfffe && p + 34 <= end) {
+				format = le16(p + 32);
+			}
+		} else if (!memcmp(p, "data", 4) && format == 1 && channels
+				&& bits && bits <= 32 && bits % 8 == 0) {
+			c->bytes = le32(p + 4);
+			if (c->bytes > (unsigned long long)(end - p - 8)) {
+				c->bytes = end - p - 8;
+			}
+			c->bytes -= c->bytes % (channels * bits / 8);
+			c->pcm = (unsigned char *)malloc(c->bytes ? c->bytes : 1);
+			if (!c->pcm) {
+				break;
+			}
+			memcpy(c->pcm, p + 8, c->bytes);
+			c->fmt = bits_format(bits);
+			c->def.channels = channels;
+			c->def.bits_per_sample = bits;
+			c->def.sample_rate = rate;
+			c->def.sample_count = c->bytes / (channels * bits / 8);
+			snprintf(c->name, sizeof(c->name), "%s",
+				base ? base + 1 : path);
+			break;
+		}
+	}
+	free(file);
+	return c->pcm && c->def.sample_count;
+}
+
+static void
+run_btw(const bench_case *c, int reps, bench_result *r)
+{
+	unsigned long long len, out_len;
+	unsigned char *enc;
+	void *dec;
+	double t;
+	btw_def d;
+	int i;
+
+	r->enc = r->dec = 1e30;
+	r->len = 0;
+	r->error = NULL;
+	for (i = 0; i < reps && !r->error; i++) {
+		t = now();
+		enc = btw_encode_fmt(c->pcm, c->fmt, &c->def, &len);
+		t = now() - t;
+		if (!enc) {
+			r->error = "encode";
+			break;
+		}
+		r->enc = t < r->enc ? t : r->enc;
+		r->len = len;
+
+		t = now();
+		dec = btw_decode_n(enc, len, c->fmt, &d, &out_len);
+		t = now() - t;
+		r->dec = t < r->dec ? t : r->dec;
+		if (!dec) {
+			r->error = "decode";
+		} else if (memcmp(dec, c->pcm, c->bytes)) {
+			r->error = "mismatch";
+		}
+		free(dec);
+		free(enc);
+	}
+}
+
+#ifdef BTW_BENCH_FLAC
+typedef struct {
+	unsigned char *data;
+	unsigned long long len, cap, pos;
+	const bench_case *c;
+	unsigned long long frame;	/* Next frame the decoder writes */
+	int ok;
+} flac_io;
+
+static FLAC__StreamEncoderWriteStatus
+flac_write(const FLAC__StreamEncoder *enc, const FLAC__byte buffer[],
+		size_t bytes, unsigned samples, unsigned current_frame,
+		void *user)
+{
+	flac_io *io = (flac_io *)user;
+	unsigned char *p;
+
+	(void)enc;
+	(void)samples;
+	(void)current_frame;
+	if (io->len + bytes > io->cap) {
+		io->cap = (io->len + bytes) * 2;
+		if (!(p = (unsigned char *)realloc(io->data, io->cap))) {
+			return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+		}
+		io->data = p;
+	}
+	memcpy(io->data + io->len, buffer, bytes);
+	io->len += bytes;
+	return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+static FLAC__StreamDecoderReadStatus
+flac_read(const FLAC__StreamDecoder *dec, FLAC__byte buffer[], size_t *bytes,
+		void *user)
+{
+	flac_io *io = (flac_io *)user;
+
+	(void)dec;
+	if (io->pos >= io->len) {
+		*bytes = 0;
+		return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+	}
+	if (*bytes > io->len - io->pos) {
+		*bytes = io->len - io->pos;
+	}
+	memcpy(buffer, io->data + io->pos, *bytes);
+	io->pos += *bytes;
+	return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+/* Compare a decoded frame with the input, widened like put_sample's */
+static FLAC__StreamDecoderWriteStatus
+flac_output(const FLAC__StreamDecoder *dec, const FLAC__Frame *frame,
+		const FLAC__int32 *const buffer[], void *user)
+{
+	flac_io *io = (flac_io *)user;
+	const bench_case *c = io->c;
+	unsigned int size = format_bytes(c->fmt), chan, j;
+	const unsigned char *p;
+	long long v;
+
+	(void)dec;
+	for (j = 0; j < frame->header.blocksize; j++, io->frame++) {
+		for (chan = 0; chan < c->def.channels; chan++) {
+			p = c->pcm + (io->frame * c->def.channels + chan) * size;
+			switch (c->fmt) {
+			case BTW_FMT_U8:
+				v = *p - (1 << (c->def.bits_per_sample - 1));
+				break;
+			case BTW_FMT_S16:
+				v = *(const int16_t *)p;
+				break;
+			case BTW_FMT_S24:
+				v = (int32_t)((uint32_t)(p[0] | p[1] << 8
+					| p[2] << 16) << 8) >> 8;
+				break;
+			default:
+				v = *(const int32_t *)p;
+				break;
+			}
+			io->ok &= buffer[chan][j] == v;
+		}
+	}
+	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void
+flac_error(const FLAC__StreamDecoder *dec,
+		FLAC__StreamDecoderErrorStatus status, void *user)
+{
+	(void)dec;
+	(void)status;
+	((flac_io *)user)->ok = 0;
+}
+
+/* Like run_btw, with FLAC taking samples widened to FLAC__int32 */
+static void
+run_flac(const bench_case *c, int reps, bench_result *r)
+{
+	unsigned long long n = c->def.sample_count * c->def.channels, i;
+	unsigned int size = format_bytes(c->fmt);
+	FLAC__StreamEncoder *enc;
+	FLAC__StreamDecoder *dec;
+	FLAC__int32 *wide;
+	const unsigned char *p;
+	flac_io io;
+	double t;
+	int rep;
+
+	r->enc = r->dec = 1e30;
+	r->len = 0;
+	r->error = "flac";
+	if (!(wide = (FLAC__int32 *)malloc(n * sizeof(*wide)))) {
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		p = c->pcm + i * size;
+		switch (c->fmt) {
+		case BTW_FMT_U8:
+			wide[i] = *p - (1 << (c->def.bits_per_sample - 1));
+			break;
+		case BTW_FMT_S16:
+			wide[i] = *(const int16_t *)p;
+			break;
+		case BTW_FMT_S24:
+			wide[i] = (int32_t)((uint32_t)(p[0] | p[1] << 8
+				| p[2] << 16) << 8) >> 8;
+			break;
+		default:
+			wide[i] = *(const int32_t *)p;
+			break;
+		}
+	}
+
+	for (rep = 0; rep < reps; rep++) {
+		memset(&io, 0, sizeof(io));
+		io.c = c;
+		io.ok = 1;
+
+		/* The widening above isn't timed, as BTW takes PCM as it is */
+		t = now();
+		enc = FLAC__stream_encoder_new();
+		if (!enc) {
+			break;
+		}
+		FLAC__stream_encoder_set_channels(enc, c->def.channels);
+		FLAC__stream_encoder_set_bits_per_sample(enc,
+			c->def.bits_per_sample);
+		FLAC__stream_encoder_set_sample_rate(enc, c->def.sample_rate);
+		FLAC__stream_encoder_set_total_samples_estimate(enc,
+			c->def.sample_count);
+		if (FLAC__stream_encoder_init_stream(enc, flac_write, NULL, NULL,
+				NULL, &io) != FLAC__STREAM_ENCODER_INIT_STATUS_OK
+				|| !FLAC__stream_encoder_process_interleaved(enc,
+					wide, c->def.sample_count)
+				|| !FLAC__stream_encoder_finish(enc)) {
+			FLAC__stream_encoder_delete(enc);
+			free(io.data);
+			break;
+		}
+		FLAC__stream_encoder_delete(enc);
+		t = now() - t;
+		r->enc = t < r->enc ? t : r->enc;
+		r->len = io.len;
+
+		t = now();
+		dec = FLAC__stream_decoder_new();
+		if (!dec || FLAC__stream_decoder_init_stream(dec, flac_read, NULL,
+				NULL, NULL, NULL, flac_output, NULL, flac_error,
+				&io) != FLAC__STREAM_DECODER_INIT_STATUS_OK
+				|| !FLAC__stream_decoder_process_until_end_of_stream(
+					dec)) {
+			io.ok = 0;
+		}
+		if (dec) {
+			FLAC__stream_decoder_delete(dec);
+		}
+		t = now() - t;
+		r->dec = t < r->dec ? t : r->dec;
+		r->error = io.ok && io.frame == c->def.sample_count
+			? NULL : "flac";
+		free(io.data);
+		if (r->error) {
+			break;
+		}
+	}
+	free(wide);
+}
+#endif
+
+static void
+print_rates(const bench_case *c, double t)
+{
+	double samples = (double)c->def.sample_count * c->def.channels;
+
+	printf(" %8.1f %8.1f %7.2f", c->bytes / 1e6 / t, samples / 1e6 / t,
+		t * 1e9 / samples);
+}
+
+static void
+print_header(void)
+{
+	printf("%-16s %4s %3s %6s %8s %8s %7s %8s %8s %7s %7s",
+		"case", "bits", "ch", "ratio", "enc MB/s", "enc MS/s", "enc ns",
+		"dec MB/s", "dec MS/s", "dec ns", "RSS MB");
+#ifdef BTW_BENCH_FLAC
+	printf(" %6s %8s %8s", "flac", "enc MB/s", "dec MB/s");
+#endif
+	printf("\n");
+}
+
+/* Run case c in a child process, return 0 if it round-tripped */
+static int
+bench(const bench_case *c, int reps)
+{
+	struct rusage usage;
+	bench_result r;
+	int status;
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		return 1;
+	}
+	if (pid == 0) {
+		run_btw(c, reps, &r);
+		printf("%-16.16s %4u %3u", c->name, c->def.bits_per_sample,
+			c->def.channels);
+		if (r.error) {
+			printf(" %s FAILED\n", r.error);
+			exit(1);
+		}
+		printf(" %6.3f", (double)r.len / c->bytes);
+		print_rates(c, r.enc);
+		print_rates(c, r.dec);
+
+		/* ru_maxrss is in kilobytes on Linux */
+		getrusage(RUSAGE_SELF, &usage);
+		printf(" %7.1f", usage.ru_maxrss / 1024.0);
+#ifdef BTW_BENCH_FLAC
+		run_flac(c, reps, &r);
+		if (!r.error) {
+			printf(" %6.3f %8.1f %8.1f", (double)r.len / c->bytes,
+				c->bytes / 1e6 / r.enc, c->bytes / 1e6 / r.dec);
+		} else {
+			printf(" %6s %8s %8s", "-", "-", "-");
+		}
+#endif
+		printf("\n");
+		exit(0);
+	}
+	if (waitpid(pid, &status, 0) != pid) {
+		return 1;
+	}
+	return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+/* Parse a comma separated list of numbers into list, return its length */
+static int
+parse_list(const char *s, unsigned int *list)
+{
+	int n = 0;
+
+	while (*s && n < BENCH_MAX_LIST) {
+		list[n++] = strtoul(s, (char **)&s, 10);
+		if (*s == ',') {
+			s++;
+		} else if (*s) {
+			return 0;
+		}
+	}
+	return n;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: btw_bench [-b bits,...] [-c channels,...] "
+		"[-k kinds] [-s seconds]\n"
+		"    [-r rate] [-n reps] [-B block_size] [-m min_block_size] "
+		"[file.wav...]\n"
+		"kinds are letters: s sine, n noise, z silence, "
+		"-k '' for files only\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned int bits[BENCH_MAX_LIST] = { 8, 16, 24, 32 };
+	unsigned int channels[BENCH_MAX_LIST] = { 1, 2, 8 };
+	unsigned int block_size = 0, min_block_size = 0;
+	int nbits = 4, nchannels = 3, reps = 5, failed = 0, i, b, ch;
+	const char *kinds = "snz", *k;
+	unsigned long rate = 48000;
+	double seconds = 4;
+	bench_case c;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (!argv[i][1] || argv[i][2] || i + 1 == argc) {
+			usage();
+		}
+		switch (argv[i++][1]) {
+		case 'b':
+			nbits = parse_list(argv[i], bits);
+			break;
+		case 'c':
+			nchannels = parse_list(argv[i], channels);
+			break;
+		case 'k':
+			kinds = argv[i];
+			break;
+		case 's':
+			seconds = atof(argv[i]);
+			break;
+		case 'r':
+			rate = strtoul(argv[i], NULL, 10);
+			break;
+		case 'n':
+			reps = atoi(argv[i]);
+			break;
+		case 'B':
+			block_size = strtoul(argv[i], NULL, 10);
+			break;
+		case 'm':
+			min_block_size = strtoul(argv[i], NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	for (b = 0; b < nbits; b++) {
+		if (bits[b] < 2 || bits[b] > 32) {
+			usage();
+		}
+	}
+	for (ch = 0; ch < nchannels; ch++) {
+		if (!channels[ch]) {
+			usage();
+		}
+	}
+	if (!nbits || !nchannels || reps < 1 || seconds <= 0 || !rate
+			|| strspn(kinds, "snz") != strlen(kinds)) {
+		usage();
+	}
+
+	print_header();
+	for (k = kinds; *k; k++) {
+		for (b = 0; b < nbits; b++) {
+			for (ch = 0; ch < nchannels; ch++) {
+				if (!make_case(&c, *k, bits[b], channels[ch],
+						rate, seconds)) {
+					return 1;
+				}
+				c.def.block_size = block_size;
+				c.def.min_block_size = min_block_size;
+				failed |= bench(&c, reps);
+				free(c.pcm);
+			}
+		}
+	}
+	for (; i < argc; i++) {
+		if (!read_wav(&c, argv[i])) {
+			fprintf(stderr, "btw_bench: can't read %s\n", argv[i]);
+			failed = 1;
+			continue;
+		}
+		c.def.block_size = block_size;
+		c.def.min_block_size = min_block_size;
+		failed |= bench(&c, reps);
+		free(c.pcm);
+	}
+	return failed;
+}
@@ -16,23 +16,121 @@
  * limitations under the License.
  *
  * -- ABOUT:
- * BTW can compress audio losslessly at about 75% efficiency. Both encoding
- * and decoding speeds are slower than FLAC, but I believe this is mainly
- * due to a lack of optimization for bit reading and writing.
+ * BTW can compress audio losslessly at about 75% efficiency. Bits are read
+ * and written a 64-bit word at a time, with unary runs found by counting
+ * trailing ones instead of bit by bit.
  *
  * -- TLDR:
  * Define BTW_IMPLEMENATION, and define whether you want to store samples in
  * uint8_t, int16_t, or int32_t integers.
  * Samples must be alligned to their integer type to be encoded correctly.
+ * Without one of these, only the _fmt functions and the ones named after a
+ * format, which take the sample format at run time, are available.
  *
  * #define BTW_IMPLEMENTATION
  * //#define BTW_U8 when samples can fit in 8 bits or less
  * //#define BTW_S16 when samples can fit in 16 bits or less
  * //#define BTW_S32 when samples can fit in 32 bits or less
+ * //#define BTW_SEEK_INTERVAL 0 to encode without a seek table
+ * //#define BTW_CHECKSUMS 0 to encode without block and file checksums
+ * //#define BTW_PARTITION_ORDER 0 to encode one rice_len per channel
+ * //#define BTW_NO_THREADS to run the _mt functions on the calling thread
+ * //#define BTW_NO_SIMD to leave out the AVX2 and NEON kernels
+ * //#define BTW_NO_MMAP to have btw_open_file read files into memory
+ * //#define BTW_STATS to count where encoding time and bits go, see btw_stats
  * #include "btw.h"
  *
+ * Otherwise link with -pthread on POSIX systems.
+ *
  * -- DOCUMENTATION:
  *
+ * A file is a 28-byte header, an optional seek table and then the blocks of
+ * block_size samples per channel. All fields are little-endian.
+ *
+ *   "btw", version (2)   4 bytes
+ *   sample_count         8 bytes, samples per channel, all ones if unknown
+ *   channels             2 bytes
+ *   bits_per_sample      2 bytes
+ *   sample_rate          4 bytes
+ *   flags                2 bytes
+ *   seek_interval        2 bytes, blocks per seek table entry, 0 for none
+ *   block_size           2 bytes
+ *   min_block_size       2 bytes
+ *
+ * The last two are only there when flags has BTW_FLAG_BLOCK_SIZE, otherwise
+ * the header is 24 bytes and both sizes are 512.
+ *
+ * The seek table holds one 8-byte entry for every seek_interval blocks,
+ * giving the offset of that block from the start of the file.
+ *
+ * A block is coded as one piece, or, if it is bigger than min_block_size,
+ * may be split in halves which are coded the same way. Such a piece starts
+ * with a bit that is 1 when it is split. A piece whose second half would
+ * hold no samples, at the end of the stream, is never split and has no bit.
+ *
+ * Each piece holds every channel in turn. A channel is its predictor order
+ * (3 bits, when flags has BTW_FLAG_PREDICTOR), rice_len (enough bits for
+ * bits_per_sample) and then a Rice code for each sample's residual: a sign
+ * bit, the magnitude shifted right by rice_len in unary as ones ended by a
+ * zero, and the low rice_len bits of the magnitude. Without the flag the
+ * order is 1. Order k predicts from the previous k samples with the fixed
+ * polynomial predictors, the first samples of each piece using order j for
+ * sample j until k is reached. Samples fitting in bits_per_sample bits keep
+ * every residual below 2^(bits_per_sample + 5), so decoders reject unary
+ * runs longer than that allows.
+ *
+ * When flags has BTW_FLAG_ZIGZAG, codes have no sign bit. The residual r
+ * is folded to 2r, or -2r - 1 when negative, and that is coded as the
+ * magnitude.
+ *
+ * When flags has BTW_FLAG_ESCAPE, a unary run of 16 ones is not ended by a
+ * zero but escapes the code: the whole magnitude follows in
+ * bits_per_sample + 5 bits, or + 6 when folded, instead of the low rice_len
+ * bits. Order 6 then marks a channel coded verbatim, each sample in two's
+ * complement in bits_per_sample + 1 bits.
+ *
+ * When flags has BTW_FLAG_NARROW, only side channels take bits_per_sample
+ * + 1 bits for the samples of verbatim channels and for the values of
+ * constant ones, every other channel bits_per_sample bits. Verbatim data
+ * then stays within the size of its PCM but for one bit per stereo sample.
+ * When flags also has BTW_FLAG_UNSIGNED, the samples were unsigned, 0 to
+ * 2^bits_per_sample - 1 as 8-bit PCM is, and those bits_per_sample bits
+ * are zero-extended instead of being two's complement.
+ *
+ * When flags has BTW_FLAG_PARTITIONED, the order is followed by a 3-bit
+ * partition order p instead of rice_len. The channel is then split into
+ * partitions of size >> p samples, size being that of the piece, each
+ * starting with its own rice_len.
+ *
+ * When flags has BTW_FLAG_CONSTANT, order 7 marks a channel whose samples
+ * all have the same value. Only that value follows, in two's complement in
+ * bits_per_sample + 1 bits.
+ *
+ * When flags has BTW_FLAG_STEREO, each piece of a two-channel file starts
+ * with a 2-bit stereo mode naming the channels it codes: left and right (0),
+ * left and side (1), side and right (2) or mid and side (3), where side is
+ * left - right and mid is (left + right) >> 1.
+ *
+ * When flags has BTW_FLAG_CRC, each block ends after its padding with the
+ * low 16 bits of the CRC-32C of its bytes, and the last block is followed
+ * by the CRC-32C of the decoded samples as interleaved little-endian PCM,
+ * each sample in its low (bits_per_sample + 7) / 8 bytes.
+ *
+ * When flags has BTW_FLAG_OPEN, the stream was written without knowing its
+ * length, so sample_count may be unknown. Each block then starts with a
+ * bit that is 1 for the last one, which is followed by its samples per
+ * channel in 16 bits, 0 when the stream is empty. A stream that was cut off
+ * after a whole block, before its last one and file check, ends there.
+ *
+ * Blocks are self-contained: no prediction reaches back into the previous
+ * piece and each block is padded with zero bits to a byte boundary. Any
+ * block can be decoded on its own given its offset, which is what the seek
+ * table and btw_decode_range rely on.
+ *
+ * Version 1 files have 'f' in place of the version, end the header after
+ * sample_rate and have no seek table. Their blocks are not padded, so the
+ * next block starts at the bit following the previous one.
+ *
  */
 
 /* TLDR: define BTW_IMPLEMENTATION and a BTW_BIT_DEPTH */
@@ -57,6 +155,8 @@ typedef void btw_sample_fmt; /* Should cause compiler failure */
 #ifndef BTW_H
 #define BTW_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -66,338 +166,6715 @@ typedef struct {
 	unsigned int bits_per_sample;
 	unsigned long sample_rate;
 	unsigned long long sample_count;
+	/*
+	 * Samples per channel in a block, a power of two from
+	 * BTW_MIN_BLOCK_SIZE to BTW_MAX_BLOCK_SIZE, 0 for 512. Blocks are
+	 * the unit of seeking.
+	 */
+	unsigned int block_size;
+	/*
+	 * Smallest piece the encoder may split a block into, trying halves
+	 * wherever they code smaller. 0 or block_size keeps blocks whole.
+	 */
+	unsigned int min_block_size;
 } btw_def;
 
+#define BTW_MIN_BLOCK_SIZE 16
+#define BTW_MAX_BLOCK_SIZE 32768
+
+/*
+ * Sample layouts for the _fmt functions, which take the format at run time
+ * instead of from BTW_U8, BTW_S16 or BTW_S32. Samples are interleaved by
+ * channel as always.
+ */
+typedef enum {
+	BTW_FMT_U8,	/* uint8_t */
+	BTW_FMT_S16,	/* int16_t */
+	BTW_FMT_S24,	/* 3 bytes a sample, little-endian, no padding */
+	BTW_FMT_S32,	/* int32_t */
+	BTW_FMT_F32	/* float, sample / 2^(bits_per_sample - 1), decode
+			   only */
+} btw_format;
 
+/* Errors the _into functions return */
+typedef enum {
+	BTW_OK = 0,
+	BTW_ERR_INVALID = -1,	/* A bad argument or btw_def */
+	BTW_ERR_NOMEM = -2,	/* Scratch couldn't be allocated */
+	BTW_ERR_SPACE = -3,	/* out is too small */
+	BTW_ERR_CORRUPT = -4,	/* data isn't a stream that can be decoded */
+	BTW_ERR_IO = -5		/* A file couldn't be opened or read */
+} btw_error;
+
+/*
+ * Encode samples, returning a buffer of exactly *out_len bytes to free, or
+ * NULL on bad input or when out of memory.
+ */
 unsigned char *btw_encode(btw_sample_fmt *samples, btw_def *def,
 		unsigned long long *out_len);
 
+/* Read the header of data into def, which is zeroed if it isn't one */
 void btw_read_metadata(const unsigned char *data, btw_def *def);
 
 btw_sample_fmt *btw_decode(const unsigned char *data, btw_def *def,
 		unsigned long long *out_len);
 
-#ifdef __cplusplus
-}
-#endif
+/*
+ * btw_read_metadata and btw_decode_fmt for len bytes of data, which they
+ * never read past, so they are safe on untrusted input. A truncated or
+ * corrupt stream makes btw_decode_n return NULL. btw_read_metadata_n
+ * returns BTW_OK, or BTW_ERR_CORRUPT if there's no valid header.
+ */
+int btw_read_metadata_n(const unsigned char *data, unsigned long long len,
+		btw_def *def);
 
-#endif /* BTW_H */
+void *btw_decode_n(const unsigned char *data, unsigned long long len,
+		btw_format fmt, btw_def *def, unsigned long long *out_len);
 
-#ifdef BTW_IMPLEMENTATION
-#include <stdlib.h>
+/*
+ * Read only the header from the first len bytes of data into def, which
+ * needn't hold more than BTW_PROBE_SIZE bytes. Returns BTW_OK, or
+ * BTW_ERR_CORRUPT with def zeroed if they don't start with a BTW header.
+ * Unlike btw_read_metadata_n it can't tell whether the rest of the stream
+ * is there.
+ */
+int btw_probe(const unsigned char *data, unsigned long long len,
+		btw_def *def);
 
-#define BTW_BLOCK_SIZE 512
-#define BTW_HEADER_SIZE 20
+/* Bytes of the longest header */
+#define BTW_PROBE_SIZE 28
 
-#define BTW_MAGIC \
-	(((unsigned int)'b') | ((unsigned int)'t') << 8 | \
-	 ((unsigned int)'w') <<	16 | ((unsigned int)'f' << 24))
+/*
+ * Decode len bytes of data without keeping the samples, returning BTW_OK if
+ * it is a whole stream that passes its checksums, BTW_ERR_CORRUPT if not
+ * or BTW_ERR_NOMEM. Streams written without checksums are only checked to
+ * decode.
+ */
+int btw_verify_n(const unsigned char *data, unsigned long long len);
 
-static long long
-BTW_abs(long long number)
-{
-	return number >= 0 ? number : number * -1;
-}
+/*
+ * A thread pool supplied by the caller. run must call fn(arg, i) for every
+ * i below count, on any threads and in any order, and return once they
+ * have all finished.
+ */
+typedef void (*btw_task_fn)(void *arg, unsigned int index);
 
-static int
-bits_required(long long number)
-{
-	uint8_t r = 0;
-	while (number >>= 1)
-		r++;
+typedef struct {
+	void (*run)(void *pool, btw_task_fn fn, void *arg, unsigned int count);
+	void *pool;
+} btw_thread_pool;
 
-	return r;
-}
+/*
+ * Encode like btw_encode, splitting the blocks into "threads" groups that
+ * are encoded in parallel, 0 meaning one per CPU. The groups run on pool
+ * when it isn't NULL, otherwise a thread is started for each. The output is
+ * the same as btw_encode's.
+ */
+unsigned char *btw_encode_mt(btw_sample_fmt *samples, btw_def *def,
+		unsigned int threads, const btw_thread_pool *pool,
+		unsigned long long *out_len);
 
-static void
-put_bit(unsigned char *output, unsigned long long *out_pos,
-		int *bit_pos, unsigned char bit)
-{
-	output[*out_pos] |= (bit << *bit_pos) & 0xff;
+/*
+ * Decode like btw_decode, with "threads" groups of seek table entries
+ * decoded in parallel, 0 meaning one per CPU. pool is used as for
+ * btw_encode_mt. Files without a seek table are decoded on the caller.
+ */
+btw_sample_fmt *btw_decode_mt(const unsigned char *data, btw_def *def,
+		unsigned int threads, const btw_thread_pool *pool,
+		unsigned long long *out_len);
 
-	*bit_pos = (*bit_pos + 1) % 8;
-	*out_pos += !(*bit_pos);
-}
+/* One clip of a batch for btw_encode_batch or btw_decode_batch */
+typedef struct {
+	const void *samples;	/* Interleaved samples to encode */
+	btw_format fmt;		/* Of samples, or to decode to */
+	btw_def def;		/* Checked with defaults filled in */
+	unsigned long long offset, len;	/* Of the clip's stream in the arena */
+	void *decoded;		/* The decoded samples */
+	int result;		/* A btw_error */
+} btw_batch_item;
 
-static void
-put_number(unsigned char *output, unsigned long long *out_pos,
-		int *bit_pos, unsigned char bits, int64_t number)
-{
-	unsigned char cast;
+/*
+ * Encode count clips into one arena of *arena_len bytes to free, which is
+ * NULL only when out of memory. Each item gets the offset and len of its
+ * stream, or a result other than BTW_OK and a len of 0. The clips are split
+ * into runs of about the same number of samples that are each encoded in
+ * turn, reusing one scratch, on up to "threads" threads, 0 meaning one per
+ * CPU. pool is used as for btw_encode_mt.
+ */
+unsigned char *btw_encode_batch(btw_batch_item *items, unsigned int count,
+		unsigned int threads, const btw_thread_pool *pool,
+		unsigned long long *arena_len);
 
-	if (bits > (8 - *bit_pos)) {
+/*
+ * Decode the streams at each item's offset and len in arena to its fmt, as
+ * btw_encode_batch left them, split across threads the same way. Returns
+ * one block to free holding every clip's samples, 8-byte aligned, with
+ * each item's decoded pointing at them and def read from its header, or
+ * NULL when out of memory. Items whose result isn't BTW_OK get no samples.
+ */
+void *btw_decode_batch(const unsigned char *arena, btw_batch_item *items,
+		unsigned int count, unsigned int threads,
+		const btw_thread_pool *pool);
 
-		cast = number & (0xff >> (*bit_pos));
-		output[(*out_pos)++] |= (cast << *bit_pos) & 0xff;
-		bits -= (8 - *bit_pos);
-		number >>= (8 - *bit_pos);
+/*
+ * Decode count samples per channel starting at first_sample into out, which
+ * must hold count * channels samples. Files with a seek table start from its
+ * nearest entry instead of the first block. Returns the number of samples
+ * per channel decoded, or 0 on error.
+ */
+unsigned long long btw_decode_range(const unsigned char *data, btw_def *def,
+		unsigned long long first_sample, unsigned long long count,
+		btw_sample_fmt *out);
 
-		*bit_pos = 0;
+/* sample_count of a stream whose length wasn't known when it was written */
+#define BTW_UNKNOWN_COUNT (~0ULL)
 
-		while (bits >= 8) {
-			cast = number & 0xff;
-			output[(*out_pos)++] = cast;
-			bits -= 8;
-			number >>= 8;
-		}
-	}
+/*
+ * Receives the output of a streaming encoder: len bytes to be stored at
+ * offset. Writes come in order, except that seek table entries and, at the
+ * end, the header are written back over earlier bytes. Return 0 on success.
+ */
+typedef int (*btw_write_fn)(void *user, unsigned long long offset,
+		const unsigned char *data, unsigned long long len);
 
-	if (bits) {
-		cast = number & (0xff >> (8 - bits));
-		output[*out_pos] |= cast << *bit_pos;
+typedef struct btw_encoder btw_encoder;
 
-		*bit_pos = (*bit_pos + bits) % 8;
-		*out_pos += (*bit_pos == 0);
-	}
-}
+/*
+ * Start a streaming encoder which keeps at most one block in memory.
+ * When def->sample_count is set, exactly that many samples per channel must
+ * be fed and a seek table is written. When it is 0 there is no seek table,
+ * each block is written once the next sample is fed and the last one is
+ * marked as such. The header says BTW_UNKNOWN_COUNT until
+ * btw_encoder_finish rewrites it, which sinks that can't seek back may
+ * fail without failing the stream: decoders then find the length from the
+ * blocks.
+ */
+btw_encoder *btw_encoder_init(const btw_def *def, btw_write_fn write,
+		void *user);
 
-static void
-put_ones(unsigned char *output, unsigned long long *out_pos,
-		int *bit_pos, unsigned int ones)
-{
-	if (ones > (8 - *bit_pos)) {
+/* Feed count interleaved samples per channel, return 0 on success */
+int btw_encoder_feed(btw_encoder *enc, const btw_sample_fmt *samples,
+		unsigned long long count);
 
-		output[(*out_pos)++] |= (0xff << *bit_pos) & 0xff;
+/* Write the last block, free enc and return 0 if everything was written */
+int btw_encoder_finish(btw_encoder *enc, unsigned long long *out_len);
 
-		ones -= (8 - *bit_pos);
-		*bit_pos = 0;
+/*
+ * Supplies input to a streaming decoder: read up to len bytes into buf and
+ * return how many, 0 at the end of the input or -1 on error.
+ */
+typedef long long (*btw_read_fn)(void *user, unsigned char *buf,
+		unsigned long long len);
 
-		while (ones >= 8) {
+typedef struct btw_decoder btw_decoder;
 
-			output[(*out_pos)++] = 0xff;
+/*
+ * Start a streaming decoder. It pulls input through read, or when read is
+ * NULL, is given it with btw_decoder_push. It buffers about one block of
+ * input and of samples, and after the header is read only allocates when
+ * a block is bigger than any before it.
+ */
+btw_decoder *btw_decoder_init(btw_read_fn read, void *user);
 
-			ones -= 8;
-		}
-	}
+/* Add input, a NULL data marks its end. Returns 0 on success */
+int btw_decoder_push(btw_decoder *dec, const unsigned char *data,
+		unsigned long long len);
 
-	if (ones) {
-		output[*out_pos] |= ((0xff >> (8 - ones)) << *bit_pos) & 0xff;
+/*
+ * Fill def from the header. Returns 0 on success, 1 if more input must be
+ * pushed first or -1 on error. def->sample_count is BTW_UNKNOWN_COUNT for
+ * streams written without knowing their length, which end with their last
+ * block or where the input ends after a whole block.
+ */
+int btw_decoder_info(btw_decoder *dec, btw_def *def);
 
-		*bit_pos = (*bit_pos + ones) % 8;
-		*out_pos += (*bit_pos == 0);
-	}
+/*
+ * Decode up to "frames" samples per channel into out. Returns how many were
+ * decoded, which is less at the end of the stream or when more input must
+ * be pushed, or -1 on error.
+ */
+long long btw_decoder_read(btw_decoder *dec, btw_sample_fmt *out,
+		unsigned long long frames);
 
-}
+void btw_decoder_free(btw_decoder *dec);
 
-static unsigned char
-grab_bit(const unsigned char *input, unsigned long long *in_pos,
-		int *bit_pos)
-{
-	int r = (input[*in_pos] >> *bit_pos) & 1;
-	*bit_pos = (*bit_pos + 1) % 8;
-	*in_pos += !(*bit_pos);
-	return r;
-}
+/*
+ * The functions above with samples in fmt. Wherever they take or return
+ * btw_sample_fmt, these take or return fmt, and the streaming encoder and
+ * decoder they start are fed and read in fmt too.
+ */
+unsigned char *btw_encode_fmt(const void *samples, btw_format fmt,
+		const btw_def *def, unsigned long long *out_len);
 
-static long long
-grab_number(const unsigned char *input, unsigned long long *in_pos,
-		int *bit_pos, int bits)
-{
-	long long r = 0;
-	int tally = 0;
+void *btw_decode_fmt(const unsigned char *data, btw_format fmt,
+		btw_def *def, unsigned long long *out_len);
 
-	if (bits > (8 - *bit_pos)) {
+unsigned char *btw_encode_mt_fmt(const void *samples, btw_format fmt,
+		const btw_def *def, unsigned int threads,
+		const btw_thread_pool *pool, unsigned long long *out_len);
 
-		r = (input[(*in_pos)++] >> *bit_pos);
+void *btw_decode_mt_fmt(const unsigned char *data, btw_format fmt,
+		btw_def *def, unsigned int threads, const btw_thread_pool *pool,
+		unsigned long long *out_len);
 
-		bits -= (8 - *bit_pos);
-		tally = (8 - *bit_pos);
+unsigned long long btw_decode_range_fmt(const unsigned char *data,
+		btw_format fmt, btw_def *def, unsigned long long first_sample,
+		unsigned long long count, void *out);
 
-		*bit_pos = 0;
+btw_encoder *btw_encoder_init_fmt(const btw_def *def, btw_format fmt,
+		btw_write_fn write, void *user);
 
-		while (bits >= 8) {
-			r |= input[(*in_pos)++] << tally;
+btw_decoder *btw_decoder_init_fmt(btw_format fmt, btw_read_fn read,
+		void *user);
 
-			tally += 8;
-			bits -= 8;
-		}
-	}
+/*
+ * The whole-buffer _fmt functions with each channel in its own buffer,
+ * planes[chan], instead of interleaved. The _planar decoders return one
+ * allocation, freed with free(), holding the channel pointers followed by
+ * the samples.
+ */
+unsigned char *btw_encode_planar(const void *const *planes, btw_format fmt,
+		const btw_def *def, unsigned long long *out_len);
 
-	if (bits) {
-		r |= ((input[*in_pos] >> *bit_pos) & (0xff >> (8 - bits))) << tally;
-		*bit_pos = (*bit_pos + bits) % 8;
-		*in_pos += (*bit_pos == 0);
-	}
+void **btw_decode_planar(const unsigned char *data, btw_format fmt,
+		btw_def *def, unsigned long long *out_len);
 
-	return r;
-}
+unsigned char *btw_encode_mt_planar(const void *const *planes,
+		btw_format fmt, const btw_def *def, unsigned int threads,
+		const btw_thread_pool *pool, unsigned long long *out_len);
 
-unsigned char *
-btw_encode(btw_sample_fmt *samples, btw_def *def, unsigned long long *out_len)
-{
-	unsigned long long i = 0, rice_un;
-	unsigned int cap, l, k, chan;
-	int metadata_bit_pos = 0, rice_bit_pos = 0, rice_len;
-	long long diff, av_diff;
-	long long prev_sample, cur_sample;
-	long long max_len, metadata_pos = 0;
-	int bits_per_rice_len;
-	unsigned char *output = NULL;
-	*out_len = 0;
+void **btw_decode_mt_planar(const unsigned char *data, btw_format fmt,
+		btw_def *def, unsigned int threads, const btw_thread_pool *pool,
+		unsigned long long *out_len);
 
-	if (!out_len || !def || !samples || !def->channels
-			|| !def->sample_rate || !def->sample_count
-			|| !def->bits_per_sample) {
-		exit(EXIT_FAILURE);
-		return NULL;
-	}
-	bits_per_rice_len = bits_required(def->bits_per_sample);
+unsigned long long btw_decode_range_planar(const unsigned char *data,
+		btw_format fmt, btw_def *def, unsigned long long first_sample,
+		unsigned long long count, void *const *planes);
+
+/*
+ * Allocator for the scratch of the _into functions, which use malloc and
+ * free when it is NULL. free is never called with NULL.
+ */
+typedef struct {
+	void *(*alloc)(void *user, unsigned long long size);
+	void (*free)(void *user, void *p);
+	void *user;
+} btw_allocator;
 
-	max_len = ((def->channels * def->sample_count * def->bits_per_sample)
-		/ 8) + 1024;
-	output = calloc(max_len, sizeof(unsigned char));
+/*
+ * Bytes btw_encode_into may need for def, 0 if def can't be encoded. No file
+ * of samples fitting in bits_per_sample bits is longer.
+ */
+unsigned long long btw_max_encoded_size(const btw_def *def);
 
-	put_number(output, &metadata_pos, &metadata_bit_pos, 32, BTW_MAGIC);
+/* Fill def and return the bytes data decodes to in fmt, 0 on error */
+unsigned long long btw_decoded_size(const unsigned char *data,
+		btw_format fmt, btw_def *def);
 
-	put_number(output, &metadata_pos, &metadata_bit_pos, 64, def->sample_count);
-	put_number(output, &metadata_pos, &metadata_bit_pos, 16, def->channels);
-	put_number(output, &metadata_pos, &metadata_bit_pos, 16,
-			def->bits_per_sample);
-	put_number(output, &metadata_pos, &metadata_bit_pos, 32, def->sample_rate);
+/*
+ * btw_encode_fmt and btw_decode_fmt writing into the out_size bytes of out
+ * instead of allocating the output. Only scratch of a few blocks is
+ * allocated, through alloc. Returns BTW_OK or a btw_error.
+ */
+int btw_encode_into(const void *samples, btw_format fmt, const btw_def *def,
+		unsigned char *out, unsigned long long out_size,
+		unsigned long long *out_len, const btw_allocator *alloc);
 
-	*out_len = metadata_pos;
+int btw_decode_into(const unsigned char *data, btw_format fmt, btw_def *def,
+		void *out, unsigned long long out_size,
+		unsigned long long *out_len, const btw_allocator *alloc);
 
-	while (i < def->sample_count) {
+/*
+ * btw_decode_into for len bytes of data, which it never reads past, like
+ * btw_decode_n. A truncated or corrupt stream returns BTW_ERR_CORRUPT.
+ */
+int btw_decode_into_n(const unsigned char *data, unsigned long long len,
+		btw_format fmt, btw_def *def, void *out,
+		unsigned long long out_size, unsigned long long *out_len,
+		const btw_allocator *alloc);
 
+#ifdef BTW_STATS
+/*
+ * What encoding and decoding add up while attached with btw_stats_attach.
+ * Cycles are ticks of the CPU's cycle counter, 0 where there isn't one.
+ */
+typedef struct {
+	/* Bits written by the encoder, by field */
+	unsigned long long header_bits;		/* Header, seek table and file
+						   check */
+	unsigned long long piece_bits;		/* Split, stereo, order,
+						   partition order, constant
+						   and verbatim values,
+						   padding, block check */
+	unsigned long long rice_len_bits;
+	unsigned long long unary_bits;		/* Each run and its end */
+	unsigned long long remainder_bits;
+	unsigned long long rice_len_count[32];	/* Partitions coded with each
+						   rice_len */
+	unsigned long long escaped_codes;	/* Residuals coded with their
+						   whole magnitude */
+	unsigned long long constant_channels;	/* Coded as one value */
+	unsigned long long verbatim_channels;
+	unsigned long long encoded_samples;
+	unsigned long long analysis_cycles;	/* Widening, choosing
+						   predictors, stereo,
+						   splits, rice_len */
+	unsigned long long emission_cycles;	/* Writing the codes */
 
-		if (def->sample_count - i < BTW_BLOCK_SIZE) {
-			cap = def->sample_count - i;
-		} else {
-			cap = BTW_BLOCK_SIZE;
-		}
+	unsigned long long decoded_samples;
+	unsigned long long exact_reads;		/* Residuals read a byte at a
+						   time, near the end or for
+						   long runs */
+	unsigned long long read_cycles;		/* Reading residuals */
+	unsigned long long restore_cycles;	/* Everything else: fields,
+						   prediction, stereo, output */
+} btw_stats;
 
-		for (chan = 0; chan < def->channels; chan++) {
+/*
+ * Add the counts of every encode and decode the calling thread starts from
+ * now on to stats, or stop counting when it is NULL. Each thread attaches
+ * its own, and the _mt functions count their workers into the caller's.
+ * Calls running at once on several threads must not share stats.
+ */
+void btw_stats_attach(btw_stats *stats);
+#endif
 
-			prev_sample = av_diff = 0;
+typedef struct btw_file btw_file;
 
-			for (l = 0; l < cap; l++) {
-				cur_sample = samples[(i + l) * def->channels
-					+ chan];
+/*
+ * Map the BTW file at path and read its header into def, return NULL if it
+ * can't be opened or isn't a BTW file. The samples are only read from disk
+ * as they are decoded.
+ */
+btw_file *btw_open_file(const char *path, btw_def *def);
 
-				diff = cur_sample - prev_sample;
-				av_diff += BTW_abs(diff);
+/*
+ * The file's size bytes, which can be given to any function taking data.
+ * They stay valid until btw_close_file.
+ */
+const unsigned char *btw_map(const btw_file *file, unsigned long long *size);
 
-				prev_sample = cur_sample;
-			}
+/*
+ * btw_decode_fmt and btw_decode_range_fmt from file, checked like
+ * btw_decode_n against its end. They tell the OS the whole file will be
+ * read in order, or from the seek table, which bytes the range needs.
+ */
+void *btw_file_decode(btw_file *file, btw_format fmt,
+		unsigned long long *out_len);
 
-			rice_len = bits_required(av_diff / BTW_BLOCK_SIZE);
+unsigned long long btw_file_decode_range(btw_file *file, btw_format fmt,
+		unsigned long long first_sample, unsigned long long count,
+		void *out);
 
-			put_number(output, out_len, &rice_bit_pos,
-				bits_per_rice_len, rice_len);
+void btw_close_file(btw_file *file);
 
-			prev_sample = 0;
-			for (l = 0; l < cap; l++) {
-				cur_sample = samples[(i + l) * def->channels
-					+ chan];
-				diff = cur_sample - prev_sample;
-				put_bit(output, out_len, &rice_bit_pos, diff
-					< 0);
+/*
+ * btw_probe the count files at paths into defs, reading only their first
+ * BTW_PROBE_SIZE bytes, on up to "threads" threads, 0 for one per CPU.
+ * Each file's result goes to results: BTW_OK, BTW_ERR_IO or
+ * BTW_ERR_CORRUPT. Returns how many were BTW files.
+ */
+unsigned int btw_probe_files(const char *const *paths, unsigned int count,
+		unsigned int threads, btw_def *defs, int *results);
 
-				diff = BTW_abs(diff);
+/*
+ * Transcode a WAV file of 8, 16, 24 or 32-bit PCM, RIFF or RF64, read from
+ * in into a stream written to out, with the block sizes of def or the
+ * defaults when it is NULL. Samples are read a chunk at a time: while
+ * "threads" groups of blocks of one chunk are encoded, 0 meaning one per
+ * CPU, the previous chunk is written and the next one read on another
+ * task. pool is used as for btw_encode_mt. Writes come in order, except
+ * that the seek table is written back at the end. Returns BTW_OK,
+ * BTW_ERR_IO when read or write fail, BTW_ERR_CORRUPT when the input isn't
+ * such a WAV file, BTW_ERR_INVALID for bad block sizes or a data size of 0
+ * or, as writers that can't seek back leave RIFF files, 0xffffffff, or
+ * BTW_ERR_NOMEM.
+ */
+int btw_wav_encode(btw_read_fn read, void *in, btw_write_fn write, void *out,
+		const btw_def *def, unsigned int threads,
+		const btw_thread_pool *pool);
 
-				rice_un = diff >> rice_len;
-				put_ones(output, out_len, &rice_bit_pos,
-					rice_un);
-				put_bit(output, out_len, &rice_bit_pos, 0);
+/*
+ * Transcode the stream in len bytes of data to a WAV file written to out in
+ * order, RF64 when it is too big for RIFF, each sample in the bytes
+ * bits_per_sample needs. Seek table entries are decoded in "threads"
+ * groups as for btw_decode_mt while the previous chunk is written. Returns
+ * BTW_OK, BTW_ERR_IO when write fails or BTW_ERR_CORRUPT, possibly after
+ * part of the output is written, or BTW_ERR_NOMEM.
+ */
+int btw_wav_decode(const unsigned char *data, unsigned long long len,
+		btw_write_fn write, void *out, unsigned int threads,
+		const btw_thread_pool *pool);
 
-				put_number(output, out_len, &rice_bit_pos,
-					rice_len, diff);
+/* btw_encode_fmt and btw_decode_fmt for each format */
+unsigned char *btw_encode_u8(const uint8_t *samples, const btw_def *def,
+		unsigned long long *out_len);
+unsigned char *btw_encode_s16(const int16_t *samples, const btw_def *def,
+		unsigned long long *out_len);
+unsigned char *btw_encode_s24_packed(const unsigned char *samples,
+		const btw_def *def, unsigned long long *out_len);
+unsigned char *btw_encode_s32(const int32_t *samples, const btw_def *def,
+		unsigned long long *out_len);
 
-				prev_sample = cur_sample;
-			}
-		}
-		i += cap;
-	}
+uint8_t *btw_decode_u8(const unsigned char *data, btw_def *def,
+		unsigned long long *out_len);
+int16_t *btw_decode_s16(const unsigned char *data, btw_def *def,
+		unsigned long long *out_len);
+unsigned char *btw_decode_s24_packed(const unsigned char *data,
+		btw_def *def, unsigned long long *out_len);
+int32_t *btw_decode_s32(const unsigned char *data, btw_def *def,
+		unsigned long long *out_len);
+float *btw_decode_f32(const unsigned char *data, btw_def *def,
+		unsigned long long *out_len);
 
-	if (rice_bit_pos) {
-		(*out_len)++;
-	}
-	return output;
+#ifdef __cplusplus
 }
+#endif
 
-void
-btw_read_metadata(const unsigned char *data, btw_def *def)
-{
+#endif /* BTW_H */
 
-	if (!def || !data) {
-		return;
-	}
+#ifdef BTW_IMPLEMENTATION
+#include <stdlib.h>
+#include <string.h>
 
-	if (data[0] != 'b' || data[1] != 't' || data[2] != 'w' || data[3] != 'f') {
-		return;
-	}
-	unsigned long long metadata_pos = 4;
-	int metadata_bit_pos = 0;
+#ifdef _WIN32
+#if !defined(BTW_NO_THREADS) || !defined(BTW_NO_MMAP)
+#include <windows.h>
+#endif
+#else
+#include <unistd.h>
+#ifndef BTW_NO_THREADS
+#include <pthread.h>
+#endif
+#ifndef BTW_NO_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#endif
 
+#ifdef BTW_NO_MMAP
+#include <stdio.h>
+#endif
 
-	def->sample_count
-		= grab_number(data, &metadata_pos, &metadata_bit_pos, 64);
-	def->channels
-		= grab_number(data, &metadata_pos, &metadata_bit_pos, 16);
-	def->bits_per_sample
-		= grab_number(data, &metadata_pos, &metadata_bit_pos, 16);
-	def->sample_rate
-		= grab_number(data, &metadata_pos, &metadata_bit_pos, 32);
-}
+#ifndef BTW_NO_SIMD
+#if (defined(__GNUC__) || defined(__clang__)) \
+	&& (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BTW_AVX2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#ifdef __ARM_FEATURE_CRC32
+#include <arm_acle.h>
+#endif
+#define BTW_NEON
+#endif
+#endif
 
-btw_sample_fmt *
-btw_decode(const unsigned char *data, btw_def *def, unsigned long long *out_len)
-{
-	unsigned long long i = 0, in_pos = 20, cap;
-	unsigned int j, chan;
-	int bit_pos = 0, rice_len, sign, bits_per_rice_len;
-	long long diff, prev_sample;
-	btw_sample_fmt *output = NULL;
-	if (!def || !out_len || !data) {
-		return NULL;
-	}
+#if defined(BTW_U8)
+#define BTW_NATIVE_FMT BTW_FMT_U8
+#elif defined(BTW_S16)
+#define BTW_NATIVE_FMT BTW_FMT_S16
+#elif defined(BTW_S32)
+#define BTW_NATIVE_FMT BTW_FMT_S32
+#endif
 
-	btw_read_metadata(data, def);
+#define BTW_BLOCK_SIZE 512
+#define BTW_HEADER_SIZE BTW_PROBE_SIZE
+#define BTW_VERSION 2
 
-	if (!def->channels || !def->sample_rate || !def->sample_count
-		|| !def->bits_per_sample) {
-		return NULL;
-	}
-	output = (btw_sample_fmt *)malloc(def->sample_count * def->channels * sizeof(btw_sample_fmt));
-	bits_per_rice_len = bits_required(def->bits_per_sample);
+/* Without BTW_FLAG_BLOCK_SIZE the header ends after seek_interval */
+#define BTW_HEADER_SIZE_FIXED 24
 
-	*out_len = 0;
+/* Version 1 files have a shorter header and 'f' in place of the version */
+#define BTW_HEADER_SIZE_V1 20
+#define BTW_VERSION_V1 'f'
 
-	while (i < def->sample_count) {
-		if (def->sample_count - i < BTW_BLOCK_SIZE) {
-			cap = (def->sample_count - i);
-		} else {
-			cap = BTW_BLOCK_SIZE;
-		}
-		for (chan = 0; chan < def->channels; chan++) {
-			rice_len = grab_number(data, &in_pos, &bit_pos, bits_per_rice_len);
+/* Each channel of a block starts with its predictor order */
+#define BTW_FLAG_PREDICTOR 0x1
+/* Blocks of two-channel files start with their stereo mode */
+#define BTW_FLAG_STEREO 0x2
+/* Channels are split into partitions, each with its own rice_len */
+#define BTW_FLAG_PARTITIONED 0x4
+/* The header holds the block sizes and blocks may be split */
+#define BTW_FLAG_BLOCK_SIZE 0x8
+/* Channels may be coded as one value with BTW_ORDER_CONSTANT */
+#define BTW_FLAG_CONSTANT 0x10
+/* Rice codes escape long runs, channels may be BTW_ORDER_VERBATIM */
+#define BTW_FLAG_ESCAPE 0x20
+/* Residuals are folded to unsigned instead of having a sign bit */
+#define BTW_FLAG_ZIGZAG 0x40
+/* Blocks and the file end in checksums */
+#define BTW_FLAG_CRC 0x80
+/* Blocks start with whether they are the last, for streams of no length */
+#define BTW_FLAG_OPEN 0x100
+/* Verbatim and constant values of channels but side ones fit the samples */
+#define BTW_FLAG_NARROW 0x200
+/* Those values are unsigned, for streams of BTW_FMT_U8 samples */
+#define BTW_FLAG_UNSIGNED 0x400
+/* Flags this implementation reads */
+#define BTW_FLAGS (BTW_FLAG_PREDICTOR | BTW_FLAG_STEREO \
+	| BTW_FLAG_PARTITIONED | BTW_FLAG_BLOCK_SIZE | BTW_FLAG_CONSTANT \
+	| BTW_FLAG_ESCAPE | BTW_FLAG_ZIGZAG | BTW_FLAG_CRC | BTW_FLAG_OPEN \
+	| BTW_FLAG_NARROW | BTW_FLAG_UNSIGNED)
 
-			prev_sample = 0;
-			for (j = 0; j < cap; j++) {
-				diff = 0;
-				/* Is the diff negative? */
-				sign = grab_bit(data, &in_pos, &bit_pos);
+/* Checksums of each block and of the whole file, 0 leaves them out */
+#ifndef BTW_CHECKSUMS
+#define BTW_CHECKSUMS 1
+#endif
 
-				/* Read unary portion of rice */
-				while (grab_bit(data, &in_pos, &bit_pos)) {
-					diff += 1 << rice_len;
-				}
+/*
+ * Flags this implementation writes, and BTW_FLAG_OPEN and BTW_FLAG_UNSIGNED
+ * when it must
+ */
+#if BTW_CHECKSUMS
+#define BTW_WRITE_FLAGS (BTW_FLAGS & ~BTW_FLAG_OPEN & ~BTW_FLAG_UNSIGNED)
+#else
+#define BTW_WRITE_FLAGS (BTW_FLAGS & ~BTW_FLAG_OPEN & ~BTW_FLAG_UNSIGNED \
+	& ~BTW_FLAG_CRC)
+#endif
 
-				/* Grab the remaining bits */
-				diff |= grab_number(data, &in_pos, &bit_pos, rice_len);
+#define BTW_BLOCK_CHECK_BITS 16
+#define BTW_FILE_CHECK_BITS 32
+#define BTW_LAST_BLOCK_BITS 16
 
-				if (sign) {
-					diff *= -1;
-				}
+/* How encode_blocks starts blocks */
+#define BTW_MARK_NONE 0		/* Without BTW_FLAG_OPEN */
+#define BTW_MARK_MORE 1		/* As not the last */
+#define BTW_MARK_LAST 2		/* The one ending sample_count as the last */
 
-				prev_sample = output[(i + j) * def->channels + chan] = prev_sample + diff;
-				(*out_len)++;
-			}
-		}
-		i += cap;
-		in_pos += (bit_pos != 0);
-		bit_pos = 0;
+#define BTW_MAX_ORDER 4
+#define BTW_ORDER_BITS 3
+#define BTW_ORDER_VERBATIM 6
+#define BTW_ORDER_CONSTANT 7
+
+/* Ones of a unary run that escape to the whole magnitude */
+#define BTW_ESCAPE_RUN 16
+
+/* The two channels coded for each stereo mode */
+#define BTW_STEREO_LR 0		/* left, right */
+#define BTW_STEREO_LS 1		/* left, side */
+#define BTW_STEREO_SR 2		/* side, right */
+#define BTW_STEREO_MS 3		/* mid, side */
+#define BTW_STEREO_BITS 2
+
+#define BTW_PARTITION_BITS 3
+
+/* Blocks per seek table entry, 0 leaves the table out */
+#ifndef BTW_SEEK_INTERVAL
+#define BTW_SEEK_INTERVAL 16
+#endif
+
+/* Highest partition order the encoder tries, 0 for one rice_len a channel */
+#ifndef BTW_PARTITION_ORDER
+#define BTW_PARTITION_ORDER 4
+#endif
+#if BTW_PARTITION_ORDER >= (1 << BTW_PARTITION_BITS)
+#error "BTW_PARTITION_ORDER does not fit its field"
+#endif
+
+#define BTW_MAGIC \
+	(((unsigned int)'b') | ((unsigned int)'t') << 8 | \
+	 ((unsigned int)'w') <<	16 | ((unsigned int)BTW_VERSION << 24))
+
+static long long
+BTW_abs(long long number)
+{
+	return number >= 0 ? number : number * -1;
+}
+
+static int
+bits_required(long long number)
+{
+	uint8_t r = 0;
+	while (number >>= 1)
+		r++;
+
+	return r;
+}
+
+/*
+ * Fixed polynomial prediction of the next sample from the previous ones,
+ * h[0] being the latest. Blocks are self-contained, so the first samples of
+ * a block are predicted with order j for sample j until order is reached.
+ */
+static uint64_t
+fixed_prediction(const uint64_t *h, unsigned int order)
+{
+	switch (order) {
+	case 1:
+		return h[0];
+	case 2:
+		return 2 * h[0] - h[1];
+	case 3:
+		return 3 * h[0] - 3 * h[1] + h[2];
+	case 4:
+		return 4 * h[0] - 6 * h[1] + 4 * h[2] - h[3];
 	}
-	return output;
+	return 0;
+}
+
+/*
+ * Advance d from the residuals of every order for the previous sample to
+ * the residuals for x, sample l of its block. Order k's residual is the
+ * k-th difference, which needs k samples before it in the block.
+ */
+static void
+fixed_residuals(long long *d, long long x, unsigned int l)
+{
+	long long d1 = x - (l > 0 ? d[0] : 0);
+	long long d2 = d1 - (l > 1 ? d[1] : 0);
+	long long d3 = d2 - (l > 2 ? d[2] : 0);
+
+	d[4] = d3 - (l > 3 ? d[3] : 0);
+	d[3] = d3;
+	d[2] = d2;
+	d[1] = d1;
+	d[0] = x;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ \
+	|| defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM64)
+#define BTW_LITTLE_ENDIAN
+#endif
+
+static void
+store_le64(unsigned char *p, uint64_t v)
+{
+#ifdef BTW_LITTLE_ENDIAN
+	memcpy(p, &v, sizeof(v));
+#else
+	int b;
+	for (b = 0; b < 8; b++) {
+		p[b] = (v >> (b * 8)) & 0xff;
+	}
+#endif
+}
+
+#ifdef BTW_STATS
+#if defined(__GNUC__) || defined(__clang__)
+#define BTW_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define BTW_THREAD_LOCAL __declspec(thread)
+#elif defined(__cplusplus) && __cplusplus >= 201103L
+#define BTW_THREAD_LOCAL thread_local
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define BTW_THREAD_LOCAL _Thread_local
+#else
+#define BTW_THREAD_LOCAL
+#endif
+
+static BTW_THREAD_LOCAL btw_stats *attached_stats;
+
+void
+btw_stats_attach(btw_stats *stats)
+{
+	attached_stats = stats;
+}
+
+static uint64_t
+stat_ticks(void)
+{
+#if (defined(__GNUC__) || defined(__clang__)) \
+		&& (defined(__x86_64__) || defined(__i386__))
+	return __builtin_ia32_rdtsc();
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+	uint64_t t;
+
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(t));
+	return t;
+#else
+	return 0;
+#endif
+}
+
+/* Add the counts of from to to */
+static void
+stats_add(btw_stats *to, const btw_stats *from)
+{
+	const unsigned long long *p = (const unsigned long long *)from;
+	unsigned long long *q = (unsigned long long *)to;
+	unsigned int j;
+
+	/* btw_stats is nothing but unsigned long longs */
+	for (j = 0; j < sizeof(*to) / sizeof(*q); j++) {
+		q[j] += p[j];
+	}
+}
+
+/* Bits the encoder has counted by field in the codes of channels */
+static unsigned long long
+stats_coded_bits(const btw_stats *s)
+{
+	return s->rice_len_bits + s->unary_bits + s->remainder_bits;
+}
+
+/* Where the counts of a block stood when it was started */
+typedef struct {
+	uint64_t ticks;
+	unsigned long long emission_cycles;
+	unsigned long long pos;	/* In bits */
+	unsigned long long coded_bits;
+} btw_stats_mark;
+#endif
+
+/*
+ * Bits are packed LSB first into a 64-bit accumulator which is written out
+ * a whole word at a time. Only completed bytes are retired on a flush.
+ * Within 8 bytes of the end of out, bytes are stored one at a time, and
+ * overflow is set once a bit doesn't fit. bw_put_fast and bw_put_rice
+ * skip that check and are only used once bw_room has found space.
+ */
+typedef struct {
+	unsigned char *out;
+	unsigned long long size;	/* Bytes of out */
+	unsigned long long pos;	/* Byte the accumulator is flushed to */
+	uint64_t acc;
+	unsigned int bits;	/* Bits pending in acc */
+	int overflow;
+#ifdef BTW_STATS
+	btw_stats *stats;	/* Where to count, NULL for nowhere */
+#endif
+} btw_writer;
+
+static void
+bw_init(btw_writer *bw, unsigned char *out, unsigned long long size,
+		unsigned long long pos)
+{
+	bw->out = out;
+	bw->size = size;
+	bw->pos = pos;
+	bw->acc = 0;
+	bw->bits = 0;
+	bw->overflow = 0;
+#ifdef BTW_STATS
+	bw->stats = attached_stats;
+#endif
+}
+
+/* Whether "bits" more bits can be appended with the _fast functions */
+static int
+bw_room(const btw_writer *bw, unsigned long long bits)
+{
+	return bw->pos + (bw->bits + bits + 7) / 8 + 8 <= bw->size;
+}
+
+static void
+bw_flush(btw_writer *bw)
+{
+	unsigned int b;
+
+	if (bw->pos + 8 <= bw->size) {
+		store_le64(bw->out + bw->pos, bw->acc);
+	} else {
+		for (b = 0; b < (bw->bits + 7) / 8; b++) {
+			if (bw->pos + b >= bw->size) {
+				bw->overflow = 1;
+				break;
+			}
+			bw->out[bw->pos + b] = (bw->acc >> (b * 8)) & 0xff;
+		}
+	}
+	bw->pos += bw->bits >> 3;
+	bw->acc >>= bw->bits & ~7u;
+	bw->bits &= 7;
+}
+
+/*
+ * Append the low "bits" bits of value, which must not have higher bits set.
+ * Every append ends in a flush, so less than 8 bits are ever left pending
+ * and up to 56 bits can be appended at once.
+ */
+static void
+bw_put(btw_writer *bw, uint64_t value, unsigned int bits)
+{
+	bw->acc |= value << bw->bits;
+	bw->bits += bits;
+	bw_flush(bw);
+}
+
+static void
+bw_put_fast(btw_writer *bw, uint64_t value, unsigned int bits)
+{
+	bw->acc |= value << bw->bits;
+	bw->bits += bits;
+	store_le64(bw->out + bw->pos, bw->acc);
+	bw->pos += bw->bits >> 3;
+	bw->acc >>= bw->bits & ~7u;
+	bw->bits &= 7;
+}
+
+/* Pad with zero bits to the next byte */
+static void
+bw_align(btw_writer *bw)
+{
+	bw->pos += (bw->bits != 0);
+	bw->acc = 0;
+	bw->bits = 0;
+}
+
+/* Return the number of bytes used in the output so far */
+static unsigned long long
+bw_finish(btw_writer *bw)
+{
+	return bw->pos + (bw->bits != 0);
+}
+
+/* Fold v to unsigned, 0, -1, 1, -2... going to 0, 1, 2, 3... */
+static uint64_t
+zigzag(long long v)
+{
+	return ((uint64_t)v << 1) ^ -(uint64_t)(v < 0);
+}
+
+/*
+ * The code of one residual, *len bits: its zigzag shifted right by rice_len
+ * in unary terminated by a zero, then the low rice_len bits. A quotient of
+ * BTW_ESCAPE_RUN or more is escaped, its ones followed by the zigzag in
+ * escape_bits bits. With rice_len below 32 and escape_bits below 41, codes
+ * are never longer than 56 bits and are appended in one go.
+ */
+static uint64_t
+rice_code(long long diff, int rice_len, int escape_bits, unsigned int *len)
+{
+	uint64_t u = zigzag(diff);
+	uint64_t rice_un = u >> rice_len;
+
+	if (rice_un < BTW_ESCAPE_RUN) {
+		*len = rice_un + 1 + rice_len;
+		return ((1ULL << rice_un) - 1)
+			| ((u & ((1ULL << rice_len) - 1)) << (rice_un + 1));
+	}
+	*len = BTW_ESCAPE_RUN + escape_bits;
+	return ((1ULL << BTW_ESCAPE_RUN) - 1)
+		| ((u & ((1ULL << escape_bits) - 1)) << BTW_ESCAPE_RUN);
+}
+
+static void
+bw_put_rice_slow(btw_writer *bw, long long diff, int rice_len,
+		int escape_bits)
+{
+	unsigned int len;
+	uint64_t code = rice_code(diff, rice_len, escape_bits, &len);
+
+	bw_put(bw, code, len);
+}
+
+/* Write one residual where bw_room allows */
+static void
+bw_put_rice(btw_writer *bw, long long diff, int rice_len, int escape_bits)
+{
+	unsigned int len;
+	uint64_t code = rice_code(diff, rice_len, escape_bits, &len);
+
+	bw_put_fast(bw, code, len);
+}
+
+static uint64_t
+load_le64(const unsigned char *p)
+{
+	uint64_t v;
+#ifdef BTW_LITTLE_ENDIAN
+	memcpy(&v, p, sizeof(v));
+#else
+	int b;
+	for (v = 0, b = 0; b < 8; b++) {
+		v |= (uint64_t)p[b] << (b * 8);
+	}
+#endif
+	return v;
+}
+
+static unsigned int
+load_le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t
+load_le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Number of trailing zero bits, v must not be zero */
+static unsigned int
+ctz64(uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctzll(v);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long r;
+	_BitScanForward64(&r, v);
+	return r;
+#else
+	unsigned int r = 0;
+	while (!(v & 1)) {
+		v >>= 1;
+		r++;
+	}
+	return r;
+#endif
+}
+
+/* Reflected polynomial of CRC-32C, which x86 and ARM have instructions for */
+#define BTW_CRC32C 0x82f63b78
+
+/* Slice-by-8 tables, crc_table[k][j] is the CRC of byte j and k zeros */
+static const uint32_t crc_table[8][256] = {
+	{
+		0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f,
+		0x35f1141c, 0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc,
+		0x6be22838, 0x9989ab3b, 0x4d43cfd0, 0xbf284cd3, 0xac78bf27,
+		0x5e133c24, 0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b,
+		0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384, 0x9a879fa0,
+		0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+		0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29,
+		0x33ed7d2a, 0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+		0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5, 0x6dfe410e,
+		0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa, 0x30e349b1, 0xc288cab2,
+		0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad, 0x1642ae59,
+		0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+		0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc,
+		0xb3109ebf, 0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0,
+		0x67dafa54, 0x95b17957, 0xcba24573, 0x39c9c670, 0x2a993584,
+		0xd8f2b687, 0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+		0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927, 0x96bf4dcc,
+		0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+		0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4,
+		0x0f36e6f7, 0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096,
+		0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789, 0xeb1fcbad,
+		0x197448ae, 0x0a24bb5a, 0xf84f3859, 0x2c855cb2, 0xdeeedfb1,
+		0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e, 0x90a324fa,
+		0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+		0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd,
+		0xceb018de, 0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b,
+		0x63cd4b8f, 0x91a6c88c, 0x456cac67, 0xb7072f64, 0xa457dc90,
+		0x563c5f93, 0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043,
+		0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c, 0x92a8fc17,
+		0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+		0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f,
+		0x0b21572c, 0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+		0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652, 0x65d122b9,
+		0x97baa1ba, 0x84ea524e, 0x7681d14d, 0x2892ed69, 0xdaf96e6a,
+		0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975, 0x0e330a81,
+		0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+		0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06,
+		0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a,
+		0x1e6dcdee, 0xec064eed, 0xc38d26c4, 0x31e6a5c7, 0x22b65633,
+		0xd0ddd530, 0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+		0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff, 0x8ecee914,
+		0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+		0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643,
+		0x07198540, 0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90,
+		0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a,
+		0x115b2b19, 0x020bd8ed, 0xf0605bee, 0x24aa3f05, 0xd6c1bc06,
+		0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6, 0x88d28022,
+		0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+		0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a,
+		0xc69f7b69, 0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9,
+		0x988c474d, 0x6ae7c44e, 0xbe2da0a5, 0x4c4623a6, 0x5f16d052,
+		0xad7d5351
+	},
+	{
+		0x00000000, 0x13a29877, 0x274530ee, 0x34e7a899, 0x4e8a61dc,
+		0x5d28f9ab, 0x69cf5132, 0x7a6dc945, 0x9d14c3b8, 0x8eb65bcf,
+		0xba51f356, 0xa9f36b21, 0xd39ea264, 0xc03c3a13, 0xf4db928a,
+		0xe7790afd, 0x3fc5f181, 0x2c6769f6, 0x1880c16f, 0x0b225918,
+		0x714f905d, 0x62ed082a, 0x560aa0b3, 0x45a838c4, 0xa2d13239,
+		0xb173aa4e, 0x859402d7, 0x96369aa0, 0xec5b53e5, 0xfff9cb92,
+		0xcb1e630b, 0xd8bcfb7c, 0x7f8be302, 0x6c297b75, 0x58ced3ec,
+		0x4b6c4b9b, 0x310182de, 0x22a31aa9, 0x1644b230, 0x05e62a47,
+		0xe29f20ba, 0xf13db8cd, 0xc5da1054, 0xd6788823, 0xac154166,
+		0xbfb7d911, 0x8b507188, 0x98f2e9ff, 0x404e1283, 0x53ec8af4,
+		0x670b226d, 0x74a9ba1a, 0x0ec4735f, 0x1d66eb28, 0x298143b1,
+		0x3a23dbc6, 0xdd5ad13b, 0xcef8494c, 0xfa1fe1d5, 0xe9bd79a2,
+		0x93d0b0e7, 0x80722890, 0xb4958009, 0xa737187e, 0xff17c604,
+		0xecb55e73, 0xd852f6ea, 0xcbf06e9d, 0xb19da7d8, 0xa23f3faf,
+		0x96d89736, 0x857a0f41, 0x620305bc, 0x71a19dcb, 0x45463552,
+		0x56e4ad25, 0x2c896460, 0x3f2bfc17, 0x0bcc548e, 0x186eccf9,
+		0xc0d23785, 0xd370aff2, 0xe797076b, 0xf4359f1c, 0x8e585659,
+		0x9dface2e, 0xa91d66b7, 0xbabffec0, 0x5dc6f43d, 0x4e646c4a,
+		0x7a83c4d3, 0x69215ca4, 0x134c95e1, 0x00ee0d96, 0x3409a50f,
+		0x27ab3d78, 0x809c2506, 0x933ebd71, 0xa7d915e8, 0xb47b8d9f,
+		0xce1644da, 0xddb4dcad, 0xe9537434, 0xfaf1ec43, 0x1d88e6be,
+		0x0e2a7ec9, 0x3acdd650, 0x296f4e27, 0x53028762, 0x40a01f15,
+		0x7447b78c, 0x67e52ffb, 0xbf59d487, 0xacfb4cf0, 0x981ce469,
+		0x8bbe7c1e, 0xf1d3b55b, 0xe2712d2c, 0xd69685b5, 0xc5341dc2,
+		0x224d173f, 0x31ef8f48, 0x050827d1, 0x16aabfa6, 0x6cc776e3,
+		0x7f65ee94, 0x4b82460d, 0x5820de7a, 0xfbc3faf9, 0xe861628e,
+		0xdc86ca17, 0xcf245260, 0xb5499b25, 0xa6eb0352, 0x920cabcb,
+		0x81ae33bc, 0x66d73941, 0x7575a136, 0x419209af, 0x523091d8,
+		0x285d589d, 0x3bffc0ea, 0x0f186873, 0x1cbaf004, 0xc4060b78,
+		0xd7a4930f, 0xe3433b96, 0xf0e1a3e1, 0x8a8c6aa4, 0x992ef2d3,
+		0xadc95a4a, 0xbe6bc23d, 0x5912c8c0, 0x4ab050b7, 0x7e57f82e,
+		0x6df56059, 0x1798a91c, 0x043a316b, 0x30dd99f2, 0x237f0185,
+		0x844819fb, 0x97ea818c, 0xa30d2915, 0xb0afb162, 0xcac27827,
+		0xd960e050, 0xed8748c9, 0xfe25d0be, 0x195cda43, 0x0afe4234,
+		0x3e19eaad, 0x2dbb72da, 0x57d6bb9f, 0x447423e8, 0x70938b71,
+		0x63311306, 0xbb8de87a, 0xa82f700d, 0x9cc8d894, 0x8f6a40e3,
+		0xf50789a6, 0xe6a511d1, 0xd242b948, 0xc1e0213f, 0x26992bc2,
+		0x353bb3b5, 0x01dc1b2c, 0x127e835b, 0x68134a1e, 0x7bb1d269,
+		0x4f567af0, 0x5cf4e287, 0x04d43cfd, 0x1776a48a, 0x23910c13,
+		0x30339464, 0x4a5e5d21, 0x59fcc556, 0x6d1b6dcf, 0x7eb9f5b8,
+		0x99c0ff45, 0x8a626732, 0xbe85cfab, 0xad2757dc, 0xd74a9e99,
+		0xc4e806ee, 0xf00fae77, 0xe3ad3600, 0x3b11cd7c, 0x28b3550b,
+		0x1c54fd92, 0x0ff665e5, 0x759baca0, 0x663934d7, 0x52de9c4e,
+		0x417c0439, 0xa6050ec4, 0xb5a796b3, 0x81403e2a, 0x92e2a65d,
+		0xe88f6f18, 0xfb2df76f, 0xcfca5ff6, 0xdc68c781, 0x7b5fdfff,
+		0x68fd4788, 0x5c1aef11, 0x4fb87766, 0x35d5be23, 0x26772654,
+		0x12908ecd, 0x013216ba, 0xe64b1c47, 0xf5e98430, 0xc10e2ca9,
+		0xd2acb4de, 0xa8c17d9b, 0xbb63e5ec, 0x8f844d75, 0x9c26d502,
+		0x449a2e7e, 0x5738b609, 0x63df1e90, 0x707d86e7, 0x0a104fa2,
+		0x19b2d7d5, 0x2d557f4c, 0x3ef7e73b, 0xd98eedc6, 0xca2c75b1,
+		0xfecbdd28, 0xed69455f, 0x97048c1a, 0x84a6146d, 0xb041bcf4,
+		0xa3e32483
+	},
+	{
+		0x00000000, 0xa541927e, 0x4f6f520d, 0xea2ec073, 0x9edea41a,
+		0x3b9f3664, 0xd1b1f617, 0x74f06469, 0x38513ec5, 0x9d10acbb,
+		0x773e6cc8, 0xd27ffeb6, 0xa68f9adf, 0x03ce08a1, 0xe9e0c8d2,
+		0x4ca15aac, 0x70a27d8a, 0xd5e3eff4, 0x3fcd2f87, 0x9a8cbdf9,
+		0xee7cd990, 0x4b3d4bee, 0xa1138b9d, 0x045219e3, 0x48f3434f,
+		0xedb2d131, 0x079c1142, 0xa2dd833c, 0xd62de755, 0x736c752b,
+		0x9942b558, 0x3c032726, 0xe144fb14, 0x4405696a, 0xae2ba919,
+		0x0b6a3b67, 0x7f9a5f0e, 0xdadbcd70, 0x30f50d03, 0x95b49f7d,
+		0xd915c5d1, 0x7c5457af, 0x967a97dc, 0x333b05a2, 0x47cb61cb,
+		0xe28af3b5, 0x08a433c6, 0xade5a1b8, 0x91e6869e, 0x34a714e0,
+		0xde89d493, 0x7bc846ed, 0x0f382284, 0xaa79b0fa, 0x40577089,
+		0xe516e2f7, 0xa9b7b85b, 0x0cf62a25, 0xe6d8ea56, 0x43997828,
+		0x37691c41, 0x92288e3f, 0x78064e4c, 0xdd47dc32, 0xc76580d9,
+		0x622412a7, 0x880ad2d4, 0x2d4b40aa, 0x59bb24c3, 0xfcfab6bd,
+		0x16d476ce, 0xb395e4b0, 0xff34be1c, 0x5a752c62, 0xb05bec11,
+		0x151a7e6f, 0x61ea1a06, 0xc4ab8878, 0x2e85480b, 0x8bc4da75,
+		0xb7c7fd53, 0x12866f2d, 0xf8a8af5e, 0x5de93d20, 0x29195949,
+		0x8c58cb37, 0x66760b44, 0xc337993a, 0x8f96c396, 0x2ad751e8,
+		0xc0f9919b, 0x65b803e5, 0x1148678c, 0xb409f5f2, 0x5e273581,
+		0xfb66a7ff, 0x26217bcd, 0x8360e9b3, 0x694e29c0, 0xcc0fbbbe,
+		0xb8ffdfd7, 0x1dbe4da9, 0xf7908dda, 0x52d11fa4, 0x1e704508,
+		0xbb31d776, 0x511f1705, 0xf45e857b, 0x80aee112, 0x25ef736c,
+		0xcfc1b31f, 0x6a802161, 0x56830647, 0xf3c29439, 0x19ec544a,
+		0xbcadc634, 0xc85da25d, 0x6d1c3023, 0x8732f050, 0x2273622e,
+		0x6ed23882, 0xcb93aafc, 0x21bd6a8f, 0x84fcf8f1, 0xf00c9c98,
+		0x554d0ee6, 0xbf63ce95, 0x1a225ceb, 0x8b277743, 0x2e66e53d,
+		0xc448254e, 0x6109b730, 0x15f9d359, 0xb0b84127, 0x5a968154,
+		0xffd7132a, 0xb3764986, 0x1637dbf8, 0xfc191b8b, 0x595889f5,
+		0x2da8ed9c, 0x88e97fe2, 0x62c7bf91, 0xc7862def, 0xfb850ac9,
+		0x5ec498b7, 0xb4ea58c4, 0x11abcaba, 0x655baed3, 0xc01a3cad,
+		0x2a34fcde, 0x8f756ea0, 0xc3d4340c, 0x6695a672, 0x8cbb6601,
+		0x29faf47f, 0x5d0a9016, 0xf84b0268, 0x1265c21b, 0xb7245065,
+		0x6a638c57, 0xcf221e29, 0x250cde5a, 0x804d4c24, 0xf4bd284d,
+		0x51fcba33, 0xbbd27a40, 0x1e93e83e, 0x5232b292, 0xf77320ec,
+		0x1d5de09f, 0xb81c72e1, 0xccec1688, 0x69ad84f6, 0x83834485,
+		0x26c2d6fb, 0x1ac1f1dd, 0xbf8063a3, 0x55aea3d0, 0xf0ef31ae,
+		0x841f55c7, 0x215ec7b9, 0xcb7007ca, 0x6e3195b4, 0x2290cf18,
+		0x87d15d66, 0x6dff9d15, 0xc8be0f6b, 0xbc4e6b02, 0x190ff97c,
+		0xf321390f, 0x5660ab71, 0x4c42f79a, 0xe90365e4, 0x032da597,
+		0xa66c37e9, 0xd29c5380, 0x77ddc1fe, 0x9df3018d, 0x38b293f3,
+		0x7413c95f, 0xd1525b21, 0x3b7c9b52, 0x9e3d092c, 0xeacd6d45,
+		0x4f8cff3b, 0xa5a23f48, 0x00e3ad36, 0x3ce08a10, 0x99a1186e,
+		0x738fd81d, 0xd6ce4a63, 0xa23e2e0a, 0x077fbc74, 0xed517c07,
+		0x4810ee79, 0x04b1b4d5, 0xa1f026ab, 0x4bdee6d8, 0xee9f74a6,
+		0x9a6f10cf, 0x3f2e82b1, 0xd50042c2, 0x7041d0bc, 0xad060c8e,
+		0x08479ef0, 0xe2695e83, 0x4728ccfd, 0x33d8a894, 0x96993aea,
+		0x7cb7fa99, 0xd9f668e7, 0x9557324b, 0x3016a035, 0xda386046,
+		0x7f79f238, 0x0b899651, 0xaec8042f, 0x44e6c45c, 0xe1a75622,
+		0xdda47104, 0x78e5e37a, 0x92cb2309, 0x378ab177, 0x437ad51e,
+		0xe63b4760, 0x0c158713, 0xa954156d, 0xe5f54fc1, 0x40b4ddbf,
+		0xaa9a1dcc, 0x0fdb8fb2, 0x7b2bebdb, 0xde6a79a5, 0x3444b9d6,
+		0x91052ba8
+	},
+	{
+		0x00000000, 0xdd45aab8, 0xbf672381, 0x62228939, 0x7b2231f3,
+		0xa6679b4b, 0xc4451272, 0x1900b8ca, 0xf64463e6, 0x2b01c95e,
+		0x49234067, 0x9466eadf, 0x8d665215, 0x5023f8ad, 0x32017194,
+		0xef44db2c, 0xe964b13d, 0x34211b85, 0x560392bc, 0x8b463804,
+		0x924680ce, 0x4f032a76, 0x2d21a34f, 0xf06409f7, 0x1f20d2db,
+		0xc2657863, 0xa047f15a, 0x7d025be2, 0x6402e328, 0xb9474990,
+		0xdb65c0a9, 0x06206a11, 0xd725148b, 0x0a60be33, 0x6842370a,
+		0xb5079db2, 0xac072578, 0x71428fc0, 0x136006f9, 0xce25ac41,
+		0x2161776d, 0xfc24ddd5, 0x9e0654ec, 0x4343fe54, 0x5a43469e,
+		0x8706ec26, 0xe524651f, 0x3861cfa7, 0x3e41a5b6, 0xe3040f0e,
+		0x81268637, 0x5c632c8f, 0x45639445, 0x98263efd, 0xfa04b7c4,
+		0x27411d7c, 0xc805c650, 0x15406ce8, 0x7762e5d1, 0xaa274f69,
+		0xb327f7a3, 0x6e625d1b, 0x0c40d422, 0xd1057e9a, 0xaba65fe7,
+		0x76e3f55f, 0x14c17c66, 0xc984d6de, 0xd0846e14, 0x0dc1c4ac,
+		0x6fe34d95, 0xb2a6e72d, 0x5de23c01, 0x80a796b9, 0xe2851f80,
+		0x3fc0b538, 0x26c00df2, 0xfb85a74a, 0x99a72e73, 0x44e284cb,
+		0x42c2eeda, 0x9f874462, 0xfda5cd5b, 0x20e067e3, 0x39e0df29,
+		0xe4a57591, 0x8687fca8, 0x5bc25610, 0xb4868d3c, 0x69c32784,
+		0x0be1aebd, 0xd6a40405, 0xcfa4bccf, 0x12e11677, 0x70c39f4e,
+		0xad8635f6, 0x7c834b6c, 0xa1c6e1d4, 0xc3e468ed, 0x1ea1c255,
+		0x07a17a9f, 0xdae4d027, 0xb8c6591e, 0x6583f3a6, 0x8ac7288a,
+		0x57828232, 0x35a00b0b, 0xe8e5a1b3, 0xf1e51979, 0x2ca0b3c1,
+		0x4e823af8, 0x93c79040, 0x95e7fa51, 0x48a250e9, 0x2a80d9d0,
+		0xf7c57368, 0xeec5cba2, 0x3380611a, 0x51a2e823, 0x8ce7429b,
+		0x63a399b7, 0xbee6330f, 0xdcc4ba36, 0x0181108e, 0x1881a844,
+		0xc5c402fc, 0xa7e68bc5, 0x7aa3217d, 0x52a0c93f, 0x8fe56387,
+		0xedc7eabe, 0x30824006, 0x2982f8cc, 0xf4c75274, 0x96e5db4d,
+		0x4ba071f5, 0xa4e4aad9, 0x79a10061, 0x1b838958, 0xc6c623e0,
+		0xdfc69b2a, 0x02833192, 0x60a1b8ab, 0xbde41213, 0xbbc47802,
+		0x6681d2ba, 0x04a35b83, 0xd9e6f13b, 0xc0e649f1, 0x1da3e349,
+		0x7f816a70, 0xa2c4c0c8, 0x4d801be4, 0x90c5b15c, 0xf2e73865,
+		0x2fa292dd, 0x36a22a17, 0xebe780af, 0x89c50996, 0x5480a32e,
+		0x8585ddb4, 0x58c0770c, 0x3ae2fe35, 0xe7a7548d, 0xfea7ec47,
+		0x23e246ff, 0x41c0cfc6, 0x9c85657e, 0x73c1be52, 0xae8414ea,
+		0xcca69dd3, 0x11e3376b, 0x08e38fa1, 0xd5a62519, 0xb784ac20,
+		0x6ac10698, 0x6ce16c89, 0xb1a4c631, 0xd3864f08, 0x0ec3e5b0,
+		0x17c35d7a, 0xca86f7c2, 0xa8a47efb, 0x75e1d443, 0x9aa50f6f,
+		0x47e0a5d7, 0x25c22cee, 0xf8878656, 0xe1873e9c, 0x3cc29424,
+		0x5ee01d1d, 0x83a5b7a5, 0xf90696d8, 0x24433c60, 0x4661b559,
+		0x9b241fe1, 0x8224a72b, 0x5f610d93, 0x3d4384aa, 0xe0062e12,
+		0x0f42f53e, 0xd2075f86, 0xb025d6bf, 0x6d607c07, 0x7460c4cd,
+		0xa9256e75, 0xcb07e74c, 0x16424df4, 0x106227e5, 0xcd278d5d,
+		0xaf050464, 0x7240aedc, 0x6b401616, 0xb605bcae, 0xd4273597,
+		0x09629f2f, 0xe6264403, 0x3b63eebb, 0x59416782, 0x8404cd3a,
+		0x9d0475f0, 0x4041df48, 0x22635671, 0xff26fcc9, 0x2e238253,
+		0xf36628eb, 0x9144a1d2, 0x4c010b6a, 0x5501b3a0, 0x88441918,
+		0xea669021, 0x37233a99, 0xd867e1b5, 0x05224b0d, 0x6700c234,
+		0xba45688c, 0xa345d046, 0x7e007afe, 0x1c22f3c7, 0xc167597f,
+		0xc747336e, 0x1a0299d6, 0x782010ef, 0xa565ba57, 0xbc65029d,
+		0x6120a825, 0x0302211c, 0xde478ba4, 0x31035088, 0xec46fa30,
+		0x8e647309, 0x5321d9b1, 0x4a21617b, 0x9764cbc3, 0xf54642fa,
+		0x2803e842
+	},
+	{
+		0x00000000, 0x38116fac, 0x7022df58, 0x4833b0f4, 0xe045beb0,
+		0xd854d11c, 0x906761e8, 0xa8760e44, 0xc5670b91, 0xfd76643d,
+		0xb545d4c9, 0x8d54bb65, 0x2522b521, 0x1d33da8d, 0x55006a79,
+		0x6d1105d5, 0x8f2261d3, 0xb7330e7f, 0xff00be8b, 0xc711d127,
+		0x6f67df63, 0x5776b0cf, 0x1f45003b, 0x27546f97, 0x4a456a42,
+		0x725405ee, 0x3a67b51a, 0x0276dab6, 0xaa00d4f2, 0x9211bb5e,
+		0xda220baa, 0xe2336406, 0x1ba8b557, 0x23b9dafb, 0x6b8a6a0f,
+		0x539b05a3, 0xfbed0be7, 0xc3fc644b, 0x8bcfd4bf, 0xb3debb13,
+		0xdecfbec6, 0xe6ded16a, 0xaeed619e, 0x96fc0e32, 0x3e8a0076,
+		0x069b6fda, 0x4ea8df2e, 0x76b9b082, 0x948ad484, 0xac9bbb28,
+		0xe4a80bdc, 0xdcb96470, 0x74cf6a34, 0x4cde0598, 0x04edb56c,
+		0x3cfcdac0, 0x51eddf15, 0x69fcb0b9, 0x21cf004d, 0x19de6fe1,
+		0xb1a861a5, 0x89b90e09, 0xc18abefd, 0xf99bd151, 0x37516aae,
+		0x0f400502, 0x4773b5f6, 0x7f62da5a, 0xd714d41e, 0xef05bbb2,
+		0xa7360b46, 0x9f2764ea, 0xf236613f, 0xca270e93, 0x8214be67,
+		0xba05d1cb, 0x1273df8f, 0x2a62b023, 0x625100d7, 0x5a406f7b,
+		0xb8730b7d, 0x806264d1, 0xc851d425, 0xf040bb89, 0x5836b5cd,
+		0x6027da61, 0x28146a95, 0x10050539, 0x7d1400ec, 0x45056f40,
+		0x0d36dfb4, 0x3527b018, 0x9d51be5c, 0xa540d1f0, 0xed736104,
+		0xd5620ea8, 0x2cf9dff9, 0x14e8b055, 0x5cdb00a1, 0x64ca6f0d,
+		0xccbc6149, 0xf4ad0ee5, 0xbc9ebe11, 0x848fd1bd, 0xe99ed468,
+		0xd18fbbc4, 0x99bc0b30, 0xa1ad649c, 0x09db6ad8, 0x31ca0574,
+		0x79f9b580, 0x41e8da2c, 0xa3dbbe2a, 0x9bcad186, 0xd3f96172,
+		0xebe80ede, 0x439e009a, 0x7b8f6f36, 0x33bcdfc2, 0x0badb06e,
+		0x66bcb5bb, 0x5eadda17, 0x169e6ae3, 0x2e8f054f, 0x86f90b0b,
+		0xbee864a7, 0xf6dbd453, 0xcecabbff, 0x6ea2d55c, 0x56b3baf0,
+		0x1e800a04, 0x269165a8, 0x8ee76bec, 0xb6f60440, 0xfec5b4b4,
+		0xc6d4db18, 0xabc5decd, 0x93d4b161, 0xdbe70195, 0xe3f66e39,
+		0x4b80607d, 0x73910fd1, 0x3ba2bf25, 0x03b3d089, 0xe180b48f,
+		0xd991db23, 0x91a26bd7, 0xa9b3047b, 0x01c50a3f, 0x39d46593,
+		0x71e7d567, 0x49f6bacb, 0x24e7bf1e, 0x1cf6d0b2, 0x54c56046,
+		0x6cd40fea, 0xc4a201ae, 0xfcb36e02, 0xb480def6, 0x8c91b15a,
+		0x750a600b, 0x4d1b0fa7, 0x0528bf53, 0x3d39d0ff, 0x954fdebb,
+		0xad5eb117, 0xe56d01e3, 0xdd7c6e4f, 0xb06d6b9a, 0x887c0436,
+		0xc04fb4c2, 0xf85edb6e, 0x5028d52a, 0x6839ba86, 0x200a0a72,
+		0x181b65de, 0xfa2801d8, 0xc2396e74, 0x8a0ade80, 0xb21bb12c,
+		0x1a6dbf68, 0x227cd0c4, 0x6a4f6030, 0x525e0f9c, 0x3f4f0a49,
+		0x075e65e5, 0x4f6dd511, 0x777cbabd, 0xdf0ab4f9, 0xe71bdb55,
+		0xaf286ba1, 0x9739040d, 0x59f3bff2, 0x61e2d05e, 0x29d160aa,
+		0x11c00f06, 0xb9b60142, 0x81a76eee, 0xc994de1a, 0xf185b1b6,
+		0x9c94b463, 0xa485dbcf, 0xecb66b3b, 0xd4a70497, 0x7cd10ad3,
+		0x44c0657f, 0x0cf3d58b, 0x34e2ba27, 0xd6d1de21, 0xeec0b18d,
+		0xa6f30179, 0x9ee26ed5, 0x36946091, 0x0e850f3d, 0x46b6bfc9,
+		0x7ea7d065, 0x13b6d5b0, 0x2ba7ba1c, 0x63940ae8, 0x5b856544,
+		0xf3f36b00, 0xcbe204ac, 0x83d1b458, 0xbbc0dbf4, 0x425b0aa5,
+		0x7a4a6509, 0x3279d5fd, 0x0a68ba51, 0xa21eb415, 0x9a0fdbb9,
+		0xd23c6b4d, 0xea2d04e1, 0x873c0134, 0xbf2d6e98, 0xf71ede6c,
+		0xcf0fb1c0, 0x6779bf84, 0x5f68d028, 0x175b60dc, 0x2f4a0f70,
+		0xcd796b76, 0xf56804da, 0xbd5bb42e, 0x854adb82, 0x2d3cd5c6,
+		0x152dba6a, 0x5d1e0a9e, 0x650f6532, 0x081e60e7, 0x300f0f4b,
+		0x783cbfbf, 0x402dd013, 0xe85bde57, 0xd04ab1fb, 0x9879010f,
+		0xa0686ea3
+	},
+	{
+		0x00000000, 0xef306b19, 0xdb8ca0c3, 0x34bccbda, 0xb2f53777,
+		0x5dc55c6e, 0x697997b4, 0x8649fcad, 0x6006181f, 0x8f367306,
+		0xbb8ab8dc, 0x54bad3c5, 0xd2f32f68, 0x3dc34471, 0x097f8fab,
+		0xe64fe4b2, 0xc00c303e, 0x2f3c5b27, 0x1b8090fd, 0xf4b0fbe4,
+		0x72f90749, 0x9dc96c50, 0xa975a78a, 0x4645cc93, 0xa00a2821,
+		0x4f3a4338, 0x7b8688e2, 0x94b6e3fb, 0x12ff1f56, 0xfdcf744f,
+		0xc973bf95, 0x2643d48c, 0x85f4168d, 0x6ac47d94, 0x5e78b64e,
+		0xb148dd57, 0x370121fa, 0xd8314ae3, 0xec8d8139, 0x03bdea20,
+		0xe5f20e92, 0x0ac2658b, 0x3e7eae51, 0xd14ec548, 0x570739e5,
+		0xb83752fc, 0x8c8b9926, 0x63bbf23f, 0x45f826b3, 0xaac84daa,
+		0x9e748670, 0x7144ed69, 0xf70d11c4, 0x183d7add, 0x2c81b107,
+		0xc3b1da1e, 0x25fe3eac, 0xcace55b5, 0xfe729e6f, 0x1142f576,
+		0x970b09db, 0x783b62c2, 0x4c87a918, 0xa3b7c201, 0x0e045beb,
+		0xe13430f2, 0xd588fb28, 0x3ab89031, 0xbcf16c9c, 0x53c10785,
+		0x677dcc5f, 0x884da746, 0x6e0243f4, 0x813228ed, 0xb58ee337,
+		0x5abe882e, 0xdcf77483, 0x33c71f9a, 0x077bd440, 0xe84bbf59,
+		0xce086bd5, 0x213800cc, 0x1584cb16, 0xfab4a00f, 0x7cfd5ca2,
+		0x93cd37bb, 0xa771fc61, 0x48419778, 0xae0e73ca, 0x413e18d3,
+		0x7582d309, 0x9ab2b810, 0x1cfb44bd, 0xf3cb2fa4, 0xc777e47e,
+		0x28478f67, 0x8bf04d66, 0x64c0267f, 0x507ceda5, 0xbf4c86bc,
+		0x39057a11, 0xd6351108, 0xe289dad2, 0x0db9b1cb, 0xebf65579,
+		0x04c63e60, 0x307af5ba, 0xdf4a9ea3, 0x5903620e, 0xb6330917,
+		0x828fc2cd, 0x6dbfa9d4, 0x4bfc7d58, 0xa4cc1641, 0x9070dd9b,
+		0x7f40b682, 0xf9094a2f, 0x16392136, 0x2285eaec, 0xcdb581f5,
+		0x2bfa6547, 0xc4ca0e5e, 0xf076c584, 0x1f46ae9d, 0x990f5230,
+		0x763f3929, 0x4283f2f3, 0xadb399ea, 0x1c08b7d6, 0xf338dccf,
+		0xc7841715, 0x28b47c0c, 0xaefd80a1, 0x41cdebb8, 0x75712062,
+		0x9a414b7b, 0x7c0eafc9, 0x933ec4d0, 0xa7820f0a, 0x48b26413,
+		0xcefb98be, 0x21cbf3a7, 0x1577387d, 0xfa475364, 0xdc0487e8,
+		0x3334ecf1, 0x0788272b, 0xe8b84c32, 0x6ef1b09f, 0x81c1db86,
+		0xb57d105c, 0x5a4d7b45, 0xbc029ff7, 0x5332f4ee, 0x678e3f34,
+		0x88be542d, 0x0ef7a880, 0xe1c7c399, 0xd57b0843, 0x3a4b635a,
+		0x99fca15b, 0x76ccca42, 0x42700198, 0xad406a81, 0x2b09962c,
+		0xc439fd35, 0xf08536ef, 0x1fb55df6, 0xf9fab944, 0x16cad25d,
+		0x22761987, 0xcd46729e, 0x4b0f8e33, 0xa43fe52a, 0x90832ef0,
+		0x7fb345e9, 0x59f09165, 0xb6c0fa7c, 0x827c31a6, 0x6d4c5abf,
+		0xeb05a612, 0x0435cd0b, 0x308906d1, 0xdfb96dc8, 0x39f6897a,
+		0xd6c6e263, 0xe27a29b9, 0x0d4a42a0, 0x8b03be0d, 0x6433d514,
+		0x508f1ece, 0xbfbf75d7, 0x120cec3d, 0xfd3c8724, 0xc9804cfe,
+		0x26b027e7, 0xa0f9db4a, 0x4fc9b053, 0x7b757b89, 0x94451090,
+		0x720af422, 0x9d3a9f3b, 0xa98654e1, 0x46b63ff8, 0xc0ffc355,
+		0x2fcfa84c, 0x1b736396, 0xf443088f, 0xd200dc03, 0x3d30b71a,
+		0x098c7cc0, 0xe6bc17d9, 0x60f5eb74, 0x8fc5806d, 0xbb794bb7,
+		0x544920ae, 0xb206c41c, 0x5d36af05, 0x698a64df, 0x86ba0fc6,
+		0x00f3f36b, 0xefc39872, 0xdb7f53a8, 0x344f38b1, 0x97f8fab0,
+		0x78c891a9, 0x4c745a73, 0xa344316a, 0x250dcdc7, 0xca3da6de,
+		0xfe816d04, 0x11b1061d, 0xf7fee2af, 0x18ce89b6, 0x2c72426c,
+		0xc3422975, 0x450bd5d8, 0xaa3bbec1, 0x9e87751b, 0x71b71e02,
+		0x57f4ca8e, 0xb8c4a197, 0x8c786a4d, 0x63480154, 0xe501fdf9,
+		0x0a3196e0, 0x3e8d5d3a, 0xd1bd3623, 0x37f2d291, 0xd8c2b988,
+		0xec7e7252, 0x034e194b, 0x8507e5e6, 0x6a378eff, 0x5e8b4525,
+		0xb1bb2e3c
+	},
+	{
+		0x00000000, 0x68032cc8, 0xd0065990, 0xb8057558, 0xa5e0c5d1,
+		0xcde3e919, 0x75e69c41, 0x1de5b089, 0x4e2dfd53, 0x262ed19b,
+		0x9e2ba4c3, 0xf628880b, 0xebcd3882, 0x83ce144a, 0x3bcb6112,
+		0x53c84dda, 0x9c5bfaa6, 0xf458d66e, 0x4c5da336, 0x245e8ffe,
+		0x39bb3f77, 0x51b813bf, 0xe9bd66e7, 0x81be4a2f, 0xd27607f5,
+		0xba752b3d, 0x02705e65, 0x6a7372ad, 0x7796c224, 0x1f95eeec,
+		0xa7909bb4, 0xcf93b77c, 0x3d5b83bd, 0x5558af75, 0xed5dda2d,
+		0x855ef6e5, 0x98bb466c, 0xf0b86aa4, 0x48bd1ffc, 0x20be3334,
+		0x73767eee, 0x1b755226, 0xa370277e, 0xcb730bb6, 0xd696bb3f,
+		0xbe9597f7, 0x0690e2af, 0x6e93ce67, 0xa100791b, 0xc90355d3,
+		0x7106208b, 0x19050c43, 0x04e0bcca, 0x6ce39002, 0xd4e6e55a,
+		0xbce5c992, 0xef2d8448, 0x872ea880, 0x3f2bddd8, 0x5728f110,
+		0x4acd4199, 0x22ce6d51, 0x9acb1809, 0xf2c834c1, 0x7ab7077a,
+		0x12b42bb2, 0xaab15eea, 0xc2b27222, 0xdf57c2ab, 0xb754ee63,
+		0x0f519b3b, 0x6752b7f3, 0x349afa29, 0x5c99d6e1, 0xe49ca3b9,
+		0x8c9f8f71, 0x917a3ff8, 0xf9791330, 0x417c6668, 0x297f4aa0,
+		0xe6ecfddc, 0x8eefd114, 0x36eaa44c, 0x5ee98884, 0x430c380d,
+		0x2b0f14c5, 0x930a619d, 0xfb094d55, 0xa8c1008f, 0xc0c22c47,
+		0x78c7591f, 0x10c475d7, 0x0d21c55e, 0x6522e996, 0xdd279cce,
+		0xb524b006, 0x47ec84c7, 0x2fefa80f, 0x97eadd57, 0xffe9f19f,
+		0xe20c4116, 0x8a0f6dde, 0x320a1886, 0x5a09344e, 0x09c17994,
+		0x61c2555c, 0xd9c72004, 0xb1c40ccc, 0xac21bc45, 0xc422908d,
+		0x7c27e5d5, 0x1424c91d, 0xdbb77e61, 0xb3b452a9, 0x0bb127f1,
+		0x63b20b39, 0x7e57bbb0, 0x16549778, 0xae51e220, 0xc652cee8,
+		0x959a8332, 0xfd99affa, 0x459cdaa2, 0x2d9ff66a, 0x307a46e3,
+		0x58796a2b, 0xe07c1f73, 0x887f33bb, 0xf56e0ef4, 0x9d6d223c,
+		0x25685764, 0x4d6b7bac, 0x508ecb25, 0x388de7ed, 0x808892b5,
+		0xe88bbe7d, 0xbb43f3a7, 0xd340df6f, 0x6b45aa37, 0x034686ff,
+		0x1ea33676, 0x76a01abe, 0xcea56fe6, 0xa6a6432e, 0x6935f452,
+		0x0136d89a, 0xb933adc2, 0xd130810a, 0xccd53183, 0xa4d61d4b,
+		0x1cd36813, 0x74d044db, 0x27180901, 0x4f1b25c9, 0xf71e5091,
+		0x9f1d7c59, 0x82f8ccd0, 0xeafbe018, 0x52fe9540, 0x3afdb988,
+		0xc8358d49, 0xa036a181, 0x1833d4d9, 0x7030f811, 0x6dd54898,
+		0x05d66450, 0xbdd31108, 0xd5d03dc0, 0x8618701a, 0xee1b5cd2,
+		0x561e298a, 0x3e1d0542, 0x23f8b5cb, 0x4bfb9903, 0xf3feec5b,
+		0x9bfdc093, 0x546e77ef, 0x3c6d5b27, 0x84682e7f, 0xec6b02b7,
+		0xf18eb23e, 0x998d9ef6, 0x2188ebae, 0x498bc766, 0x1a438abc,
+		0x7240a674, 0xca45d32c, 0xa246ffe4, 0xbfa34f6d, 0xd7a063a5,
+		0x6fa516fd, 0x07a63a35, 0x8fd9098e, 0xe7da2546, 0x5fdf501e,
+		0x37dc7cd6, 0x2a39cc5f, 0x423ae097, 0xfa3f95cf, 0x923cb907,
+		0xc1f4f4dd, 0xa9f7d815, 0x11f2ad4d, 0x79f18185, 0x6414310c,
+		0x0c171dc4, 0xb412689c, 0xdc114454, 0x1382f328, 0x7b81dfe0,
+		0xc384aab8, 0xab878670, 0xb66236f9, 0xde611a31, 0x66646f69,
+		0x0e6743a1, 0x5daf0e7b, 0x35ac22b3, 0x8da957eb, 0xe5aa7b23,
+		0xf84fcbaa, 0x904ce762, 0x2849923a, 0x404abef2, 0xb2828a33,
+		0xda81a6fb, 0x6284d3a3, 0x0a87ff6b, 0x17624fe2, 0x7f61632a,
+		0xc7641672, 0xaf673aba, 0xfcaf7760, 0x94ac5ba8, 0x2ca92ef0,
+		0x44aa0238, 0x594fb2b1, 0x314c9e79, 0x8949eb21, 0xe14ac7e9,
+		0x2ed97095, 0x46da5c5d, 0xfedf2905, 0x96dc05cd, 0x8b39b544,
+		0xe33a998c, 0x5b3fecd4, 0x333cc01c, 0x60f48dc6, 0x08f7a10e,
+		0xb0f2d456, 0xd8f1f89e, 0xc5144817, 0xad1764df, 0x15121187,
+		0x7d113d4f
+	},
+	{
+		0x00000000, 0x493c7d27, 0x9278fa4e, 0xdb448769, 0x211d826d,
+		0x6821ff4a, 0xb3657823, 0xfa590504, 0x423b04da, 0x0b0779fd,
+		0xd043fe94, 0x997f83b3, 0x632686b7, 0x2a1afb90, 0xf15e7cf9,
+		0xb86201de, 0x847609b4, 0xcd4a7493, 0x160ef3fa, 0x5f328edd,
+		0xa56b8bd9, 0xec57f6fe, 0x37137197, 0x7e2f0cb0, 0xc64d0d6e,
+		0x8f717049, 0x5435f720, 0x1d098a07, 0xe7508f03, 0xae6cf224,
+		0x7528754d, 0x3c14086a, 0x0d006599, 0x443c18be, 0x9f789fd7,
+		0xd644e2f0, 0x2c1de7f4, 0x65219ad3, 0xbe651dba, 0xf759609d,
+		0x4f3b6143, 0x06071c64, 0xdd439b0d, 0x947fe62a, 0x6e26e32e,
+		0x271a9e09, 0xfc5e1960, 0xb5626447, 0x89766c2d, 0xc04a110a,
+		0x1b0e9663, 0x5232eb44, 0xa86bee40, 0xe1579367, 0x3a13140e,
+		0x732f6929, 0xcb4d68f7, 0x827115d0, 0x593592b9, 0x1009ef9e,
+		0xea50ea9a, 0xa36c97bd, 0x782810d4, 0x31146df3, 0x1a00cb32,
+		0x533cb615, 0x8878317c, 0xc1444c5b, 0x3b1d495f, 0x72213478,
+		0xa965b311, 0xe059ce36, 0x583bcfe8, 0x1107b2cf, 0xca4335a6,
+		0x837f4881, 0x79264d85, 0x301a30a2, 0xeb5eb7cb, 0xa262caec,
+		0x9e76c286, 0xd74abfa1, 0x0c0e38c8, 0x453245ef, 0xbf6b40eb,
+		0xf6573dcc, 0x2d13baa5, 0x642fc782, 0xdc4dc65c, 0x9571bb7b,
+		0x4e353c12, 0x07094135, 0xfd504431, 0xb46c3916, 0x6f28be7f,
+		0x2614c358, 0x1700aeab, 0x5e3cd38c, 0x857854e5, 0xcc4429c2,
+		0x361d2cc6, 0x7f2151e1, 0xa465d688, 0xed59abaf, 0x553baa71,
+		0x1c07d756, 0xc743503f, 0x8e7f2d18, 0x7426281c, 0x3d1a553b,
+		0xe65ed252, 0xaf62af75, 0x9376a71f, 0xda4ada38, 0x010e5d51,
+		0x48322076, 0xb26b2572, 0xfb575855, 0x2013df3c, 0x692fa21b,
+		0xd14da3c5, 0x9871dee2, 0x4335598b, 0x0a0924ac, 0xf05021a8,
+		0xb96c5c8f, 0x6228dbe6, 0x2b14a6c1, 0x34019664, 0x7d3deb43,
+		0xa6796c2a, 0xef45110d, 0x151c1409, 0x5c20692e, 0x8764ee47,
+		0xce589360, 0x763a92be, 0x3f06ef99, 0xe44268f0, 0xad7e15d7,
+		0x572710d3, 0x1e1b6df4, 0xc55fea9d, 0x8c6397ba, 0xb0779fd0,
+		0xf94be2f7, 0x220f659e, 0x6b3318b9, 0x916a1dbd, 0xd856609a,
+		0x0312e7f3, 0x4a2e9ad4, 0xf24c9b0a, 0xbb70e62d, 0x60346144,
+		0x29081c63, 0xd3511967, 0x9a6d6440, 0x4129e329, 0x08159e0e,
+		0x3901f3fd, 0x703d8eda, 0xab7909b3, 0xe2457494, 0x181c7190,
+		0x51200cb7, 0x8a648bde, 0xc358f6f9, 0x7b3af727, 0x32068a00,
+		0xe9420d69, 0xa07e704e, 0x5a27754a, 0x131b086d, 0xc85f8f04,
+		0x8163f223, 0xbd77fa49, 0xf44b876e, 0x2f0f0007, 0x66337d20,
+		0x9c6a7824, 0xd5560503, 0x0e12826a, 0x472eff4d, 0xff4cfe93,
+		0xb67083b4, 0x6d3404dd, 0x240879fa, 0xde517cfe, 0x976d01d9,
+		0x4c2986b0, 0x0515fb97, 0x2e015d56, 0x673d2071, 0xbc79a718,
+		0xf545da3f, 0x0f1cdf3b, 0x4620a21c, 0x9d642575, 0xd4585852,
+		0x6c3a598c, 0x250624ab, 0xfe42a3c2, 0xb77edee5, 0x4d27dbe1,
+		0x041ba6c6, 0xdf5f21af, 0x96635c88, 0xaa7754e2, 0xe34b29c5,
+		0x380faeac, 0x7133d38b, 0x8b6ad68f, 0xc256aba8, 0x19122cc1,
+		0x502e51e6, 0xe84c5038, 0xa1702d1f, 0x7a34aa76, 0x3308d751,
+		0xc951d255, 0x806daf72, 0x5b29281b, 0x1215553c, 0x230138cf,
+		0x6a3d45e8, 0xb179c281, 0xf845bfa6, 0x021cbaa2, 0x4b20c785,
+		0x906440ec, 0xd9583dcb, 0x613a3c15, 0x28064132, 0xf342c65b,
+		0xba7ebb7c, 0x4027be78, 0x091bc35f, 0xd25f4436, 0x9b633911,
+		0xa777317b, 0xee4b4c5c, 0x350fcb35, 0x7c33b612, 0x866ab316,
+		0xcf56ce31, 0x14124958, 0x5d2e347f, 0xe54c35a1, 0xac704886,
+		0x7734cfef, 0x3e08b2c8, 0xc451b7cc, 0x8d6dcaeb, 0x56294d82,
+		0x1f1530a5
+	}
+};
+
+static uint32_t
+crc32c_table(uint32_t crc, const unsigned char *p, unsigned long long n)
+{
+	uint32_t lo, hi;
+
+	for (; n >= 8; n -= 8, p += 8) {
+		lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+		crc = crc_table[7][lo & 0xff] ^ crc_table[6][lo >> 8 & 0xff]
+			^ crc_table[5][lo >> 16 & 0xff] ^ crc_table[4][lo >> 24]
+			^ crc_table[3][hi & 0xff] ^ crc_table[2][hi >> 8 & 0xff]
+			^ crc_table[1][hi >> 16 & 0xff] ^ crc_table[0][hi >> 24];
+	}
+	for (; n; n--, p++) {
+		crc = crc >> 8 ^ crc_table[0][(crc ^ *p) & 0xff];
+	}
+	return crc;
+}
+
+#ifdef BTW_AVX2
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char *p, unsigned long long n)
+{
+#ifdef __x86_64__
+	uint64_t c = crc;
+
+	for (; n >= 8; n -= 8, p += 8) {
+		c = _mm_crc32_u64(c, load_le64(p));
+	}
+	crc = (uint32_t)c;
+#endif
+	for (; n; n--, p++) {
+		crc = _mm_crc32_u8(crc, *p);
+	}
+	return crc;
+}
+#elif defined(BTW_NEON) && defined(__ARM_FEATURE_CRC32)
+static uint32_t
+crc32c_arm(uint32_t crc, const unsigned char *p, unsigned long long n)
+{
+	for (; n >= 8; n -= 8, p += 8) {
+		crc = __crc32cd(crc, load_le64(p));
+	}
+	for (; n; n--, p++) {
+		crc = __crc32cb(crc, *p);
+	}
+	return crc;
+}
+#endif
+
+/* CRC-32C of n bytes at p following bytes whose CRC-32C is crc, 0 if none */
+static uint32_t
+crc32c(uint32_t crc, const unsigned char *p, unsigned long long n)
+{
+#if defined(BTW_AVX2)
+	if (__builtin_cpu_supports("sse4.2")) {
+		return ~crc32c_sse42(~crc, p, n);
+	}
+#elif defined(BTW_NEON) && defined(__ARM_FEATURE_CRC32)
+	return ~crc32c_arm(~crc, p, n);
+#endif
+	return ~crc32c_table(~crc, p, n);
+}
+
+/* Product of polynomials a and b modulo that of CRC-32C, all reflected */
+static uint32_t
+crc_multiply(uint32_t a, uint32_t b)
+{
+	uint32_t m, p = 0;
+
+	for (m = 1U << 31; m; m >>= 1) {
+		if (a & m) {
+			p ^= b;
+		}
+		b = b & 1 ? b >> 1 ^ BTW_CRC32C : b >> 1;
+	}
+	return p;
+}
+
+/*
+ * CRC-32C of two runs of bytes from the CRC a of the first and b of the
+ * second, of len bytes: a is carried over them by multiplying it by
+ * x^(8 * len), found by squaring.
+ */
+static uint32_t
+crc32c_combine(uint32_t a, uint32_t b, unsigned long long len)
+{
+	uint32_t square = 1U << 23;		/* x^8 */
+	uint32_t shift = 1U << 31;		/* 1 */
+
+	for (; len; len >>= 1) {
+		if (len & 1) {
+			shift = crc_multiply(square, shift);
+		}
+		square = crc_multiply(square, square);
+	}
+	return crc_multiply(shift, a) ^ b;
+}
+
+/*
+ * The reader is a bit position and a limit. The fast functions load a
+ * whole unaligned word at the current byte, which gives at least 57 valid
+ * bits but touches up to 8 bytes past the position, so callers must know
+ * those bytes are there. The exact ones only touch bytes holding the bits
+ * they return, and check them against the limit.
+ */
+typedef struct {
+	const unsigned char *in;
+	unsigned long long pos;	/* Position in bits */
+	unsigned long long end;	/* Bits available, ~0 if not known */
+	int error;		/* An exact read went past end */
+#ifdef BTW_STATS
+	btw_stats *stats;
+#endif
+} btw_reader;
+
+static void
+br_init(btw_reader *br, const unsigned char *in, unsigned long long pos,
+		unsigned long long end)
+{
+	br->in = in;
+	br->pos = pos;
+	br->end = end;
+	br->error = 0;
+#ifdef BTW_STATS
+	br->stats = attached_stats;
+#endif
+}
+
+static uint64_t
+br_peek(const btw_reader *br)
+{
+	return load_le64(br->in + (br->pos >> 3)) >> (br->pos & 7);
+}
+
+/*
+ * Read a residual with one word load. Returns 0 without reading anything
+ * if its unary run is longer than max_run, which must leave the code no
+ * longer than 57 bits.
+ */
+static int
+br_try_rice(btw_reader *br, int rice_len, int max_run, long long *diff)
+{
+	uint64_t w = br_peek(br), sign = w & 1, mag;
+	int rice_un = ctz64(~(w >> 1));
+
+	if (rice_un > max_run) {
+		return 0;
+	}
+
+	mag = ((uint64_t)rice_un << rice_len)
+		| ((w >> (rice_un + 2)) & ((1ULL << rice_len) - 1));
+	br->pos += rice_un + 2 + rice_len;
+	*diff = (long long)((mag ^ -sign) + sign);
+	return 1;
+}
+
+/*
+ * Read up to n folded residuals into res with word loads, stopping before
+ * the first whose unary run is longer than max_run, which must leave the
+ * code no longer than 57 bits, and return how many were read. Each common
+ * rice_len has its own loop, so its shift and mask are constants, and the
+ * position is kept in a local so stores to res can't make it be reloaded.
+ */
+static unsigned long long
+br_run_zigzag(btw_reader *br, int rice_len, int max_run,
+		unsigned long long n, long long *res)
+{
+	const unsigned char *in = br->in;
+	unsigned long long pos = br->pos, j = 0;
+	uint64_t w, u;
+	int rice_un;
+
+	/* The top bit stops a word of ones, which is too long anyway */
+#define BTW_RUN(k) \
+	for (; j < n; j++) { \
+		w = load_le64(in + (pos >> 3)) >> (pos & 7); \
+		rice_un = ctz64(~w | 1ULL << 63); \
+		if (rice_un > max_run) { \
+			break; \
+		} \
+		u = ((uint64_t)rice_un << (k)) \
+			| ((w >> (rice_un + 1)) & ((1ULL << (k)) - 1)); \
+		pos += rice_un + 1 + (k); \
+		res[j] = (long long)((u >> 1) ^ -(u & 1)); \
+	}
+#define BTW_CASE(k) \
+	case k: \
+		BTW_RUN(k); \
+		break
+
+	switch (rice_len) {
+	BTW_CASE(0); BTW_CASE(1); BTW_CASE(2); BTW_CASE(3);
+	BTW_CASE(4); BTW_CASE(5); BTW_CASE(6); BTW_CASE(7);
+	BTW_CASE(8); BTW_CASE(9); BTW_CASE(10); BTW_CASE(11);
+	BTW_CASE(12); BTW_CASE(13); BTW_CASE(14); BTW_CASE(15);
+	BTW_CASE(16); BTW_CASE(17); BTW_CASE(18); BTW_CASE(19);
+	BTW_CASE(20); BTW_CASE(21); BTW_CASE(22); BTW_CASE(23);
+	default:
+		BTW_RUN(rice_len);
+		break;
+	}
+#undef BTW_CASE
+#undef BTW_RUN
+
+	br->pos = pos;
+	return j;
+}
+
+/* Read up to 57 bits, touching only the bytes they occupy */
+static uint64_t
+br_get_exact(btw_reader *br, unsigned int bits)
+{
+	uint64_t r = 0;
+	unsigned int got = 0, shift, take;
+
+	if (br->end - br->pos < bits) {
+		br->error = 1;
+		br->pos = br->end;
+		return 0;
+	}
+
+	while (got < bits) {
+		shift = br->pos & 7;
+		take = 8 - shift;
+		if (take > bits - got) {
+			take = bits - got;
+		}
+		r |= (uint64_t)((br->in[br->pos >> 3] >> shift)
+			& ((1u << take) - 1)) << got;
+		got += take;
+		br->pos += take;
+	}
+	return r;
+}
+
+/*
+ * Read a residual, folded when zigzag, touching only the bytes it occupies.
+ * Its unary run must be shorter than max_un bits, unless escape_bits isn't
+ * 0: then a run of max_un ones is followed by the magnitude in escape_bits
+ * bits.
+ */
+static long long
+br_get_rice_exact(btw_reader *br, int rice_len, uint64_t max_un,
+		int escape_bits, int zigzag)
+{
+	uint64_t sign = zigzag ? 0 : br_get_exact(br, 1), mag = 0;
+	unsigned int shift, zeros, run;
+
+	for (;;) {
+		if (br->pos >= br->end) {
+			br->error = 1;
+			return 0;
+		}
+		shift = br->pos & 7;
+		zeros = (~br->in[br->pos >> 3] & 0xff) >> shift;
+		run = zeros ? ctz64(zeros) : 8 - shift;
+		if (mag + run >= max_un) {
+			if (!escape_bits) {
+				br->error = 1;
+				return 0;
+			}
+			br->pos += max_un - mag;
+			mag = br_get_exact(br, escape_bits);
+			goto done;
+		}
+		mag += run;
+		br->pos += run;
+		if (zeros) {
+			br->pos++;
+			break;
+		}
+	}
+
+	mag = (mag << rice_len) | br_get_exact(br, rice_len);
+done:
+	if (zigzag) {
+		return (long long)((mag >> 1) ^ -(mag & 1));
+	}
+	return (long long)((mag ^ -sign) + sign);
+}
+
+/* Read "bits" bits of two's complement, touching only their bytes */
+static long long
+br_get_signed(btw_reader *br, unsigned int bits)
+{
+	uint64_t sign = 1ULL << (bits - 1);
+
+	return (long long)((br_get_exact(br, bits) ^ sign) - sign);
+}
+
+/*
+ * Samples in one of the btw_format layouts, starting with sample "first"
+ * per channel: interleaved in data, or when planes isn't NULL, one buffer
+ * per channel.
+ */
+typedef struct {
+	unsigned char *data;
+	void *const *planes;
+	unsigned long long first;
+	btw_format fmt;
+} btw_samples;
+
+static void
+samples_init(btw_samples *s, void *data, void *const *planes,
+		btw_format fmt, unsigned long long first)
+{
+	s->data = (unsigned char *)data;
+	s->planes = planes;
+	s->first = first;
+	s->fmt = fmt;
+}
+
+static unsigned int
+format_size(btw_format fmt)
+{
+	static const unsigned char sizes[] = { 1, 2, 3, 4, 4 };
+
+	return sizes[fmt];
+}
+
+/* Most bytes of samples to allocate, leaving room to add to the size */
+#define BTW_MAX_ALLOC ((unsigned long long)((size_t)-1 >> 1))
+
+/* Bytes n samples per channel of def take in fmt, ~0 past BTW_MAX_ALLOC */
+static unsigned long long
+samples_size(const btw_def *def, btw_format fmt, unsigned long long n)
+{
+	unsigned long long frame = (unsigned long long)def->channels
+		* format_size(fmt);
+
+	if (frame && n > BTW_MAX_ALLOC / frame) {
+		return ~0ULL;
+	}
+	return n * frame;
+}
+
+/* Where sample i of channel chan is, with stride samples to the next one */
+static unsigned char *
+sample_at(const btw_samples *s, unsigned int channels, unsigned long long i,
+		unsigned int chan, unsigned int *stride)
+{
+	unsigned long long size = format_size(s->fmt);
+
+	if (s->planes) {
+		*stride = 1;
+		return (unsigned char *)s->planes[chan] + (i - s->first) * size;
+	}
+	*stride = channels;
+	return s->data + ((i - s->first) * channels + chan) * size;
+}
+
+/* Widen cap samples of channel chan from sample i of s into x */
+static void
+load_samples(const btw_samples *s, unsigned int channels,
+		unsigned long long i, unsigned int chan, unsigned int cap,
+		long long *x)
+{
+	unsigned int j, stride;
+	const unsigned char *p = sample_at(s, channels, i, chan, &stride);
+
+	/* One loop per format, so none of them switches per sample */
+#define BTW_LOAD(type) \
+	for (j = 0; j < cap; j++) \
+		x[j] = ((const type *)p)[(unsigned long long)j * stride]
+
+	switch (s->fmt) {
+	case BTW_FMT_U8:
+		BTW_LOAD(uint8_t);
+		break;
+	case BTW_FMT_S16:
+		BTW_LOAD(int16_t);
+		break;
+	case BTW_FMT_S24:
+		for (j = 0; j < cap; j++, p += 3 * stride) {
+			x[j] = (long long)(p[0] | p[1] << 8 | (uint32_t)p[2] << 16)
+				- (p[2] & 0x80 ? 1LL << 24 : 0);
+		}
+		break;
+	case BTW_FMT_S32:
+		BTW_LOAD(int32_t);
+		break;
+	case BTW_FMT_F32:
+		break;
+	}
+#undef BTW_LOAD
+}
+
+/* Narrow cap samples of x into channel chan of s from sample i */
+static void
+store_samples(const long long *x, unsigned int cap, const btw_samples *s,
+		unsigned int channels, unsigned long long i, unsigned int chan,
+		unsigned int bits_per_sample)
+{
+	unsigned int j, stride;
+	unsigned char *p = sample_at(s, channels, i, chan, &stride);
+	float scale;
+
+#define BTW_STORE(type) \
+	for (j = 0; j < cap; j++) \
+		((type *)p)[(unsigned long long)j * stride] = (type)x[j]
+
+	switch (s->fmt) {
+	case BTW_FMT_U8:
+		BTW_STORE(uint8_t);
+		break;
+	case BTW_FMT_S16:
+		BTW_STORE(int16_t);
+		break;
+	case BTW_FMT_S24:
+		for (j = 0; j < cap; j++, p += 3 * stride) {
+			p[0] = (uint64_t)x[j] & 0xff;
+			p[1] = (uint64_t)x[j] >> 8 & 0xff;
+			p[2] = (uint64_t)x[j] >> 16 & 0xff;
+		}
+		break;
+	case BTW_FMT_S32:
+		BTW_STORE(int32_t);
+		break;
+	case BTW_FMT_F32:
+		scale = 1.0f / (float)(1ULL << (bits_per_sample - 1));
+		for (j = 0; j < cap; j++) {
+			((float *)p)[(unsigned long long)j * stride]
+				= (float)x[j] * scale;
+		}
+		break;
+	}
+#undef BTW_STORE
+}
+
+/* Bytes each sample takes in the PCM the file check is over */
+static unsigned int
+pcm_bytes(const btw_def *def)
+{
+	return (def->bits_per_sample + 7) / 8;
+}
+
+/*
+ * Store the low "bytes" bytes of cap samples from x little-endian to every
+ * stride bytes of p, the PCM the file check is over
+ */
+static void
+pack_samples(const long long *x, unsigned int cap, unsigned int bytes,
+		unsigned int stride, unsigned char *p)
+{
+	unsigned int j;
+
+#ifdef BTW_LITTLE_ENDIAN
+#define BTW_PACK(type) \
+	for (j = 0; j < cap; j++, p += stride) { \
+		type v = (type)x[j]; \
+		memcpy(p, &v, sizeof(v)); \
+	}
+#else
+#define BTW_PACK(type) \
+	for (j = 0; j < cap; j++, p += stride) { \
+		type v = (type)x[j]; \
+		unsigned int b; \
+		for (b = 0; b < sizeof(v); b++) { \
+			p[b] = v >> (b * 8) & 0xff; \
+		} \
+	}
+#endif
+
+	switch (bytes) {
+	case 1:
+		BTW_PACK(uint8_t);
+		break;
+	case 2:
+		BTW_PACK(uint16_t);
+		break;
+	case 3:
+		for (j = 0; j < cap; j++, p += stride) {
+			p[0] = (uint64_t)x[j] & 0xff;
+			p[1] = (uint64_t)x[j] >> 8 & 0xff;
+			p[2] = (uint64_t)x[j] >> 16 & 0xff;
+		}
+		break;
+	default:
+		BTW_PACK(uint32_t);
+		break;
+	}
+#undef BTW_PACK
+}
+
+/*
+ * Where s already holds the PCM of the block at sample i, so it needn't be
+ * packed, or NULL
+ */
+static const unsigned char *
+samples_pcm(const btw_samples *s, const btw_def *def, unsigned long long i)
+{
+	unsigned int stride;
+
+	if (!s || s->planes || format_size(s->fmt) != pcm_bytes(def)
+			|| s->fmt == BTW_FMT_U8 || s->fmt == BTW_FMT_F32) {
+		return NULL;
+	}
+#ifndef BTW_LITTLE_ENDIAN
+	if (s->fmt != BTW_FMT_S24) {
+		return NULL;
+	}
+#endif
+	return sample_at(s, def->channels, i, 0, &stride);
+}
+
+/*
+ * Bytes that encoding "samples" samples per channel may take, besides the
+ * header. No channel takes more than verbatim, which is the size of the
+ * samples but for the extra bit of a side channel, so that bounds every
+ * block along with its mark, split bit, stereo mode, orders, padding and
+ * check.
+ */
+static unsigned long long
+encoded_bound(const btw_def *def, unsigned long long samples)
+{
+	unsigned long long blocks = (samples + def->block_size - 1)
+		/ def->block_size;
+	unsigned int check = BTW_WRITE_FLAGS & BTW_FLAG_CRC
+		? BTW_BLOCK_CHECK_BITS : 0;
+
+	return (samples * (def->channels * def->bits_per_sample
+			+ (def->channels == 2))
+		+ blocks * (1 + BTW_LAST_BLOCK_BITS + 1 + BTW_STEREO_BITS
+			+ def->channels * BTW_ORDER_BITS + 7 + check) + 7) / 8;
+}
+
+static unsigned long long
+block_count(const btw_def *def)
+{
+	return (def->sample_count + def->block_size - 1) / def->block_size;
+}
+
+static int
+is_pow2(unsigned int n)
+{
+	return n && !(n & (n - 1));
+}
+
+/* Fill in the default block sizes, return 0 if they can't be used */
+static int
+check_block_size(btw_def *def)
+{
+	if (!def->block_size) {
+		def->block_size = BTW_BLOCK_SIZE;
+	}
+	if (!def->min_block_size) {
+		def->min_block_size = def->block_size;
+	}
+	return is_pow2(def->block_size) && is_pow2(def->min_block_size)
+		&& def->min_block_size >= BTW_MIN_BLOCK_SIZE
+		&& def->min_block_size <= def->block_size
+		&& def->block_size <= BTW_MAX_BLOCK_SIZE;
+}
+
+static unsigned long long
+seek_entries(const btw_def *def, unsigned int seek_interval)
+{
+	return seek_interval
+		? (block_count(def) + seek_interval - 1) / seek_interval : 0;
+}
+
+/* Flags a stream of samples in fmt is written with */
+static unsigned int
+write_flags(btw_format fmt)
+{
+	return fmt == BTW_FMT_U8 ? BTW_WRITE_FLAGS | BTW_FLAG_UNSIGNED
+		: BTW_WRITE_FLAGS;
+}
+
+/*
+ * Write the header with flags, leaving the writer after the room for the
+ * seek table
+ */
+static void
+write_header(btw_writer *bw, const btw_def *def, unsigned int seek_interval,
+		unsigned int flags)
+{
+	bw_put(bw, BTW_MAGIC, 32);
+
+	bw_put(bw, def->sample_count & 0xffffffff, 32);
+	bw_put(bw, def->sample_count >> 32, 32);
+	bw_put(bw, def->channels & 0xffff, 16);
+	bw_put(bw, def->bits_per_sample & 0xffff, 16);
+	bw_put(bw, def->sample_rate & 0xffffffff, 32);
+	bw_put(bw, flags, 16);
+	bw_put(bw, seek_interval, 16);
+	bw_put(bw, def->block_size, 16);
+	bw_put(bw, def->min_block_size, 16);
+
+	bw->pos += seek_entries(def, seek_interval) * 8;
+}
+
+/*
+ * The wide kernels below take samples l to cap of x, l being at least
+ * BTW_MAX_ORDER, add the residuals of every order to sums and return the
+ * first sample they left. Order k's residuals are found as the kth
+ * difference of x, one vector of samples at a time.
+ */
+#ifdef BTW_AVX2
+#define BTW_ABS256(v) \
+	_mm256_sub_epi64(_mm256_xor_si256((v), \
+		_mm256_cmpgt_epi64(_mm256_setzero_si256(), (v))), \
+		_mm256_cmpgt_epi64(_mm256_setzero_si256(), (v)))
+
+__attribute__((target("avx2")))
+static unsigned int
+sum_residuals_avx2(const long long *x, unsigned int l, unsigned int cap,
+		long long *sums)
+{
+	__m256i a0, a1, a2, a3, a4;
+	__m256i s0, s1, s2, s3, s4;
+	long long lanes[4];
+
+	s0 = s1 = s2 = s3 = s4 = _mm256_setzero_si256();
+	for (; l + 4 <= cap; l += 4) {
+		/* ak goes from x[l - k] to the order k residual of x[l] */
+		a0 = _mm256_loadu_si256((const __m256i *)(x + l));
+		a1 = _mm256_loadu_si256((const __m256i *)(x + l - 1));
+		a2 = _mm256_loadu_si256((const __m256i *)(x + l - 2));
+		a3 = _mm256_loadu_si256((const __m256i *)(x + l - 3));
+		a4 = _mm256_loadu_si256((const __m256i *)(x + l - 4));
+		a4 = _mm256_sub_epi64(a3, a4);
+		a3 = _mm256_sub_epi64(a2, a3);
+		a2 = _mm256_sub_epi64(a1, a2);
+		a1 = _mm256_sub_epi64(a0, a1);
+		a4 = _mm256_sub_epi64(a3, a4);
+		a3 = _mm256_sub_epi64(a2, a3);
+		a2 = _mm256_sub_epi64(a1, a2);
+		a4 = _mm256_sub_epi64(a3, a4);
+		a3 = _mm256_sub_epi64(a2, a3);
+		a4 = _mm256_sub_epi64(a3, a4);
+		s0 = _mm256_add_epi64(s0, BTW_ABS256(a0));
+		s1 = _mm256_add_epi64(s1, BTW_ABS256(a1));
+		s2 = _mm256_add_epi64(s2, BTW_ABS256(a2));
+		s3 = _mm256_add_epi64(s3, BTW_ABS256(a3));
+		s4 = _mm256_add_epi64(s4, BTW_ABS256(a4));
+	}
+
+#define BTW_HSUM256(k, v) \
+	_mm256_storeu_si256((__m256i *)lanes, (v)); \
+	sums[k] += lanes[0] + lanes[1] + lanes[2] + lanes[3]
+
+	BTW_HSUM256(0, s0);
+	BTW_HSUM256(1, s1);
+	BTW_HSUM256(2, s2);
+	BTW_HSUM256(3, s3);
+	BTW_HSUM256(4, s4);
+#undef BTW_HSUM256
+	return l;
+}
+
+/* Like sum_residuals_avx2, storing the order "order" residuals in e */
+__attribute__((target("avx2")))
+static unsigned int
+order_residuals_avx2(const long long *x, unsigned int l, unsigned int cap,
+		unsigned int order, long long *e)
+{
+	__m256i a0, a1, a2, a3, a4;
+
+	for (; l + 4 <= cap; l += 4) {
+		a0 = _mm256_loadu_si256((const __m256i *)(x + l));
+		a1 = _mm256_loadu_si256((const __m256i *)(x + l - 1));
+		a2 = _mm256_loadu_si256((const __m256i *)(x + l - 2));
+		a3 = _mm256_loadu_si256((const __m256i *)(x + l - 3));
+		a4 = _mm256_loadu_si256((const __m256i *)(x + l - 4));
+		a4 = _mm256_sub_epi64(a3, a4);
+		a3 = _mm256_sub_epi64(a2, a3);
+		a2 = _mm256_sub_epi64(a1, a2);
+		a1 = _mm256_sub_epi64(a0, a1);
+		a4 = _mm256_sub_epi64(a3, a4);
+		a3 = _mm256_sub_epi64(a2, a3);
+		a2 = _mm256_sub_epi64(a1, a2);
+		a4 = _mm256_sub_epi64(a3, a4);
+		a3 = _mm256_sub_epi64(a2, a3);
+		a4 = _mm256_sub_epi64(a3, a4);
+		switch (order) {
+		case 1:
+			a0 = a1;
+			break;
+		case 2:
+			a0 = a2;
+			break;
+		case 3:
+			a0 = a3;
+			break;
+		case 4:
+			a0 = a4;
+			break;
+		}
+		_mm256_storeu_si256((__m256i *)(e + l), a0);
+	}
+	return l;
+}
+#endif
+
+#ifdef BTW_NEON
+static unsigned int
+sum_residuals_neon(const long long *x, unsigned int l, unsigned int cap,
+		long long *sums)
+{
+	int64x2_t a0, a1, a2, a3, a4;
+	int64x2_t s0, s1, s2, s3, s4;
+
+	s0 = s1 = s2 = s3 = s4 = vdupq_n_s64(0);
+	for (; l + 2 <= cap; l += 2) {
+		a0 = vld1q_s64((const int64_t *)(x + l));
+		a1 = vld1q_s64((const int64_t *)(x + l - 1));
+		a2 = vld1q_s64((const int64_t *)(x + l - 2));
+		a3 = vld1q_s64((const int64_t *)(x + l - 3));
+		a4 = vld1q_s64((const int64_t *)(x + l - 4));
+		a4 = vsubq_s64(a3, a4);
+		a3 = vsubq_s64(a2, a3);
+		a2 = vsubq_s64(a1, a2);
+		a1 = vsubq_s64(a0, a1);
+		a4 = vsubq_s64(a3, a4);
+		a3 = vsubq_s64(a2, a3);
+		a2 = vsubq_s64(a1, a2);
+		a4 = vsubq_s64(a3, a4);
+		a3 = vsubq_s64(a2, a3);
+		a4 = vsubq_s64(a3, a4);
+		s0 = vaddq_s64(s0, vabsq_s64(a0));
+		s1 = vaddq_s64(s1, vabsq_s64(a1));
+		s2 = vaddq_s64(s2, vabsq_s64(a2));
+		s3 = vaddq_s64(s3, vabsq_s64(a3));
+		s4 = vaddq_s64(s4, vabsq_s64(a4));
+	}
+	sums[0] += vaddvq_s64(s0);
+	sums[1] += vaddvq_s64(s1);
+	sums[2] += vaddvq_s64(s2);
+	sums[3] += vaddvq_s64(s3);
+	sums[4] += vaddvq_s64(s4);
+	return l;
+}
+
+static unsigned int
+order_residuals_neon(const long long *x, unsigned int l, unsigned int cap,
+		unsigned int order, long long *e)
+{
+	int64x2_t a0, a1, a2, a3, a4;
+
+	for (; l + 2 <= cap; l += 2) {
+		a0 = vld1q_s64((const int64_t *)(x + l));
+		a1 = vld1q_s64((const int64_t *)(x + l - 1));
+		a2 = vld1q_s64((const int64_t *)(x + l - 2));
+		a3 = vld1q_s64((const int64_t *)(x + l - 3));
+		a4 = vld1q_s64((const int64_t *)(x + l - 4));
+		a4 = vsubq_s64(a3, a4);
+		a3 = vsubq_s64(a2, a3);
+		a2 = vsubq_s64(a1, a2);
+		a1 = vsubq_s64(a0, a1);
+		a4 = vsubq_s64(a3, a4);
+		a3 = vsubq_s64(a2, a3);
+		a2 = vsubq_s64(a1, a2);
+		a4 = vsubq_s64(a3, a4);
+		a3 = vsubq_s64(a2, a3);
+		a4 = vsubq_s64(a3, a4);
+		switch (order) {
+		case 1:
+			a0 = a1;
+			break;
+		case 2:
+			a0 = a2;
+			break;
+		case 3:
+			a0 = a3;
+			break;
+		case 4:
+			a0 = a4;
+			break;
+		}
+		vst1q_s64((int64_t *)(e + l), a0);
+	}
+	return l;
+}
+#endif
+
+/* The widest kernel the CPU has, checked at run time on x86 */
+static unsigned int
+sum_residuals_wide(const long long *x, unsigned int l, unsigned int cap,
+		long long *sums)
+{
+#if defined(BTW_AVX2)
+	if (__builtin_cpu_supports("avx2")) {
+		return sum_residuals_avx2(x, l, cap, sums);
+	}
+#elif defined(BTW_NEON)
+	return sum_residuals_neon(x, l, cap, sums);
+#endif
+	(void)x;
+	(void)cap;
+	(void)sums;
+	return l;
+}
+
+static unsigned int
+order_residuals_wide(const long long *x, unsigned int l, unsigned int cap,
+		unsigned int order, long long *e)
+{
+#if defined(BTW_AVX2)
+	if (__builtin_cpu_supports("avx2")) {
+		return order_residuals_avx2(x, l, cap, order, e);
+	}
+#elif defined(BTW_NEON)
+	return order_residuals_neon(x, l, cap, order, e);
+#endif
+	(void)x;
+	(void)cap;
+	(void)order;
+	(void)e;
+	return l;
+}
+
+/* Sum the residuals of every predictor order over cap samples of x */
+static void
+sum_residuals(const long long *x, unsigned int cap, long long *sums)
+{
+	long long d[BTW_MAX_ORDER + 1] = { 0 };
+	unsigned int l, k, head = cap < BTW_MAX_ORDER ? cap : BTW_MAX_ORDER;
+
+	memset(sums, 0, sizeof(*sums) * (BTW_MAX_ORDER + 1));
+
+	for (l = 0; l < cap; l++) {
+		if (l == head) {
+			/* Past the first samples, whose orders are capped */
+			l = sum_residuals_wide(x, l, cap, sums);
+			if (l == cap) {
+				break;
+			}
+			/* The differences of the samples before l */
+			for (k = l - BTW_MAX_ORDER; k < l; k++) {
+				fixed_residuals(d, x[k], BTW_MAX_ORDER);
+			}
+		}
+		fixed_residuals(d, x[l], l < BTW_MAX_ORDER ? l : BTW_MAX_ORDER);
+		sums[0] += BTW_abs(d[0]);
+		sums[1] += BTW_abs(d[1]);
+		sums[2] += BTW_abs(d[2]);
+		sums[3] += BTW_abs(d[3]);
+		sums[4] += BTW_abs(d[4]);
+	}
+}
+
+/*
+ * Pick the predictor order of the cap samples x of a channel from their
+ * residual sums, return an estimate of the bits the channel will take to
+ * choose the stereo mode by. Sums can't tell the few large residuals that
+ * escape, folded or not, from many small ones, so escapes are left out of
+ * it: encode_channel counts them and is what sizes the output.
+ */
+static unsigned long long
+plan_channel(const long long *x, const long long *sums, unsigned int cap,
+		int max_rice_len, unsigned int value_bits, unsigned int *order)
+{
+	unsigned long long bits, folded;
+	unsigned int k;
+	int rice_len;
+
+	/* Order 1 leaves nothing but the first sample of a constant channel */
+	if (sums[1] == BTW_abs(x[0])) {
+		*order = BTW_ORDER_CONSTANT;
+		return value_bits;
+	}
+
+	*order = 0;
+	for (k = 1; k <= BTW_MAX_ORDER; k++) {
+		if (sums[k] < sums[*order]) {
+			*order = k;
+		}
+	}
+
+	/*
+	 * Folded residuals are about twice the magnitudes, and each takes 1
+	 * + rice_len bits besides its unary run
+	 */
+	folded = 2 * (unsigned long long)sums[*order];
+	rice_len = bits_required(folded / cap);
+	if (rice_len > max_rice_len) {
+		rice_len = max_rice_len;
+	}
+
+	bits = (unsigned long long)cap * (1 + rice_len) + (folded >> rice_len);
+	/* encode_channel falls back to verbatim when that is smaller */
+	return bits < (unsigned long long)cap * value_bits ? bits
+		: (unsigned long long)cap * value_bits;
+}
+
+/* Samples are at most 32 bits, so no rice_len past 31 is worth trying */
+#define BTW_RICE_SEARCH 32
+
+typedef struct {
+	unsigned int partition_order;
+	int rice_len[1 << BTW_PARTITION_ORDER];
+} btw_rice_plan;
+
+/*
+ * Bits the codes of the n zigzags mag take with rice_len k besides 1 + k
+ * each: the unary run, or the rest of the escape once it is that long.
+ * Residuals fit in escape_bits, so no escape is shorter than 1 + k.
+ */
+static unsigned long long
+rice_sum(const unsigned long long *mag, unsigned int n, int k,
+		int escape_bits)
+{
+	unsigned long long sum = 0, run;
+	unsigned long long escape = BTW_ESCAPE_RUN + escape_bits - 1 - k;
+	unsigned int j;
+
+	for (j = 0; j < n; j++) {
+		run = mag[j] >> k;
+		sum += run < BTW_ESCAPE_RUN ? run : escape;
+	}
+	return sum;
+}
+
+/*
+ * Choose the partition order and the rice_len of each partition to code the
+ * cap residuals e of a piece of "size" samples with, return exactly how
+ * many bits that takes. mag is scratch for cap zigzags. A residual of zigzag u
+ * takes 1 + k + (u >> k) bits with rice_len k, or BTW_ESCAPE_RUN +
+ * escape_bits once u >> k reaches BTW_ESCAPE_RUN, so the sums of rice_sum
+ * over the smallest partitions give the exact cost of every larger
+ * partition too.
+ *
+ * Without escapes that cost is convex in k, and so is the cost of a larger
+ * partition, whose best k lies between the best k of its smallest
+ * partitions. Sums are only taken over that range, which keeps this to a
+ * few passes over e. Escapes level the cost off for small k, so k is then
+ * only the nearest minimum to the estimate: the plan is the best of those
+ * tried rather than always the best there is.
+ */
+static unsigned long long
+plan_rice(const long long *e, unsigned int size, unsigned int cap,
+		int max_rice_len, int bits_per_rice_len, int escape_bits,
+		unsigned long long *mag, btw_rice_plan *plan)
+{
+	unsigned long long sums[1 << BTW_PARTITION_ORDER][BTW_RICE_SEARCH];
+	unsigned long long cost, best, total, best_total = ~0ULL;
+	unsigned int top = BTW_PARTITION_ORDER;
+	unsigned int p, f, g, j, group, n, hi, parts;
+	int k, lo_k = BTW_RICE_SEARCH, hi_k = 0;
+	int rice_len[1 << BTW_PARTITION_ORDER];
+	/* The range of k each smallest partition has sums for */
+	int lo_f[1 << BTW_PARTITION_ORDER], hi_f[1 << BTW_PARTITION_ORDER];
+	unsigned long long total_mag;
+
+	if (max_rice_len >= BTW_RICE_SEARCH) {
+		max_rice_len = BTW_RICE_SEARCH - 1;
+	}
+	memset(plan, 0, sizeof(*plan));
+
+	/* Partitions of small pieces hold at least one sample */
+	while (size >> top == 0) {
+		top--;
+	}
+	size >>= top;
+	parts = (cap + size - 1) / size;
+
+	/* Walk from the estimate to each smallest partition's best k */
+	for (f = 0; f < parts; f++) {
+		n = cap - f * size < size ? cap - f * size : size;
+		total_mag = 0;
+		for (j = f * size; j < f * size + n; j++) {
+			mag[j] = zigzag(e[j]);
+			total_mag += mag[j];
+		}
+
+		k = bits_required(total_mag / n);
+		if (k > max_rice_len) {
+			k = max_rice_len;
+		}
+		sums[f][k] = rice_sum(mag + f * size, n, k, escape_bits);
+		lo_f[f] = hi_f[f] = k;
+
+		while (lo_f[f] > 0) {
+			sums[f][k - 1] = rice_sum(mag + f * size, n, k - 1,
+				escape_bits);
+			lo_f[f]--;
+			if (sums[f][k - 1] > n + sums[f][k]) {
+				break;
+			}
+			k--;
+		}
+		while (k == hi_f[f] && k < max_rice_len) {
+			sums[f][k + 1] = rice_sum(mag + f * size, n, k + 1,
+				escape_bits);
+			hi_f[f]++;
+			if (sums[f][k + 1] + n >= sums[f][k]) {
+				break;
+			}
+			k++;
+		}
+		lo_k = k < lo_k ? k : lo_k;
+		hi_k = k > hi_k ? k : hi_k;
+	}
+
+	for (f = 0; f < parts; f++) {
+		n = cap - f * size < size ? cap - f * size : size;
+		for (k = lo_k; k <= hi_k; k++) {
+			if (k < lo_f[f] || k > hi_f[f]) {
+				sums[f][k] = rice_sum(mag + f * size, n, k,
+					escape_bits);
+			}
+		}
+	}
+
+	for (p = 0; p <= top; p++) {
+		group = 1U << (top - p);
+		total = BTW_PARTITION_BITS;
+
+		for (f = 0; f < parts; f += group) {
+			hi = (f + group) * size < cap ? (f + group) * size : cap;
+			best = ~0ULL;
+			for (k = lo_k; k <= hi_k; k++) {
+				cost = (unsigned long long)(hi - f * size)
+					* (1 + k);
+				for (g = f; g < f + group && g < parts; g++) {
+					cost += sums[g][k];
+				}
+				if (cost < best) {
+					best = cost;
+					rice_len[f / group] = k;
+				}
+			}
+			total += best + bits_per_rice_len;
+		}
+
+		if (total < best_total) {
+			best_total = total;
+			plan->partition_order = p;
+			memcpy(plan->rice_len, rice_len, sizeof(rice_len));
+		}
+	}
+	return best_total;
+}
+
+/* Signals load_block widens a block into: side and mid too for stereo */
+static unsigned int
+block_signals(const btw_def *def)
+{
+	return def->channels == 2 ? 4 : def->channels;
+}
+
+/* Scratch encode_blocks needs, in long longs, the last for the block's PCM */
+static unsigned long long
+encode_scratch(const btw_def *def)
+{
+	return (block_signals(def) + 2ULL) * def->block_size
+		+ ((unsigned long long)def->channels * def->block_size + 1) / 2;
+}
+
+/*
+ * Widen the cap samples per channel from sample i into x, one block_size
+ * run per signal, so that every piece of the block is coded from there
+ * and the samples are only read once.
+ */
+static void
+load_block(const btw_samples *samples, const btw_def *def,
+		unsigned long long i, unsigned int cap, long long *x)
+{
+	long long *l = x, *r = x + def->block_size;
+	long long *side = x + 2 * def->block_size;
+	long long *mid = x + 3 * def->block_size;
+	unsigned int chan, j;
+
+	for (chan = 0; chan < def->channels; chan++) {
+		load_samples(samples, def->channels, i, chan, cap,
+			x + (unsigned long long)chan * def->block_size);
+	}
+	if (def->channels == 2) {
+		for (j = 0; j < cap; j++) {
+			side[j] = l[j] - r[j];
+			mid[j] = (l[j] + r[j]) >> 1;
+		}
+	}
+}
+
+#ifdef BTW_STATS
+/* Count the fields of the codes of cap residuals e in partitions of size */
+static void
+stats_count_codes(btw_stats *s, const long long *e, unsigned int cap,
+		unsigned int size, const int *rice_len, int bits_per_rice_len,
+		int escape_bits)
+{
+	unsigned long long rice_un;
+	unsigned int l;
+	int k = 0;
+
+	for (l = 0; l < cap; l++) {
+		if (l % size == 0) {
+			k = rice_len[l / size];
+			s->rice_len_count[k]++;
+			s->rice_len_bits += bits_per_rice_len;
+		}
+		rice_un = zigzag(e[l]) >> k;
+		if (rice_un < BTW_ESCAPE_RUN) {
+			s->unary_bits += rice_un + 1;
+			s->remainder_bits += k;
+		} else {
+			s->unary_bits += BTW_ESCAPE_RUN;
+			s->remainder_bits += escape_bits;
+			s->escaped_codes++;
+		}
+	}
+}
+#endif
+
+/*
+ * Code the cap samples x of one channel of a piece of "size" samples,
+ * return the bits it takes. Samples and the value of a constant channel
+ * take value_bits bits, and escaped codes escape_bits. Nothing is written
+ * when bw is NULL. e is scratch for 2 * cap long longs.
+ */
+static unsigned long long
+encode_channel(btw_writer *bw, const long long *x, unsigned int size,
+		unsigned int cap, unsigned int order, int max_rice_len,
+		int bits_per_rice_len, unsigned int value_bits, int escape_bits,
+		long long *e)
+{
+	long long d[BTW_MAX_ORDER + 1] = { 0 };
+	unsigned long long bits, verbatim;
+	btw_rice_plan plan;
+	unsigned int l, k;
+	int rice_len = 0;
+	uint64_t mask = (1ULL << value_bits) - 1;
+#ifdef BTW_STATS
+	uint64_t start;
+#endif
+
+	if (order == BTW_ORDER_CONSTANT) {
+		if (bw) {
+			bw_put(bw, order, BTW_ORDER_BITS);
+			bw_put(bw, (uint64_t)x[0] & mask, value_bits);
+#ifdef BTW_STATS
+			if (bw->stats) {
+				bw->stats->constant_channels++;
+			}
+#endif
+		}
+		return BTW_ORDER_BITS + value_bits;
+	}
+
+	for (l = 0; l < cap; l++) {
+		if (l == BTW_MAX_ORDER) {
+			l = order_residuals_wide(x, l, cap, order, e);
+			if (l == cap) {
+				break;
+			}
+			for (k = l - BTW_MAX_ORDER; k < l; k++) {
+				fixed_residuals(d, x[k], BTW_MAX_ORDER);
+			}
+		}
+		fixed_residuals(d, x[l], l < BTW_MAX_ORDER ? l : BTW_MAX_ORDER);
+		e[l] = d[order];
+	}
+	bits = BTW_ORDER_BITS + plan_rice(e, size, cap, max_rice_len,
+		bits_per_rice_len, escape_bits, (unsigned long long *)e + cap,
+		&plan);
+
+	/* Codes that would take more than verbatim give way to it */
+	verbatim = BTW_ORDER_BITS + (unsigned long long)cap * value_bits;
+	if (bits > verbatim) {
+		if (!bw) {
+			return verbatim;
+		}
+		bw_put(bw, BTW_ORDER_VERBATIM, BTW_ORDER_BITS);
+		if (bw_room(bw, verbatim)) {
+			btw_writer w = *bw;
+
+			for (l = 0; l < cap; l++) {
+				bw_put_fast(&w, (uint64_t)x[l] & mask,
+					value_bits);
+			}
+			*bw = w;
+		} else {
+			for (l = 0; l < cap; l++) {
+				bw_put(bw, (uint64_t)x[l] & mask, value_bits);
+			}
+		}
+#ifdef BTW_STATS
+		if (bw->stats) {
+			bw->stats->verbatim_channels++;
+		}
+#endif
+		return verbatim;
+	}
+	if (!bw) {
+		return bits;
+	}
+#ifdef BTW_STATS
+	start = stat_ticks();
+#endif
+
+	bw_put(bw, order, BTW_ORDER_BITS);
+	bw_put(bw, plan.partition_order, BTW_PARTITION_BITS);
+
+	size >>= plan.partition_order;
+	/*
+	 * Only check for the end of the output when near it. The writer is
+	 * copied so its fields aren't reloaded after every store to out.
+	 */
+	if (bw_room(bw, bits)) {
+		btw_writer w = *bw;
+
+		for (l = 0; l < cap; l++) {
+			if (l % size == 0) {
+				rice_len = plan.rice_len[l / size];
+				bw_put_fast(&w, rice_len, bits_per_rice_len);
+			}
+			bw_put_rice(&w, e[l], rice_len, escape_bits);
+		}
+		*bw = w;
+	} else {
+		for (l = 0; l < cap; l++) {
+			if (l % size == 0) {
+				rice_len = plan.rice_len[l / size];
+				bw_put(bw, rice_len, bits_per_rice_len);
+			}
+			bw_put_rice_slow(bw, e[l], rice_len, escape_bits);
+		}
+	}
+
+#ifdef BTW_STATS
+	if (bw->stats) {
+		bw->stats->emission_cycles += stat_ticks() - start;
+		stats_count_codes(bw->stats, e, cap, size, plan.rice_len,
+			bits_per_rice_len, escape_bits);
+	}
+#endif
+	return bits;
+}
+
+/*
+ * Code the cap samples per channel from sample i of the block load_block
+ * widened into block as one piece of "size" samples, return the bits it
+ * takes. Nothing is written when bw is NULL. e is 2 * block_size long
+ * longs of scratch.
+ */
+static unsigned long long
+encode_piece(const long long *block, const btw_def *def, unsigned int i,
+		unsigned int size, unsigned int cap, btw_writer *bw,
+		long long *e)
+{
+	/* Channels coded by each stereo mode, as indexes into x */
+	static const unsigned char stereo_channels[4][2] = {
+		{ 0, 1 }, { 0, 2 }, { 2, 1 }, { 3, 2 }
+	};
+	unsigned int chan;
+	unsigned int order[4], mode, m;
+	unsigned long long cost[4], mode_cost, best_cost, bits = 0;
+	long long av_diff[BTW_MAX_ORDER + 1];
+	const long long *x[4];
+	int bits_per_rice_len = bits_required(def->bits_per_sample);
+	int max_rice_len = (1 << bits_per_rice_len) - 1;
+	/*
+	 * Side channels have one bit more, and their folded order 4
+	 * residuals six
+	 */
+	unsigned int value_bits = def->bits_per_sample;
+	int escape_bits = def->bits_per_sample + 6;
+
+	if (def->channels == 2) {
+		/* Left, right, side and mid */
+		for (chan = 0; chan < 4; chan++) {
+			x[chan] = block + chan * def->block_size + i;
+			sum_residuals(x[chan], cap, av_diff);
+			cost[chan] = plan_channel(x[chan], av_diff, cap,
+				max_rice_len, value_bits + (chan == 2),
+				&order[chan]);
+		}
+
+		mode = BTW_STEREO_LR;
+		best_cost = cost[0] + cost[1];
+		for (m = 1; m < 4; m++) {
+			mode_cost = cost[stereo_channels[m][0]]
+				+ cost[stereo_channels[m][1]];
+			if (mode_cost < best_cost) {
+				mode = m;
+				best_cost = mode_cost;
+			}
+		}
+
+		if (bw) {
+			bw_put(bw, mode, BTW_STEREO_BITS);
+		}
+		bits += BTW_STEREO_BITS;
+		for (chan = 0; chan < 2; chan++) {
+			m = stereo_channels[mode][chan];
+			bits += encode_channel(bw, x[m], size, cap, order[m],
+				max_rice_len, bits_per_rice_len,
+				value_bits + (m == 2), escape_bits, e);
+		}
+		return bits;
+	}
+
+	for (chan = 0; chan < def->channels; chan++) {
+		x[0] = block + (unsigned long long)chan * def->block_size + i;
+		sum_residuals(x[0], cap, av_diff);
+		plan_channel(x[0], av_diff, cap, max_rice_len, value_bits,
+			&order[0]);
+		bits += encode_channel(bw, x[0], size, cap, order[0],
+			max_rice_len, bits_per_rice_len, value_bits, escape_bits,
+			e);
+	}
+	return bits;
+}
+
+/* Pieces a block can be split into, as a tree in an array */
+#define BTW_SPLIT_NODES (2 * BTW_MAX_BLOCK_SIZE / BTW_MIN_BLOCK_SIZE)
+
+/*
+ * Find whether the piece of "size" samples at sample i of block, of which
+ * cap are left in the stream, codes smaller whole or split in halves, and
+ * so on for the halves. Marks split[node] for pieces to split, children of
+ * node being 2 * node + 1 and 2 * node + 2, and returns the bits it takes.
+ */
+static unsigned long long
+plan_split(const long long *block, const btw_def *def, unsigned int i,
+		unsigned int size, unsigned int cap, unsigned int node,
+		unsigned char *split, long long *e)
+{
+	unsigned long long whole, halves;
+	unsigned int half = size / 2;
+
+	whole = encode_piece(block, def, i, size, cap, NULL, e);
+	split[node] = 0;
+	if (size <= def->min_block_size || cap <= half) {
+		return whole;
+	}
+
+	halves = plan_split(block, def, i, half, half, 2 * node + 1, split, e);
+	halves += plan_split(block, def, i + half, half, cap - half,
+		2 * node + 2, split, e);
+	if (halves < whole) {
+		split[node] = 1;
+		return halves + 1;
+	}
+	return whole + 1;
+}
+
+static void
+encode_split(const long long *block, const btw_def *def, unsigned int i,
+		unsigned int size, unsigned int cap, unsigned int node,
+		const unsigned char *split, btw_writer *bw, long long *e)
+{
+	unsigned int half = size / 2;
+
+	if (size > def->min_block_size && cap > half) {
+		bw_put(bw, split[node], 1);
+		if (split[node]) {
+			encode_split(block, def, i, half, half, 2 * node + 1,
+				split, bw, e);
+			encode_split(block, def, i + half, half, cap - half,
+				2 * node + 2, split, bw, e);
+			return;
+		}
+	}
+	encode_piece(block, def, i, size, cap, bw, e);
+}
+
+/*
+ * Encode blocks first to end - 1, started as marks says. The writer
+ * position of blocks that start a seek table entry are stored to that entry
+ * in seek_table, if not NULL. The CRC-32C of their PCM is added to *crc.
+ * scratch holds encode_scratch(def) long longs.
+ */
+static void
+encode_blocks(const btw_samples *samples, const btw_def *def,
+		unsigned long long first, unsigned long long end,
+		btw_writer *bw, unsigned char *seek_table, long long *scratch,
+		uint32_t *crc, unsigned int marks)
+{
+	unsigned long long i = first * def->block_size;
+	unsigned char split[BTW_SPLIT_NODES];
+	long long *e = scratch + block_signals(def) * def->block_size;
+	unsigned char *pcm = (unsigned char *)(e + 2 * def->block_size);
+	unsigned int bytes = pcm_bytes(def), stride = def->channels * bytes;
+	const unsigned char *view;
+	unsigned long long start;
+	unsigned int cap, chan, last;
+#ifdef BTW_STATS
+	btw_stats_mark mark;
+	btw_stats *stats = bw->stats;
+#endif
+
+	for (; i < def->sample_count && i / def->block_size < end; i += cap) {
+#ifdef BTW_STATS
+		if (stats) {
+			mark.ticks = stat_ticks();
+			mark.emission_cycles = stats->emission_cycles;
+			mark.pos = bw->pos * 8 + bw->bits;
+			mark.coded_bits = stats_coded_bits(stats);
+		}
+#endif
+
+#if BTW_SEEK_INTERVAL
+		if (seek_table && (i / def->block_size) % BTW_SEEK_INTERVAL == 0) {
+			store_le64(seek_table
+				+ (i / def->block_size / BTW_SEEK_INTERVAL) * 8,
+				bw->pos);
+		}
+#else
+		(void)seek_table;
+#endif
+
+		if (def->sample_count - i < def->block_size) {
+			cap = def->sample_count - i;
+		} else {
+			cap = def->block_size;
+		}
+
+		start = bw->pos;
+		if (marks != BTW_MARK_NONE) {
+			last = marks == BTW_MARK_LAST
+				&& i + cap == def->sample_count;
+			bw_put(bw, last, 1);
+			if (last) {
+				bw_put(bw, cap, BTW_LAST_BLOCK_BITS);
+			}
+		}
+		load_block(samples, def, i, cap, scratch);
+		if (BTW_WRITE_FLAGS & BTW_FLAG_CRC) {
+			view = samples_pcm(samples, def, i);
+			for (chan = 0; !view && chan < def->channels; chan++) {
+				pack_samples(scratch + (unsigned long long)chan
+					* def->block_size, cap, bytes, stride,
+					pcm + chan * bytes);
+			}
+			*crc = crc32c(*crc, view ? view : pcm,
+				(unsigned long long)cap * stride);
+		}
+		if (def->min_block_size < def->block_size) {
+			plan_split(scratch, def, 0, def->block_size, cap, 0,
+				split, e);
+		} else {
+			split[0] = 0;
+		}
+		encode_split(scratch, def, 0, def->block_size, cap, 0, split,
+			bw, e);
+		bw_align(bw);
+		if (BTW_WRITE_FLAGS & BTW_FLAG_CRC && !bw->overflow) {
+			bw_put(bw, crc32c(0, bw->out + start, bw->pos - start)
+				& 0xffff, BTW_BLOCK_CHECK_BITS);
+		}
+
+#ifdef BTW_STATS
+		/* What wasn't spent on the codes went to choosing them */
+		if (stats) {
+			stats->analysis_cycles += stat_ticks() - mark.ticks
+				- (stats->emission_cycles - mark.emission_cycles);
+			stats->piece_bits += bw->pos * 8 + bw->bits - mark.pos
+				- (stats_coded_bits(stats) - mark.coded_bits);
+			stats->encoded_samples += (unsigned long long)cap
+				* def->channels;
+		}
+#endif
+	}
+}
+
+/*
+ * Copy def into d with the defaults filled in, return 0 if samples in fmt
+ * can't be encoded with it
+ */
+static int
+check_encode(const btw_def *def, btw_format fmt, btw_def *d)
+{
+	if (!def || !def->channels || !def->sample_rate
+			|| !def->bits_per_sample || def->bits_per_sample > 32
+			|| fmt > BTW_FMT_S32) {
+		return 0;
+	}
+	*d = *def;
+	return check_block_size(d);
+}
+
+static void *
+alloc_with(const btw_allocator *alloc, unsigned long long size)
+{
+	return alloc ? alloc->alloc(alloc->user, size) : malloc(size);
+}
+
+static void
+free_with(const btw_allocator *alloc, void *p)
+{
+	if (!alloc) {
+		free(p);
+	} else if (p) {
+		alloc->free(alloc->user, p);
+	}
+}
+
+/* Bytes a whole file encoded with the checked def may take */
+static unsigned long long
+max_encoded_size(const btw_def *def)
+{
+	return BTW_HEADER_SIZE + seek_entries(def, BTW_SEEK_INTERVAL) * 8
+		+ encoded_bound(def, def->sample_count)
+		+ (BTW_WRITE_FLAGS & BTW_FLAG_CRC ? BTW_FILE_CHECK_BITS / 8 : 0);
+}
+
+/* Write the file check over PCM whose CRC-32C is crc, if files have one */
+static void
+write_file_check(btw_writer *bw, uint32_t crc)
+{
+	if (BTW_WRITE_FLAGS & BTW_FLAG_CRC) {
+		bw_put(bw, crc, BTW_FILE_CHECK_BITS);
+#ifdef BTW_STATS
+		if (bw->stats) {
+			bw->stats->header_bits += BTW_FILE_CHECK_BITS;
+		}
+#endif
+	}
+}
+
+unsigned long long
+btw_max_encoded_size(const btw_def *def)
+{
+	btw_def d;
+
+	if (!check_encode(def, BTW_FMT_S32, &d) || !d.sample_count) {
+		return 0;
+	}
+	return max_encoded_size(&d);
+}
+
+/* Whether size bytes hold the header and seek table of the checked def */
+static int
+fits_header(const btw_def *def, unsigned long long size)
+{
+	return size >= BTW_HEADER_SIZE
+		+ seek_entries(def, BTW_SEEK_INTERVAL) * 8;
+}
+
+/*
+ * Encode in as a whole file with the checked def through bw, which must
+ * start at a buffer fits_header, with encode_scratch(def) long longs of
+ * scratch
+ */
+static int
+encode_with(const btw_samples *in, const btw_def *def, btw_writer *bw,
+		long long *scratch, unsigned long long *out_len)
+{
+	uint32_t crc = 0;
+
+	write_header(bw, def, BTW_SEEK_INTERVAL, write_flags(in->fmt));
+#ifdef BTW_STATS
+	if (bw->stats) {
+		bw->stats->header_bits += bw->pos * 8;
+	}
+#endif
+	encode_blocks(in, def, 0, block_count(def), bw,
+		bw->out + BTW_HEADER_SIZE, scratch, &crc, BTW_MARK_NONE);
+	write_file_check(bw, crc);
+
+	if (bw->overflow) {
+		return BTW_ERR_SPACE;
+	}
+	*out_len = bw_finish(bw);
+	return BTW_OK;
+}
+
+/* Encode in as a whole file with the checked def into size bytes of out */
+static int
+encode_to(const btw_samples *in, const btw_def *def, unsigned char *out,
+		unsigned long long size, unsigned long long *out_len,
+		const btw_allocator *alloc)
+{
+	long long *scratch;
+	btw_writer bw;
+	int r;
+
+	if (!fits_header(def, size)) {
+		return BTW_ERR_SPACE;
+	}
+	scratch = (long long *)alloc_with(alloc, encode_scratch(def)
+		* sizeof(*scratch));
+	if (!scratch) {
+		return BTW_ERR_NOMEM;
+	}
+	bw_init(&bw, out, size, 0);
+	r = encode_with(in, def, &bw, scratch, out_len);
+	free_with(alloc, scratch);
+	return r;
+}
+
+static unsigned char *
+encode_all(const btw_samples *in, const btw_def *def,
+		unsigned long long *out_len)
+{
+	unsigned long long max_len;
+	unsigned char *output, *shrunk;
+	btw_def d;
+
+	if (!out_len || !check_encode(def, in->fmt, &d) || !d.sample_count) {
+		return NULL;
+	}
+	*out_len = 0;
+
+	max_len = max_encoded_size(&d);
+	output = (unsigned char *)malloc(max_len);
+	if (!output) {
+		return NULL;
+	}
+	if (encode_to(in, &d, output, max_len, out_len, NULL) != BTW_OK) {
+		free(output);
+		return NULL;
+	}
+
+	/* Give back what the bound left unused */
+	shrunk = (unsigned char *)realloc(output, *out_len);
+	return shrunk ? shrunk : output;
+}
+
+int
+btw_encode_into(const void *samples, btw_format fmt, const btw_def *def,
+		unsigned char *out, unsigned long long out_size,
+		unsigned long long *out_len, const btw_allocator *alloc)
+{
+	btw_samples in;
+	btw_def d;
+
+	if (!samples || !out || !out_len || !check_encode(def, fmt, &d)
+			|| !d.sample_count) {
+		return BTW_ERR_INVALID;
+	}
+	samples_init(&in, (void *)samples, NULL, fmt, 0);
+	return encode_to(&in, &d, out, out_size, out_len, alloc);
+}
+
+unsigned char *
+btw_encode_fmt(const void *samples, btw_format fmt, const btw_def *def,
+		unsigned long long *out_len)
+{
+	btw_samples in;
+
+	if (!samples) {
+		return NULL;
+	}
+	samples_init(&in, (void *)samples, NULL, fmt, 0);
+	return encode_all(&in, def, out_len);
+}
+
+unsigned char *
+btw_encode_planar(const void *const *planes, btw_format fmt,
+		const btw_def *def, unsigned long long *out_len)
+{
+	btw_samples in;
+
+	if (!planes) {
+		return NULL;
+	}
+	samples_init(&in, NULL, (void *const *)planes, fmt, 0);
+	return encode_all(&in, def, out_len);
+}
+
+#ifdef BTW_NATIVE_FMT
+unsigned char *
+btw_encode(btw_sample_fmt *samples, btw_def *def, unsigned long long *out_len)
+{
+	return btw_encode_fmt(samples, BTW_NATIVE_FMT, def, out_len);
+}
+#endif
+
+unsigned char *
+btw_encode_u8(const uint8_t *samples, const btw_def *def,
+		unsigned long long *out_len)
+{
+	return btw_encode_fmt(samples, BTW_FMT_U8, def, out_len);
+}
+
+unsigned char *
+btw_encode_s16(const int16_t *samples, const btw_def *def,
+		unsigned long long *out_len)
+{
+	return btw_encode_fmt(samples, BTW_FMT_S16, def, out_len);
+}
+
+unsigned char *
+btw_encode_s24_packed(const unsigned char *samples, const btw_def *def,
+		unsigned long long *out_len)
+{
+	return btw_encode_fmt(samples, BTW_FMT_S24, def, out_len);
+}
+
+unsigned char *
+btw_encode_s32(const int32_t *samples, const btw_def *def,
+		unsigned long long *out_len)
+{
+	return btw_encode_fmt(samples, BTW_FMT_S32, def, out_len);
+}
+
+#ifndef BTW_NO_THREADS
+typedef struct {
+	btw_task_fn fn;
+	void *arg;
+	unsigned int first, stride, count;
+} btw_worker;
+
+static void
+run_worker(btw_worker *w)
+{
+	unsigned int i;
+
+	for (i = w->first; i < w->count; i += w->stride) {
+		w->fn(w->arg, i);
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI
+worker_main(LPVOID w)
+{
+	run_worker((btw_worker *)w);
+	return 0;
+}
+#else
+static void *
+worker_main(void *w)
+{
+	run_worker((btw_worker *)w);
+	return NULL;
+}
+#endif
+#endif /* BTW_NO_THREADS */
+
+static unsigned int
+cpu_count(void)
+{
+#if defined(BTW_NO_THREADS)
+	return 1;
+#elif defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#else
+	return 1;
+#endif
+}
+
+/*
+ * Run fn for tasks 0 to count - 1 on up to "threads" threads, the calling
+ * one included. Tasks whose thread can't be started run on the caller.
+ */
+static void
+run_tasks(btw_task_fn fn, void *arg, unsigned int count, unsigned int threads)
+{
+	unsigned int t;
+#ifndef BTW_NO_THREADS
+	btw_worker *workers = NULL;
+#ifdef _WIN32
+	HANDLE *handles = NULL;
+#else
+	pthread_t *handles = NULL;
+	int *started = NULL;
+#endif
+
+	if (threads > count) {
+		threads = count;
+	}
+	if (threads > 1) {
+		workers = (btw_worker *)malloc(threads * sizeof(*workers));
+#ifdef _WIN32
+		handles = (HANDLE *)malloc(threads * sizeof(*handles));
+#else
+		handles = (pthread_t *)malloc(threads * sizeof(*handles));
+#endif
+#ifndef _WIN32
+		started = (int *)calloc(threads, sizeof(*started));
+		if (!started) {
+			threads = 1;
+		}
+#endif
+	}
+	if (threads > 1 && workers && handles) {
+		for (t = 0; t < threads; t++) {
+			workers[t].fn = fn;
+			workers[t].arg = arg;
+			workers[t].first = t;
+			workers[t].stride = threads;
+			workers[t].count = count;
+		}
+		for (t = 1; t < threads; t++) {
+#ifdef _WIN32
+			handles[t] = CreateThread(NULL, 0, worker_main,
+				&workers[t], 0, NULL);
+#else
+			started[t] = !pthread_create(&handles[t], NULL,
+				worker_main, &workers[t]);
+#endif
+		}
+		run_worker(&workers[0]);
+		for (t = 1; t < threads; t++) {
+#ifdef _WIN32
+			if (handles[t]) {
+				WaitForSingleObject(handles[t], INFINITE);
+				CloseHandle(handles[t]);
+			} else {
+				run_worker(&workers[t]);
+			}
+#else
+			if (started[t]) {
+				pthread_join(handles[t], NULL);
+			} else {
+				run_worker(&workers[t]);
+			}
+#endif
+		}
+		free(workers);
+		free(handles);
+#ifndef _WIN32
+		free(started);
+#endif
+		return;
+	}
+	free(workers);
+	free(handles);
+#ifndef _WIN32
+	free(started);
+#endif
+#else
+	(void)threads;
+#endif /* BTW_NO_THREADS */
+
+	for (t = 0; t < count; t++) {
+		fn(arg, t);
+	}
+}
+
+typedef struct {
+	const btw_samples *samples;
+	const btw_def *def;
+	unsigned long long blocks_per_group;
+	unsigned char *seek_table;	/* Relative to each group's buffer */
+	unsigned char **bufs;
+	unsigned long long *lens;
+	uint32_t *crcs;		/* Of each group's PCM */
+#ifdef BTW_STATS
+	btw_stats *stats;	/* One per group, NULL to count nothing */
+#endif
+} btw_encode_job;
+
+static void
+encode_group(void *arg, unsigned int group)
+{
+	btw_encode_job *job = (btw_encode_job *)arg;
+	unsigned long long first = group * job->blocks_per_group;
+	unsigned long long samples = job->blocks_per_group
+		* job->def->block_size;
+	long long *scratch;
+	btw_writer bw;
+
+	if (samples > job->def->sample_count - first * job->def->block_size) {
+		samples = job->def->sample_count - first * job->def->block_size;
+	}
+
+	scratch = (long long *)malloc(encode_scratch(job->def)
+		* sizeof(*scratch));
+	job->bufs[group] = (unsigned char *)malloc(
+		encoded_bound(job->def, samples));
+	if (!scratch || !job->bufs[group]) {
+		free(scratch);
+		free(job->bufs[group]);
+		job->bufs[group] = NULL;
+		return;
+	}
+
+	bw_init(&bw, job->bufs[group], encoded_bound(job->def, samples), 0);
+#ifdef BTW_STATS
+	bw.stats = job->stats ? job->stats + group : NULL;
+#endif
+	encode_blocks(job->samples, job->def, first,
+		first + job->blocks_per_group, &bw, job->seek_table, scratch,
+		job->crcs + group, BTW_MARK_NONE);
+	job->lens[group] = bw_finish(&bw);
+	free(scratch);
+	if (bw.overflow) {
+		free(job->bufs[group]);
+		job->bufs[group] = NULL;
+	}
+}
+
+static unsigned char *
+encode_mt(const btw_samples *in, const btw_def *def, unsigned int threads,
+		const btw_thread_pool *pool, unsigned long long *out_len)
+{
+	unsigned long long blocks, entries, total, base, samples;
+	uint32_t crc = 0;
+#if BTW_SEEK_INTERVAL
+	unsigned long long k, last;
+#endif
+	unsigned int groups, g;
+	unsigned char *output = NULL;
+	btw_encode_job job;
+	btw_writer bw;
+	btw_def d;
+
+	if (!out_len || !check_encode(def, in->fmt, &d) || !d.sample_count) {
+		return NULL;
+	}
+	*out_len = 0;
+	def = &d;
+
+	if (!threads) {
+		threads = cpu_count();
+	}
+
+	/* Groups own whole seek table entries so they can be rebased */
+	blocks = block_count(def);
+	job.blocks_per_group = (blocks + threads - 1) / threads;
+#if BTW_SEEK_INTERVAL
+	job.blocks_per_group = (job.blocks_per_group + BTW_SEEK_INTERVAL - 1)
+		/ BTW_SEEK_INTERVAL * BTW_SEEK_INTERVAL;
+#endif
+	groups = (blocks + job.blocks_per_group - 1) / job.blocks_per_group;
+	entries = seek_entries(def, BTW_SEEK_INTERVAL);
+
+	job.samples = in;
+	job.def = def;
+	job.seek_table = (unsigned char *)malloc(entries * 8 + 1);
+	job.bufs = (unsigned char **)calloc(groups, sizeof(*job.bufs));
+	job.lens = (unsigned long long *)calloc(groups, sizeof(*job.lens));
+	job.crcs = (uint32_t *)calloc(groups, sizeof(*job.crcs));
+#ifdef BTW_STATS
+	/* Groups count apart so they don't race, and are added up after */
+	job.stats = attached_stats ? (btw_stats *)calloc(groups,
+		sizeof(*job.stats)) : NULL;
+#endif
+
+	if (job.seek_table && job.bufs && job.lens && job.crcs) {
+		if (pool) {
+			pool->run(pool->pool, encode_group, &job, groups);
+		} else {
+			run_tasks(encode_group, &job, groups, threads);
+		}
+	}
+#ifdef BTW_STATS
+	for (g = 0; job.stats && g < groups; g++) {
+		stats_add(attached_stats, job.stats + g);
+	}
+	free(job.stats);
+#endif
+
+	/* Stitch the groups together after the header */
+	total = BTW_HEADER_SIZE + entries * 8
+		+ (BTW_WRITE_FLAGS & BTW_FLAG_CRC ? BTW_FILE_CHECK_BITS / 8 : 0);
+	for (g = 0; job.bufs && job.lens && job.crcs && g < groups; g++) {
+		if (!job.bufs[g]) {
+			break;
+		}
+		total += job.lens[g];
+	}
+	if (job.bufs && job.lens && job.crcs && g == groups) {
+		output = (unsigned char *)malloc(total);
+	}
+
+	if (output) {
+		bw_init(&bw, output, total, 0);
+		write_header(&bw, def, BTW_SEEK_INTERVAL,
+			write_flags(in->fmt));
+		base = bw.pos;
+#ifdef BTW_STATS
+		if (bw.stats) {
+			bw.stats->header_bits += bw.pos * 8;
+		}
+#endif
+
+		for (g = 0; g < groups; g++) {
+			memcpy(output + base, job.bufs[g], job.lens[g]);
+
+#if BTW_SEEK_INTERVAL
+			k = g * job.blocks_per_group / BTW_SEEK_INTERVAL;
+			last = (g + 1) * job.blocks_per_group / BTW_SEEK_INTERVAL;
+			for (; k < last && k < entries; k++) {
+				store_le64(output + BTW_HEADER_SIZE + k * 8, base
+					+ load_le64(job.seek_table + k * 8));
+			}
+#endif
+			base += job.lens[g];
+
+			/* The file check carries each group's PCM on */
+			samples = def->sample_count - g * job.blocks_per_group
+				* def->block_size;
+			if (samples > job.blocks_per_group * def->block_size) {
+				samples = job.blocks_per_group * def->block_size;
+			}
+			crc = crc32c_combine(crc, job.crcs[g], samples
+				* def->channels * pcm_bytes(def));
+		}
+		bw_init(&bw, output, total, base);
+		write_file_check(&bw, crc);
+		*out_len = total;
+	}
+
+	for (g = 0; job.bufs && g < groups; g++) {
+		free(job.bufs[g]);
+	}
+	free(job.bufs);
+	free(job.lens);
+	free(job.crcs);
+	free(job.seek_table);
+	return output;
+}
+
+unsigned char *
+btw_encode_mt_fmt(const void *samples, btw_format fmt, const btw_def *def,
+		unsigned int threads, const btw_thread_pool *pool,
+		unsigned long long *out_len)
+{
+	btw_samples in;
+
+	if (!samples) {
+		return NULL;
+	}
+	samples_init(&in, (void *)samples, NULL, fmt, 0);
+	return encode_mt(&in, def, threads, pool, out_len);
+}
+
+unsigned char *
+btw_encode_mt_planar(const void *const *planes, btw_format fmt,
+		const btw_def *def, unsigned int threads,
+		const btw_thread_pool *pool, unsigned long long *out_len)
+{
+	btw_samples in;
+
+	if (!planes) {
+		return NULL;
+	}
+	samples_init(&in, NULL, (void *const *)planes, fmt, 0);
+	return encode_mt(&in, def, threads, pool, out_len);
+}
+
+#ifdef BTW_NATIVE_FMT
+unsigned char *
+btw_encode_mt(btw_sample_fmt *samples, btw_def *def, unsigned int threads,
+		const btw_thread_pool *pool, unsigned long long *out_len)
+{
+	return btw_encode_mt_fmt(samples, BTW_NATIVE_FMT, def, threads, pool,
+		out_len);
+}
+#endif
+
+struct btw_encoder {
+	btw_def def;
+	btw_write_fn write;
+	void *user;
+	unsigned int seek_interval;
+	unsigned int flags;		/* Of the header */
+	unsigned long long fed;		/* Samples per channel so far */
+	unsigned long long pos;		/* Bytes written so far */
+	unsigned int pending;		/* Samples per channel in block */
+	btw_samples block;
+	unsigned char *out;
+	long long *scratch;
+	uint32_t crc;			/* Of the PCM so far */
+	int failed;
+};
+
+/* Encode and write out the buffered samples as one block, started as marks */
+static int
+encoder_flush(btw_encoder *enc, unsigned int marks)
+{
+	unsigned long long entry, len;
+	unsigned char offset[8];
+	btw_def block_def = enc->def;
+	btw_writer bw;
+
+	if (enc->seek_interval && (enc->fed / enc->def.block_size)
+			% enc->seek_interval == 0) {
+		entry = enc->fed / enc->def.block_size / enc->seek_interval;
+		store_le64(offset, enc->pos);
+		if (enc->write(enc->user, BTW_HEADER_SIZE + entry * 8,
+				offset, 8)) {
+			return -1;
+		}
+	}
+
+	block_def.sample_count = enc->pending;
+	bw_init(&bw, enc->out, encoded_bound(&enc->def, enc->def.block_size), 0);
+	encode_blocks(&enc->block, &block_def, 0, 1, &bw, NULL, enc->scratch,
+		&enc->crc, marks);
+	len = bw_finish(&bw);
+	if (bw.overflow) {
+		return -1;
+	}
+
+	if (enc->write(enc->user, enc->pos, enc->out, len)) {
+		return -1;
+	}
+	enc->pos += len;
+	enc->fed += enc->pending;
+	enc->pending = 0;
+	return 0;
+}
+
+/* Write the last block of an open-ended stream without samples */
+static int
+encoder_close(btw_encoder *enc)
+{
+	unsigned long long len;
+	btw_writer bw;
+
+	bw_init(&bw, enc->out, encoded_bound(&enc->def, enc->def.block_size), 0);
+	bw_put(&bw, 1, 1);
+	bw_put(&bw, 0, BTW_LAST_BLOCK_BITS);
+	bw_align(&bw);
+	if (BTW_WRITE_FLAGS & BTW_FLAG_CRC) {
+		bw_put(&bw, crc32c(0, enc->out, bw.pos) & 0xffff,
+			BTW_BLOCK_CHECK_BITS);
+	}
+	len = bw_finish(&bw);
+	if (enc->write(enc->user, enc->pos, enc->out, len)) {
+		return -1;
+	}
+	enc->pos += len;
+	return 0;
+}
+
+btw_encoder *
+btw_encoder_init_fmt(const btw_def *def, btw_format fmt, btw_write_fn write,
+		void *user)
+{
+	static const unsigned char zeros[64] = { 0 };
+	unsigned char header[BTW_HEADER_SIZE];
+	unsigned long long table, len;
+	btw_encoder *enc;
+	btw_writer bw;
+
+	if (!write) {
+		return NULL;
+	}
+
+	enc = (btw_encoder *)calloc(1, sizeof(*enc));
+	if (!enc) {
+		return NULL;
+	}
+	if (!check_encode(def, fmt, &enc->def)) {
+		free(enc);
+		return NULL;
+	}
+	enc->write = write;
+	enc->user = user;
+	enc->block.fmt = fmt;
+
+	/* The seek table's size depends on the length */
+	enc->flags = write_flags(fmt);
+	if (!def->sample_count || def->sample_count == BTW_UNKNOWN_COUNT) {
+		enc->def.sample_count = BTW_UNKNOWN_COUNT;
+		enc->flags |= BTW_FLAG_OPEN;
+	} else {
+		enc->seek_interval = BTW_SEEK_INTERVAL;
+	}
+
+	enc->block.data = (unsigned char *)malloc(samples_size(&enc->def, fmt,
+		enc->def.block_size));
+	enc->out = (unsigned char *)malloc(encoded_bound(&enc->def,
+		enc->def.block_size));
+	enc->scratch = (long long *)malloc(encode_scratch(&enc->def)
+		* sizeof(*enc->scratch));
+	if (!enc->block.data || !enc->out || !enc->scratch) {
+		goto fail;
+	}
+
+	bw_init(&bw, header, sizeof(header), 0);
+	write_header(&bw, &enc->def, enc->seek_interval, enc->flags);
+#ifdef BTW_STATS
+	if (bw.stats) {
+		bw.stats->header_bits += bw.pos * 8;
+	}
+#endif
+	if (write(user, 0, header, BTW_HEADER_SIZE)) {
+		goto fail;
+	}
+
+	/* Room for the seek table, which is filled in as blocks are started */
+	table = bw.pos - BTW_HEADER_SIZE;
+	for (enc->pos = BTW_HEADER_SIZE; table; table -= len) {
+		len = table < sizeof(zeros) ? table : sizeof(zeros);
+		if (write(user, enc->pos, zeros, len)) {
+			goto fail;
+		}
+		enc->pos += len;
+	}
+	return enc;
+
+fail:
+	free(enc->block.data);
+	free(enc->out);
+	free(enc->scratch);
+	free(enc);
+	return NULL;
+}
+
+#ifdef BTW_NATIVE_FMT
+btw_encoder *
+btw_encoder_init(const btw_def *def, btw_write_fn write, void *user)
+{
+	return btw_encoder_init_fmt(def, BTW_NATIVE_FMT, write, user);
+}
+#endif
+
+int
+btw_encoder_feed(btw_encoder *enc, const btw_sample_fmt *samples,
+		unsigned long long count)
+{
+	const unsigned char *p = (const unsigned char *)samples;
+	unsigned long long take, frame;
+
+	if (!enc || (!samples && count) || enc->failed) {
+		return -1;
+	}
+	frame = enc->def.channels * format_size(enc->block.fmt);
+	if (enc->def.sample_count != BTW_UNKNOWN_COUNT
+			&& count > enc->def.sample_count - enc->fed - enc->pending) {
+		enc->failed = 1;
+		return -1;
+	}
+
+	while (count) {
+		/*
+		 * Open-ended streams keep a full block until more samples show
+		 * it isn't the last
+		 */
+		if (enc->pending == enc->def.block_size
+				&& encoder_flush(enc, BTW_MARK_MORE)) {
+			enc->failed = 1;
+			return -1;
+		}
+		take = enc->def.block_size - enc->pending;
+		if (take > count) {
+			take = count;
+		}
+		memcpy(enc->block.data + enc->pending * frame, p, take * frame);
+		enc->pending += take;
+		p += take * frame;
+		count -= take;
+
+		if (!(enc->flags & BTW_FLAG_OPEN)
+				&& enc->pending == enc->def.block_size
+				&& encoder_flush(enc, BTW_MARK_NONE)) {
+			enc->failed = 1;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+btw_encoder_finish(btw_encoder *enc, unsigned long long *out_len)
+{
+	unsigned char header[BTW_HEADER_SIZE], check[BTW_FILE_CHECK_BITS / 8];
+	int r = -1;
+	btw_writer bw;
+
+	if (!enc) {
+		return -1;
+	}
+
+	if (enc->failed) {
+		goto done;
+	}
+	if (enc->pending ? encoder_flush(enc, enc->flags & BTW_FLAG_OPEN
+			? BTW_MARK_LAST : BTW_MARK_NONE)
+			: enc->flags & BTW_FLAG_OPEN && encoder_close(enc)) {
+		goto done;
+	}
+	if (BTW_WRITE_FLAGS & BTW_FLAG_CRC) {
+		bw_init(&bw, check, sizeof(check), 0);
+		write_file_check(&bw, enc->crc);
+		if (enc->write(enc->user, enc->pos, check, sizeof(check))) {
+			goto done;
+		}
+		enc->pos += sizeof(check);
+	}
+
+	if (enc->def.sample_count != BTW_UNKNOWN_COUNT) {
+		/* Every declared sample must have been fed */
+		if (enc->fed != enc->def.sample_count) {
+			goto done;
+		}
+	} else {
+		/*
+		 * Patch in the length. Sinks that can't seek fail this and
+		 * keep the stream as it is, which ends with its last block.
+		 */
+		enc->def.sample_count = enc->fed;
+		bw_init(&bw, header, sizeof(header), 0);
+		write_header(&bw, &enc->def, 0, enc->flags);
+		(void)enc->write(enc->user, 0, header, BTW_HEADER_SIZE);
+	}
+
+	if (out_len) {
+		*out_len = enc->pos;
+	}
+	r = 0;
+
+done:
+	free(enc->block.data);
+	free(enc->out);
+	free(enc->scratch);
+	free(enc);
+	return r;
+}
+
+typedef struct {
+	unsigned int version;
+	unsigned int flags;
+	int aligned;			/* Blocks are padded to a byte */
+	int cut;			/* An open-ended stream ends without
+					   its last block and file check */
+	unsigned int seek_interval;	/* 0 when there is no seek table */
+	const unsigned char *seek_table;
+	unsigned long long data_pos;	/* Byte offset of the first block */
+} btw_layout;
+
+/* Least bits a residual is coded in */
+static unsigned int
+residual_bits(const btw_layout *lay)
+{
+	return lay->flags & BTW_FLAG_ZIGZAG ? 1 : 2;
+}
+
+/*
+ * Bytes of header given at least its first BTW_HEADER_SIZE_FIXED bytes, or
+ * BTW_HEADER_SIZE_V1 for version 1
+ */
+static unsigned int
+header_size(const unsigned char *data)
+{
+	if (data[3] == BTW_VERSION_V1) {
+		return BTW_HEADER_SIZE_V1;
+	}
+	return data[20] & BTW_FLAG_BLOCK_SIZE
+		? BTW_HEADER_SIZE : BTW_HEADER_SIZE_FIXED;
+}
+
+/*
+ * Parse the header into def and lay, return 0 if it isn't a BTW header.
+ * Every field is byte aligned, so each is one load.
+ */
+static int
+read_header(const unsigned char *data, btw_def *def, btw_layout *lay)
+{
+	unsigned long long blocks;
+	btw_def d;
+
+	if (data[0] != 'b' || data[1] != 't' || data[2] != 'w') {
+		return 0;
+	}
+	if (data[3] == BTW_VERSION_V1) {
+		lay->version = 1;
+	} else if (data[3] == BTW_VERSION) {
+		lay->version = data[3];
+	} else {
+		return 0;
+	}
+
+	d.sample_count = load_le64(data + 4);
+	d.channels = load_le16(data + 12);
+	d.bits_per_sample = load_le16(data + 14);
+	d.sample_rate = load_le32(data + 16);
+
+	/* Version 1 blocks follow each other without padding */
+	lay->aligned = lay->version >= 2;
+	lay->cut = 0;
+	lay->flags = 0;
+	lay->seek_interval = 0;
+	lay->seek_table = NULL;
+	lay->data_pos = BTW_HEADER_SIZE_V1;
+	d.block_size = d.min_block_size = BTW_BLOCK_SIZE;
+
+	if (lay->version >= 2) {
+		lay->flags = load_le16(data + 20);
+		if (lay->flags & ~BTW_FLAGS) {
+			return 0;
+		}
+		lay->seek_interval = load_le16(data + 22);
+		lay->data_pos = BTW_HEADER_SIZE_FIXED;
+
+		if (lay->flags & BTW_FLAG_BLOCK_SIZE) {
+			d.block_size = load_le16(data + 24);
+			d.min_block_size = load_le16(data + 26);
+			if (!d.block_size || !d.min_block_size
+					|| !check_block_size(&d)) {
+				return 0;
+			}
+			lay->data_pos = BTW_HEADER_SIZE;
+		}
+
+		if (lay->seek_interval) {
+			blocks = block_count(&d);
+			lay->seek_table = data + lay->data_pos;
+			lay->data_pos += (blocks + lay->seek_interval - 1)
+				/ lay->seek_interval * 8;
+		}
+	}
+
+	*def = d;
+	return 1;
+}
+
+/* Bits in len bytes, ~0 if len isn't known either */
+static unsigned long long
+len_bits(unsigned long long len)
+{
+	return len > ~0ULL / 8 ? ~0ULL : len * 8;
+}
+
+/*
+ * read_header for data of len bytes, ~0 if not known, which must hold the
+ * header, the seek table and at least residual_bits for every sample. When
+ * channels can be constant, every block but the last must still hold a
+ * value or the residuals of each channel, and its check.
+ */
+static int
+check_header(const unsigned char *data, unsigned long long len,
+		btw_def *def, btw_layout *lay)
+{
+	unsigned long long bits, least;
+
+	if (len < BTW_HEADER_SIZE_V1
+			|| (data[3] != BTW_VERSION_V1
+				&& len < BTW_HEADER_SIZE_FIXED)
+			|| len < header_size(data)
+			|| !read_header(data, def, lay) || lay->data_pos > len) {
+		return 0;
+	}
+	if (len == ~0ULL || !def->channels || !def->sample_count
+			|| def->sample_count == BTW_UNKNOWN_COUNT) {
+		return 1;
+	}
+	bits = len_bits(len - lay->data_pos);
+	if (!(lay->flags & BTW_FLAG_CONSTANT)) {
+		return def->sample_count
+			<= bits / (residual_bits(lay) * def->channels);
+	}
+
+	least = (unsigned long long)residual_bits(lay) * def->block_size;
+	if (least > BTW_ORDER_BITS + def->bits_per_sample) {
+		least = BTW_ORDER_BITS + def->bits_per_sample;
+	}
+	least *= def->channels;
+	if (lay->flags & BTW_FLAG_CRC) {
+		least += BTW_BLOCK_CHECK_BITS;
+	}
+	if (lay->aligned) {
+		least = (least + 7) & ~7ULL;
+	}
+	/* The last block takes a bit at least */
+	return bits && (def->sample_count - 1) / def->block_size
+		<= (bits - 1) / least;
+}
+
+void
+btw_read_metadata(const unsigned char *data, btw_def *def)
+{
+	btw_layout lay;
+
+	if (!def || !data) {
+		return;
+	}
+
+	if (!read_header(data, def, &lay)) {
+		memset(def, 0, sizeof(*def));
+	}
+}
+
+int
+btw_probe(const unsigned char *data, unsigned long long len, btw_def *def)
+{
+	btw_layout lay;
+
+	if (!data || !def) {
+		return BTW_ERR_INVALID;
+	}
+	if (len < BTW_HEADER_SIZE_V1
+			|| (data[3] != BTW_VERSION_V1
+				&& len < BTW_HEADER_SIZE_FIXED)
+			|| len < header_size(data)
+			|| !read_header(data, def, &lay)) {
+		memset(def, 0, sizeof(*def));
+		return BTW_ERR_CORRUPT;
+	}
+	return BTW_OK;
+}
+
+int
+btw_read_metadata_n(const unsigned char *data, unsigned long long len,
+		btw_def *def)
+{
+	btw_layout lay;
+
+	if (!data || !def) {
+		return BTW_ERR_INVALID;
+	}
+	return check_header(data, len, def, &lay) ? BTW_OK : BTW_ERR_CORRUPT;
+}
+
+/*
+ * Undo the prediction of order "order" on cap residuals in place. The sums
+ * wrap instead of overflowing, which only corrupt streams can make them do.
+ */
+static void
+restore_channel(long long *x, unsigned int cap, unsigned int order)
+{
+	uint64_t h[BTW_MAX_ORDER + 1] = { 0 };
+	unsigned int j;
+
+	for (j = 0; j < cap; j++) {
+		h[4] = h[3];
+		h[3] = h[2];
+		h[2] = h[1];
+		h[1] = h[0];
+		h[0] = (uint64_t)x[j] + fixed_prediction(h + 1,
+			j < order ? j : order);
+		x[j] = (long long)h[0];
+	}
+}
+
+/*
+ * Turn the two channels coded by stereo mode "mode" back into left, right,
+ * wrapping like restore_channel
+ */
+static void
+restore_stereo(long long *x0, long long *x1, unsigned int cap,
+		unsigned int mode)
+{
+	uint64_t mid;
+	unsigned int j;
+
+	for (j = 0; j < cap; j++) {
+		switch (mode) {
+		case BTW_STEREO_LS:
+			x1[j] = (long long)((uint64_t)x0[j] - (uint64_t)x1[j]);
+			break;
+		case BTW_STEREO_SR:
+			x0[j] = (long long)((uint64_t)x0[j] + (uint64_t)x1[j]);
+			break;
+		case BTW_STEREO_MS:
+			/* left + right has the parity of the side */
+			mid = (uint64_t)x0[j] * 2 + (x1[j] & 1);
+			x0[j] = (long long)(mid + (uint64_t)x1[j]) / 2;
+			x1[j] = (long long)(mid - (uint64_t)x1[j]) / 2;
+			break;
+		}
+	}
+}
+
+/*
+ * Read n residuals coded with rice_len into res, folded when zigzag, where
+ * "after" is the least number of bits that can follow them in the stream.
+ * Unary runs are shorter than max_un, or escape with max_un ones when
+ * escape_bits isn't 0.
+ */
+static void
+decode_residuals(btw_reader *br, int rice_len, uint64_t max_un,
+		int escape_bits, int zigzag, unsigned int n,
+		unsigned long long after, long long *res)
+{
+	unsigned long long limit, fast, read;
+	unsigned int j = 0;
+	unsigned int least = (zigzag ? 1 : 2) + rice_len;
+	/* Escapes are left to br_get_rice_exact */
+	int max_run = 57 - (int)least;
+
+	if (escape_bits && max_run >= (int)max_un) {
+		max_run = (int)max_un - 1;
+	}
+
+	while (j < n && !br->error) {
+		/*
+		 * Bytes are there up to limit: the reader's end, or at least
+		 * "least" bits for every residual left plus what follows.
+		 * A word load reads at most 57 bits, so this many residuals
+		 * can be read with them before the loads could pass limit.
+		 */
+		limit = (n - j) * (unsigned long long)least + after;
+		limit = br->end - br->pos < limit ? br->end : br->pos + limit;
+
+		if (limit - br->pos < 72) {
+#ifdef BTW_STATS
+			if (br->stats) {
+				br->stats->exact_reads++;
+			}
+#endif
+			res[j++] = br_get_rice_exact(br, rice_len, max_un,
+				escape_bits, zigzag);
+			continue;
+		}
+
+		fast = (limit - br->pos - 72) / 57 + 1;
+		if (fast > n - j) {
+			fast = n - j;
+		}
+		/* One loop per coding, so neither branches per residual */
+		if (zigzag) {
+			read = br_run_zigzag(br, rice_len, max_run, fast,
+				res + j);
+			j += read;
+			fast -= read;
+		} else {
+			for (; fast && br_try_rice(br, rice_len, max_run,
+					&res[j]); fast--) {
+				j++;
+			}
+		}
+
+		/* A unary run longer than a word */
+		if (fast) {
+#ifdef BTW_STATS
+			if (br->stats) {
+				br->stats->exact_reads++;
+			}
+#endif
+			res[j++] = br_get_rice_exact(br, rice_len, max_un,
+				escape_bits, zigzag);
+		}
+	}
+}
+
+/*
+ * Read cap samples of "bits" bits, of two's complement unless zero is set,
+ * into res, where "after" is the least number of bits that can follow them
+ * in the stream
+ */
+static void
+decode_verbatim(btw_reader *br, unsigned int bits, int zero,
+		unsigned int cap, unsigned long long after, long long *res)
+{
+	uint64_t top = 1ULL << (bits - 1), mask = (top << 1) - 1;
+	uint64_t sign = zero ? 0 : top;
+	unsigned long long left;
+	unsigned int j;
+
+	for (j = 0; j < cap && !br->error; j++) {
+		/* A word load needs 64 bits to be there */
+		left = (unsigned long long)(cap - j) * bits + after;
+		if (left >= 64 && br->end - br->pos >= 64) {
+			res[j] = (long long)(((br_peek(br) & mask) ^ sign) - sign);
+			br->pos += bits;
+		} else {
+			res[j] = zero ? (long long)br_get_exact(br, bits)
+				: br_get_signed(br, bits);
+		}
+	}
+}
+
+/*
+ * Decode the cap samples of one channel of a piece of "size" samples into
+ * res, where "after" is the least number of bits that can follow this
+ * channel in the stream. Verbatim and constant values take value_bits
+ * bits, zero-extended when zero is set.
+ */
+static void
+decode_channel(btw_reader *br, const btw_layout *lay,
+		unsigned int bits_per_sample, unsigned int value_bits, int zero,
+		unsigned int size, unsigned int cap, unsigned long long after,
+		long long *res)
+{
+	int bits_per_rice_len = bits_required(bits_per_sample);
+	int zigzag = (lay->flags & BTW_FLAG_ZIGZAG) != 0;
+	/*
+	 * Side channels have one bit more, order 4 residuals four and folded
+	 * ones another
+	 */
+	int mag_bits = bits_per_sample + 5 + zigzag;
+	int escape_bits = lay->flags & BTW_FLAG_ESCAPE ? mag_bits : 0;
+	unsigned int j, end;
+	unsigned int order = 1;
+	uint64_t max_un;
+	long long value;
+	int rice_len;
+#ifdef BTW_STATS
+	uint64_t start;
+#endif
+
+	if (lay->flags & BTW_FLAG_PREDICTOR) {
+		order = br_get_exact(br, BTW_ORDER_BITS);
+		if (order == BTW_ORDER_CONSTANT
+				&& (lay->flags & BTW_FLAG_CONSTANT)) {
+			value = zero ? (long long)br_get_exact(br, value_bits)
+				: br_get_signed(br, value_bits);
+			for (j = 0; j < cap; j++) {
+				res[j] = value;
+			}
+			return;
+		}
+		if (order == BTW_ORDER_VERBATIM && escape_bits) {
+			decode_verbatim(br, value_bits, zero, cap, after,
+				res);
+			return;
+		}
+		if (order > BTW_MAX_ORDER) {
+			br->error = 1;
+			return;
+		}
+	}
+	if (lay->flags & BTW_FLAG_PARTITIONED) {
+		size >>= br_get_exact(br, BTW_PARTITION_BITS);
+		if (!size) {
+			br->error = 1;
+			return;
+		}
+	}
+
+#ifdef BTW_STATS
+	start = stat_ticks();
+#endif
+	for (j = 0; j < cap && !br->error; j = end) {
+		end = cap - j < size ? cap : j + size;
+		rice_len = br_get_exact(br, bits_per_rice_len);
+		if (escape_bits) {
+			max_un = BTW_ESCAPE_RUN;
+		} else if (rice_len < mag_bits) {
+			max_un = 1ULL << (mag_bits - rice_len);
+		} else {
+			max_un = 1;
+		}
+		/* At least residual_bits for every later one of the channel */
+		decode_residuals(br, rice_len, max_un, escape_bits, zigzag,
+			end - j, after + (unsigned long long)residual_bits(lay)
+				* (cap - end), res + j);
+	}
+#ifdef BTW_STATS
+	if (br->stats) {
+		br->stats->read_cycles += stat_ticks() - start;
+	}
+#endif
+
+	if (!br->error) {
+		restore_channel(res, cap, order);
+	}
+}
+
+/* Scratch decode_block needs, in long longs */
+static unsigned long long
+decode_scratch(const btw_def *def)
+{
+	return 2ULL * def->block_size
+		+ ((unsigned long long)def->channels * def->block_size + 1) / 2;
+}
+
+/*
+ * Decode cap samples per channel from sample i, a piece of "size" samples,
+ * into dst and into the block's PCM at pcm, each unless NULL
+ */
+static void
+decode_piece(btw_reader *br, const btw_def *def, const btw_layout *lay,
+		unsigned long long i, unsigned int size, unsigned int cap,
+		const btw_samples *dst, long long *scratch, unsigned char *pcm)
+{
+	unsigned long long after, least, later = 0, blocks = 0;
+	unsigned int chan, mode = BTW_STEREO_LR, value_bits;
+	unsigned int bits = residual_bits(lay);
+	unsigned int bytes = pcm_bytes(def), stride = def->channels * bytes;
+	int stereo = (lay->flags & BTW_FLAG_STEREO) && def->channels == 2;
+	long long *x[2];
+
+	if (pcm) {
+		pcm += (i % def->block_size) * stride;
+	}
+
+	x[0] = scratch;
+	x[1] = scratch + def->block_size;
+
+	if (stereo) {
+		mode = br_get_exact(br, BTW_STEREO_BITS);
+	}
+
+	/* Nothing is known to follow the block in streams of no length */
+	if (def->sample_count != BTW_UNKNOWN_COUNT) {
+		later = def->sample_count - i - cap;
+		blocks = block_count(def) - i / def->block_size - 1;
+	}
+	for (chan = 0; chan < def->channels; chan++) {
+		if (!(lay->flags & BTW_FLAG_CONSTANT)) {
+			/* At least "bits" bits for every later residual */
+			after = bits * (later * def->channels
+				+ (def->channels - chan - 1) * cap);
+		} else {
+			/*
+			 * Later channels may be constant, and later blocks
+			 * no more than a byte
+			 */
+			least = (unsigned long long)bits * cap;
+			if (least > BTW_ORDER_BITS + def->bits_per_sample) {
+				least = BTW_ORDER_BITS + def->bits_per_sample;
+			}
+			after = (def->channels - chan - 1) * least
+				+ 8 * blocks;
+		}
+		/* Side channels are the second but in side and right */
+		value_bits = def->bits_per_sample;
+		if (!(lay->flags & BTW_FLAG_NARROW) || (stereo
+				&& mode != BTW_STEREO_LR
+				&& chan == (mode != BTW_STEREO_SR))) {
+			value_bits++;
+		}
+		/* Unsigned samples only fill bits_per_sample bits */
+		decode_channel(br, lay, def->bits_per_sample, value_bits,
+			(lay->flags & BTW_FLAG_UNSIGNED)
+				&& value_bits == def->bits_per_sample,
+			size, cap, after, x[stereo ? chan : 0]);
+		if (stereo) {
+			continue;
+		}
+		if (dst) {
+			store_samples(x[0], cap, dst, def->channels, i, chan,
+				def->bits_per_sample);
+		}
+		if (pcm) {
+			pack_samples(x[0], cap, bytes, stride, pcm + chan * bytes);
+		}
+	}
+
+	if (stereo && !br->error) {
+		restore_stereo(x[0], x[1], cap, mode);
+		for (chan = 0; chan < 2; chan++) {
+			if (dst) {
+				store_samples(x[chan], cap, dst, 2, i, chan,
+					def->bits_per_sample);
+			}
+			if (pcm) {
+				pack_samples(x[chan], cap, bytes, stride,
+					pcm + chan * bytes);
+			}
+		}
+	}
+}
+
+/* Decode a piece, or its halves when it was split */
+static void
+decode_split(btw_reader *br, const btw_def *def, const btw_layout *lay,
+		unsigned long long i, unsigned int size, unsigned int cap,
+		const btw_samples *dst, long long *scratch, unsigned char *pcm)
+{
+	unsigned int half = size / 2;
+
+	if (size > def->min_block_size && cap > half && br_get_exact(br, 1)) {
+		decode_split(br, def, lay, i, half, half, dst, scratch, pcm);
+		decode_split(br, def, lay, i + half, half, cap - half, dst,
+			scratch, pcm);
+		return;
+	}
+	decode_piece(br, def, lay, i, size, cap, dst, scratch, pcm);
+}
+
+/*
+ * Read the start of a block of an open-ended stream at sample i, which
+ * sample_count would make cap long, into cap. Return 0 with the reader's
+ * error set if the two disagree.
+ */
+static int
+br_open_block(btw_reader *br, const btw_def *def, const btw_layout *lay,
+		unsigned long long i, unsigned int *cap)
+{
+	unsigned int last = br_get_exact(br, 1), n = *cap;
+	int ends;
+
+	if (last) {
+		n = br_get_exact(br, BTW_LAST_BLOCK_BITS);
+	}
+	if (br->error) {
+		return 1;
+	}
+	if (def->sample_count == BTW_UNKNOWN_COUNT) {
+		*cap = n;
+		ends = 0;
+	} else {
+		ends = i + n == def->sample_count;
+	}
+	if (n > def->block_size || (last ? n != *cap || !ends
+			: ends && !lay->cut)) {
+		br->error = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Decode the block starting at sample i into dst, or nowhere if NULL, and
+ * return its length, or 0 with the reader's error set if the block was all
+ * there but failed its check. The CRC-32C of its PCM is added to *crc,
+ * unless crc is NULL. scratch holds decode_scratch(def) long longs.
+ */
+static unsigned int
+decode_block(btw_reader *br, const btw_def *def, const btw_layout *lay,
+		unsigned long long i, const btw_samples *dst, long long *scratch,
+		uint32_t *crc)
+{
+	unsigned long long begin = br->pos;
+	const unsigned char *view = NULL;
+	unsigned char *pcm = NULL;
+	unsigned int cap;
+	uint32_t check;
+#ifdef BTW_STATS
+	uint64_t start = stat_ticks();
+	unsigned long long read = br->stats ? br->stats->read_cycles : 0;
+#endif
+
+	if (def->sample_count - i < def->block_size) {
+		cap = def->sample_count - i;
+	} else {
+		cap = def->block_size;
+	}
+	if (lay->flags & BTW_FLAG_OPEN && !br_open_block(br, def, lay, i, &cap)) {
+		return 0;
+	}
+
+	if (crc && lay->flags & BTW_FLAG_CRC) {
+		view = samples_pcm(dst, def, i);
+		if (!view) {
+			pcm = (unsigned char *)(scratch + 2 * def->block_size);
+		}
+	}
+	if (cap) {
+		decode_split(br, def, lay, i, def->block_size, cap, dst,
+			scratch, pcm);
+	}
+	if (lay->aligned) {
+		br->pos = (br->pos + 7) & ~7ULL;
+	}
+	if (lay->flags & BTW_FLAG_CRC && !br->error) {
+		check = crc32c(0, br->in + begin / 8, (br->pos - begin) / 8)
+			& 0xffff;
+		if (br_get_exact(br, BTW_BLOCK_CHECK_BITS) != check
+				&& !br->error) {
+			br->error = 1;
+			return 0;
+		}
+		if (crc) {
+			*crc = crc32c(*crc, view ? view : pcm,
+				(unsigned long long)cap * def->channels
+				* pcm_bytes(def));
+		}
+	}
+
+#ifdef BTW_STATS
+	if (br->stats) {
+		br->stats->restore_cycles += stat_ticks() - start
+			- (br->stats->read_cycles - read);
+		br->stats->decoded_samples += (unsigned long long)cap
+			* def->channels;
+	}
+#endif
+	return cap;
+}
+
+/* Read the file check after the last block, an error unless it is crc */
+static void
+br_check_file(btw_reader *br, const btw_layout *lay, uint32_t crc)
+{
+	if (lay->flags & BTW_FLAG_CRC && !lay->cut
+			&& br_get_exact(br, BTW_FILE_CHECK_BITS) != crc) {
+		br->error = 1;
+	}
+}
+
+/* Whether the stream def describes can be decoded to fmt */
+static int
+check_format(const btw_def *def, btw_format fmt)
+{
+	return def->channels && def->sample_rate && def->bits_per_sample
+		&& def->bits_per_sample <= 32 && fmt <= BTW_FMT_F32;
+}
+
+/*
+ * Find the length of the open-ended stream in len bytes of data, ~0 if not
+ * known, by reading its blocks up to the last one or to the end of data
+ */
+static int
+find_count(const unsigned char *data, unsigned long long len, btw_def *def,
+		btw_layout *lay)
+{
+	unsigned long long i = 0;
+	btw_reader br, peek;
+	long long *scratch;
+	unsigned int n;
+	int r = 0;
+
+	scratch = (long long *)malloc(decode_scratch(def) * sizeof(*scratch));
+	if (!scratch) {
+		return 0;
+	}
+	br_init(&br, data, lay->data_pos * 8, len_bits(len));
+#ifdef BTW_STATS
+	br.stats = NULL;
+#endif
+	while (!br.error) {
+		if (br.pos == br.end) {
+			/* Cut off after a whole block */
+			def->sample_count = i;
+			lay->cut = 1;
+			r = 1;
+			break;
+		}
+		peek = br;
+		if (br_get_exact(&peek, 1)) {
+			n = br_get_exact(&peek, BTW_LAST_BLOCK_BITS);
+			if (!peek.error && n <= def->block_size) {
+				def->sample_count = i + n;
+				r = 1;
+			}
+			break;
+		}
+		i += decode_block(&br, def, lay, i, NULL, scratch, NULL);
+	}
+	free(scratch);
+	return r;
+}
+
+/*
+ * check_format for the stream in len bytes of data, ~0 if not known, and
+ * find its length if its header doesn't have it
+ */
+static int
+check_decode(const unsigned char *data, unsigned long long len, btw_def *def,
+		btw_layout *lay, btw_format fmt)
+{
+	if (!check_format(def, fmt)) {
+		return 0;
+	}
+	if (def->sample_count != BTW_UNKNOWN_COUNT) {
+		return 1;
+	}
+	return lay->flags & BTW_FLAG_OPEN && find_count(data, len, def, lay);
+}
+
+/*
+ * Allocate room for every sample def describes in fmt and point s at it.
+ * When planar, the allocation starts with the array of channel pointers.
+ */
+static void *
+alloc_samples(const btw_def *def, btw_format fmt, int planar, btw_samples *s)
+{
+	unsigned long long plane = def->sample_count * format_size(fmt);
+	unsigned long long head = planar ? def->channels * sizeof(void *) : 0;
+	unsigned long long size = samples_size(def, fmt, def->sample_count);
+	unsigned char *p;
+	unsigned int chan;
+
+	if (size == ~0ULL) {
+		return NULL;
+	}
+	p = (unsigned char *)malloc(head + size);
+	if (!p) {
+		return NULL;
+	}
+	if (planar) {
+		for (chan = 0; chan < def->channels; chan++) {
+			((void **)p)[chan] = p + head + chan * plane;
+		}
+		samples_init(s, NULL, (void *const *)p, fmt, 0);
+	} else {
+		samples_init(s, p, NULL, fmt, 0);
+	}
+	return p;
+}
+
+/* Copy n samples per channel from sample i of src to dst */
+static void
+copy_samples(const btw_samples *src, const btw_samples *dst,
+		unsigned int channels, unsigned long long i, unsigned long long n)
+{
+	unsigned int size = format_size(dst->fmt), chan, from, to;
+	const unsigned char *p;
+	unsigned char *q;
+	unsigned long long j;
+
+	if (!src->planes && !dst->planes) {
+		memcpy(sample_at(dst, channels, i, 0, &to),
+			sample_at(src, channels, i, 0, &from),
+			n * channels * size);
+		return;
+	}
+	for (chan = 0; chan < channels; chan++) {
+		p = sample_at(src, channels, i, chan, &from);
+		q = sample_at(dst, channels, i, chan, &to);
+		for (j = 0; j < n; j++) {
+			memcpy(q + j * to * size, p + j * from * size, size);
+		}
+	}
+}
+
+/*
+ * Decode every block, with the checked def and lay, through br from the
+ * first one into dst or only to check them if it is NULL, with
+ * decode_scratch(def) long longs of scratch
+ */
+static int
+decode_with(btw_reader *br, const btw_def *def, const btw_layout *lay,
+		const btw_samples *dst, long long *scratch)
+{
+	unsigned long long i = 0;
+	uint32_t crc = 0;
+
+	while (i < def->sample_count && !br->error) {
+		i += decode_block(br, def, lay, i, dst, scratch, &crc);
+	}
+	/* An empty open-ended stream still has its last block */
+	if (!def->sample_count && lay->flags & BTW_FLAG_OPEN && !lay->cut) {
+		decode_block(br, def, lay, 0, dst, scratch, &crc);
+	}
+	br_check_file(br, lay, crc);
+	return br->error ? BTW_ERR_CORRUPT : BTW_OK;
+}
+
+/*
+ * Decode every block of len bytes of data, with the checked def and lay,
+ * into dst or only to check them if it is NULL
+ */
+static int
+decode_to(const unsigned char *data, unsigned long long len,
+		const btw_def *def, const btw_layout *lay, const btw_samples *dst,
+		const btw_allocator *alloc)
+{
+	long long *scratch;
+	btw_reader br;
+	int r;
+
+	scratch = (long long *)alloc_with(alloc, decode_scratch(def)
+		* sizeof(*scratch));
+	if (!scratch) {
+		return BTW_ERR_NOMEM;
+	}
+	br_init(&br, data, lay->data_pos * 8, len_bits(len));
+	r = decode_with(&br, def, lay, dst, scratch);
+	free_with(alloc, scratch);
+	return r;
+}
+
+/* Decode len bytes of data, ~0 if not known */
+static void *
+decode_all(const unsigned char *data, unsigned long long len, btw_format fmt,
+		int planar, btw_def *def, unsigned long long *out_len)
+{
+	void *output;
+	btw_samples dst;
+	btw_layout lay;
+	if (!def || !out_len || !data) {
+		return NULL;
+	}
+
+	if (!check_header(data, len, def, &lay)) {
+		return NULL;
+	}
+
+	if (!check_decode(data, len, def, &lay, fmt) || !def->sample_count) {
+		return NULL;
+	}
+	output = alloc_samples(def, fmt, planar, &dst);
+	if (!output) {
+		return NULL;
+	}
+
+	*out_len = 0;
+	if (decode_to(data, len, def, &lay, &dst, NULL) != BTW_OK) {
+		free(output);
+		return NULL;
+	}
+	*out_len = def->sample_count * def->channels;
+	return output;
+}
+
+unsigned long long
+btw_decoded_size(const unsigned char *data, btw_format fmt, btw_def *def)
+{
+	btw_layout lay;
+
+	if (!data || !def || !read_header(data, def, &lay)
+			|| !check_decode(data, ~0ULL, def, &lay, fmt)
+			|| samples_size(def, fmt, def->sample_count) == ~0ULL) {
+		return 0;
+	}
+	return samples_size(def, fmt, def->sample_count);
+}
+
+int
+btw_decode_into_n(const unsigned char *data, unsigned long long len,
+		btw_format fmt, btw_def *def, void *out,
+		unsigned long long out_size, unsigned long long *out_len,
+		const btw_allocator *alloc)
+{
+	btw_samples dst;
+	btw_layout lay;
+	int r;
+
+	if (!data || !def || !out || !out_len || fmt > BTW_FMT_F32) {
+		return BTW_ERR_INVALID;
+	}
+	if (!check_header(data, len, def, &lay)
+			|| !check_decode(data, len, def, &lay, fmt)) {
+		return BTW_ERR_CORRUPT;
+	}
+	if (out_size < samples_size(def, fmt, def->sample_count)) {
+		return BTW_ERR_SPACE;
+	}
+
+	samples_init(&dst, out, NULL, fmt, 0);
+	r = decode_to(data, len, def, &lay, &dst, alloc);
+	if (r == BTW_OK) {
+		*out_len = def->sample_count * def->channels;
+	}
+	return r;
+}
+
+int
+btw_decode_into(const unsigned char *data, btw_format fmt, btw_def *def,
+		void *out, unsigned long long out_size,
+		unsigned long long *out_len, const btw_allocator *alloc)
+{
+	return btw_decode_into_n(data, ~0ULL, fmt, def, out, out_size, out_len,
+		alloc);
+}
+
+void *
+btw_decode_fmt(const unsigned char *data, btw_format fmt, btw_def *def,
+		unsigned long long *out_len)
+{
+	return decode_all(data, ~0ULL, fmt, 0, def, out_len);
+}
+
+int
+btw_verify_n(const unsigned char *data, unsigned long long len)
+{
+	btw_layout lay;
+	btw_def def;
+
+	if (!data) {
+		return BTW_ERR_INVALID;
+	}
+	if (!check_header(data, len, &def, &lay)
+			|| !check_decode(data, len, &def, &lay, BTW_FMT_S32)) {
+		return BTW_ERR_CORRUPT;
+	}
+	return decode_to(data, len, &def, &lay, NULL, NULL);
+}
+
+void *
+btw_decode_n(const unsigned char *data, unsigned long long len,
+		btw_format fmt, btw_def *def, unsigned long long *out_len)
+{
+	return decode_all(data, len, fmt, 0, def, out_len);
+}
+
+void **
+btw_decode_planar(const unsigned char *data, btw_format fmt, btw_def *def,
+		unsigned long long *out_len)
+{
+	return (void **)decode_all(data, ~0ULL, fmt, 1, def, out_len);
+}
+
+#ifdef BTW_NATIVE_FMT
+btw_sample_fmt *
+btw_decode(const unsigned char *data, btw_def *def, unsigned long long *out_len)
+{
+	return (btw_sample_fmt *)btw_decode_fmt(data, BTW_NATIVE_FMT, def,
+		out_len);
+}
+#endif
+
+uint8_t *
+btw_decode_u8(const unsigned char *data, btw_def *def,
+		unsigned long long *out_len)
+{
+	return (uint8_t *)btw_decode_fmt(data, BTW_FMT_U8, def, out_len);
+}
+
+int16_t *
+btw_decode_s16(const unsigned char *data, btw_def *def,
+		unsigned long long *out_len)
+{
+	return (int16_t *)btw_decode_fmt(data, BTW_FMT_S16, def, out_len);
+}
+
+unsigned char *
+btw_decode_s24_packed(const unsigned char *data, btw_def *def,
+		unsigned long long *out_len)
+{
+	return (unsigned char *)btw_decode_fmt(data, BTW_FMT_S24, def,
+		out_len);
+}
+
+int32_t *
+btw_decode_s32(const unsigned char *data, btw_def *def,
+		unsigned long long *out_len)
+{
+	return (int32_t *)btw_decode_fmt(data, BTW_FMT_S32, def, out_len);
+}
+
+float *
+btw_decode_f32(const unsigned char *data, btw_def *def,
+		unsigned long long *out_len)
+{
+	return (float *)btw_decode_fmt(data, BTW_FMT_F32, def, out_len);
+}
+
+typedef struct {
+	const unsigned char *data;
+	const btw_def *def;
+	btw_layout lay;
+	unsigned long long entries_per_group;
+	btw_samples output;
+	uint32_t *crcs;		/* Of each group's PCM */
+	unsigned long long end;	/* Position after the last block, in bits */
+	int failed;
+#ifdef BTW_STATS
+	btw_stats *stats;	/* One per group, NULL to count nothing */
+#endif
+} btw_decode_job;
+
+static void
+decode_group(void *arg, unsigned int group)
+{
+	btw_decode_job *job = (btw_decode_job *)arg;
+	unsigned long long entry = group * job->entries_per_group;
+	unsigned long long i = entry * job->lay.seek_interval
+		* job->def->block_size;
+	unsigned long long end = i + job->entries_per_group
+		* job->lay.seek_interval * job->def->block_size;
+	long long *scratch;
+	btw_reader br;
+
+	scratch = (long long *)malloc(decode_scratch(job->def)
+		* sizeof(*scratch));
+	if (!scratch) {
+		job->failed = 1;
+		return;
+	}
+
+	br_init(&br, job->data,
+		load_le64(job->lay.seek_table + entry * 8) * 8, ~0ULL);
+#ifdef BTW_STATS
+	br.stats = job->stats ? job->stats + group : NULL;
+#endif
+
+	while (i < end && i < job->def->sample_count && !br.error) {
+		i += decode_block(&br, job->def, &job->lay, i, &job->output,
+			scratch, job->crcs + group);
+	}
+	free(scratch);
+	if (br.error) {
+		job->failed = 1;
+	} else if (i == job->def->sample_count) {
+		job->end = br.pos;
+	}
+}
+
+static void *
+decode_mt(const unsigned char *data, btw_format fmt, int planar, btw_def *def,
+		unsigned int threads, const btw_thread_pool *pool,
+		unsigned long long *out_len)
+{
+	unsigned long long entries, samples;
+	unsigned int groups, g;
+	uint32_t crc = 0;
+	btw_decode_job job;
+	btw_reader br;
+	void *output;
+
+	if (!def || !out_len || !data) {
+		return NULL;
+	}
+
+	if (!read_header(data, def, &job.lay)) {
+		return NULL;
+	}
+
+	/* Without a seek table the blocks can only be found one by one */
+	if (!job.lay.seek_interval) {
+		return decode_all(data, ~0ULL, fmt, planar, def, out_len);
+	}
+
+	if (!check_decode(data, ~0ULL, def, &job.lay, fmt)
+			|| !def->sample_count) {
+		return NULL;
+	}
+	output = alloc_samples(def, fmt, planar, &job.output);
+	if (!output) {
+		return NULL;
+	}
+
+	if (!threads) {
+		threads = cpu_count();
+	}
+
+	entries = (block_count(def) + job.lay.seek_interval - 1)
+		/ job.lay.seek_interval;
+	job.entries_per_group = (entries + threads - 1) / threads;
+	groups = (entries + job.entries_per_group - 1) / job.entries_per_group;
+	job.data = data;
+	job.def = def;
+	job.crcs = (uint32_t *)calloc(groups, sizeof(*job.crcs));
+	job.end = 0;
+	job.failed = !job.crcs;
+#ifdef BTW_STATS
+	job.stats = attached_stats ? (btw_stats *)calloc(groups,
+		sizeof(*job.stats)) : NULL;
+#endif
+
+	if (job.crcs) {
+		if (pool) {
+			pool->run(pool->pool, decode_group, &job, groups);
+		} else {
+			run_tasks(decode_group, &job, groups, threads);
+		}
+	}
+#ifdef BTW_STATS
+	for (g = 0; job.stats && g < groups; g++) {
+		stats_add(attached_stats, job.stats + g);
+	}
+	free(job.stats);
+#endif
+
+	/* Carry each group's PCM on to check the whole file */
+	for (g = 0; !job.failed && g < groups; g++) {
+		samples = def->sample_count - g * job.entries_per_group
+			* job.lay.seek_interval * def->block_size;
+		if (samples > job.entries_per_group * job.lay.seek_interval
+				* def->block_size) {
+			samples = job.entries_per_group * job.lay.seek_interval
+				* def->block_size;
+		}
+		crc = crc32c_combine(crc, job.crcs[g], samples * def->channels
+			* pcm_bytes(def));
+	}
+	free(job.crcs);
+	if (!job.failed) {
+		br_init(&br, data, job.end, ~0ULL);
+		br_check_file(&br, &job.lay, crc);
+		job.failed = br.error;
+	}
+	if (job.failed) {
+		free(output);
+		return NULL;
+	}
+
+	*out_len = def->sample_count * def->channels;
+	return output;
+}
+
+void *
+btw_decode_mt_fmt(const unsigned char *data, btw_format fmt, btw_def *def,
+		unsigned int threads, const btw_thread_pool *pool,
+		unsigned long long *out_len)
+{
+	return decode_mt(data, fmt, 0, def, threads, pool, out_len);
+}
+
+void **
+btw_decode_mt_planar(const unsigned char *data, btw_format fmt, btw_def *def,
+		unsigned int threads, const btw_thread_pool *pool,
+		unsigned long long *out_len)
+{
+	return (void **)decode_mt(data, fmt, 1, def, threads, pool, out_len);
+}
+
+#ifdef BTW_NATIVE_FMT
+btw_sample_fmt *
+btw_decode_mt(const unsigned char *data, btw_def *def, unsigned int threads,
+		const btw_thread_pool *pool, unsigned long long *out_len)
+{
+	return (btw_sample_fmt *)btw_decode_mt_fmt(data, BTW_NATIVE_FMT, def,
+		threads, pool, out_len);
+}
+#endif
+
+/* Work a batch item is counted as besides its samples, for splitting */
+#define BTW_BATCH_ITEM_COST BTW_BLOCK_SIZE
+
+typedef struct {
+	btw_batch_item *items;
+	const unsigned char *data;	/* Streams to decode */
+	unsigned char *out;		/* The arena or decoded samples */
+	unsigned long long *at;		/* Where each item's samples go */
+	btw_layout *lays;		/* Of each item to decode */
+	unsigned int *first;		/* Of each worker's items, and count */
+	unsigned long long *ends;	/* Where each worker's streams end */
+#ifdef BTW_STATS
+	btw_stats *stats;		/* One per worker, NULL for none */
+#endif
+} btw_batch_job;
+
+/* Work of encoding or decoding an item, nothing if it already failed */
+static unsigned long long
+batch_cost(const btw_batch_item *item)
+{
+	return item->result ? 0 : item->def.sample_count * item->def.channels
+		+ BTW_BATCH_ITEM_COST;
+}
+
+/*
+ * Split the items into runs of about the same work for each of "workers"
+ * tasks, worker t taking items first[t] to first[t + 1] - 1. Each run's
+ * streams stay together in the arena.
+ */
+static void
+split_batch(const btw_batch_item *items, unsigned int count,
+		unsigned int workers, unsigned int *first)
+{
+	unsigned long long total = 0, done = 0, cost;
+	unsigned int i, t;
+
+	for (i = 0; i < count; i++) {
+		total += batch_cost(items + i);
+	}
+	first[0] = 0;
+	for (i = 0, t = 1; t < workers; t++) {
+		for (; i < count; i++, done += cost) {
+			cost = batch_cost(items + i);
+			if (done + cost / 2 > total / workers * t) {
+				break;
+			}
+		}
+		first[t] = i;
+	}
+	first[workers] = count;
+}
+
+static void
+run_batch(const btw_thread_pool *pool, btw_task_fn fn, btw_batch_job *job,
+		unsigned int workers)
+{
+	if (pool) {
+		pool->run(pool->pool, fn, job, workers);
+	} else {
+		run_tasks(fn, job, workers, workers);
+	}
+}
+
+static void
+encode_batch_task(void *arg, unsigned int t)
+{
+	btw_batch_job *job = (btw_batch_job *)arg;
+	unsigned int i, end = job->first[t + 1];
+	unsigned long long pos, size = 0;
+	btw_batch_item *item;
+	long long *scratch;
+	btw_samples in;
+	btw_writer bw;
+
+	for (i = job->first[t]; i < end; i++) {
+		if (!job->items[i].result
+				&& encode_scratch(&job->items[i].def) > size) {
+			size = encode_scratch(&job->items[i].def);
+		}
+	}
+	scratch = size ? (long long *)malloc(size * sizeof(*scratch)) : NULL;
+
+	/* Each stream is written right after the last, within their bounds */
+	pos = job->first[t] < end ? job->items[job->first[t]].offset : 0;
+	for (i = job->first[t]; i < end; i++) {
+		item = job->items + i;
+		if (item->result) {
+			continue;
+		}
+		if (!scratch) {
+			item->result = BTW_ERR_NOMEM;
+			item->len = 0;
+			continue;
+		}
+		samples_init(&in, (void *)item->samples, NULL, item->fmt, 0);
+		bw_init(&bw, job->out + pos, item->len, 0);
+#ifdef BTW_STATS
+		bw.stats = job->stats ? job->stats + t : NULL;
+#endif
+		item->offset = pos;
+		item->result = encode_with(&in, &item->def, &bw, scratch,
+			&item->len);
+		if (item->result) {
+			item->len = 0;
+		}
+		pos += item->len;
+	}
+	job->ends[t] = pos;
+	free(scratch);
+}
+
+unsigned char *
+btw_encode_batch(btw_batch_item *items, unsigned int count,
+		unsigned int threads, const btw_thread_pool *pool,
+		unsigned long long *arena_len)
+{
+	unsigned long long total = 0, start, pos;
+	unsigned int workers, t, i;
+	btw_batch_job job;
+	unsigned char *shrunk;
+	btw_def d;
+
+	if ((!items && count) || !arena_len) {
+		return NULL;
+	}
+	*arena_len = 0;
+
+	/* Room for each stream's bound, in order */
+	for (i = 0; i < count; i++) {
+		items[i].offset = total;
+		items[i].len = 0;
+		if (!items[i].samples
+				|| !check_encode(&items[i].def, items[i].fmt, &d)
+				|| !d.sample_count) {
+			items[i].result = BTW_ERR_INVALID;
+			continue;
+		}
+		items[i].def = d;
+		items[i].result = BTW_OK;
+		items[i].len = max_encoded_size(&d);
+		total += items[i].len;
+	}
+
+	workers = threads ? threads : cpu_count();
+	workers = workers < count ? workers : count ? count : 1;
+	memset(&job, 0, sizeof(job));
+	job.items = items;
+	job.first = (unsigned int *)malloc((workers + 1) * sizeof(*job.first));
+	job.ends = (unsigned long long *)malloc(workers * sizeof(*job.ends));
+	job.out = (unsigned char *)malloc(total ? total : 1);
+#ifdef BTW_STATS
+	job.stats = attached_stats ? (btw_stats *)calloc(workers,
+		sizeof(*job.stats)) : NULL;
+#endif
+	if (!job.first || !job.ends || !job.out) {
+		free(job.out);
+		job.out = NULL;
+		goto done;
+	}
+
+	split_batch(items, count, workers, job.first);
+	run_batch(pool, encode_batch_task, &job, workers);
+
+	/* Close the gaps the bounds left between each worker's streams */
+	for (t = 0, pos = 0; t < workers; t++) {
+		if (job.first[t] == job.first[t + 1]) {
+			continue;
+		}
+		start = items[job.first[t]].offset;
+		if (start != pos) {
+			memmove(job.out + pos, job.out + start,
+				job.ends[t] - start);
+		}
+		for (i = job.first[t]; i < job.first[t + 1]; i++) {
+			items[i].offset -= start - pos;
+		}
+		pos += job.ends[t] - start;
+	}
+	*arena_len = pos;
+	shrunk = (unsigned char *)realloc(job.out, pos ? pos : 1);
+	job.out = shrunk ? shrunk : job.out;
+
+done:
+#ifdef BTW_STATS
+	for (t = 0; job.stats && t < workers; t++) {
+		stats_add(attached_stats, job.stats + t);
+	}
+	free(job.stats);
+#endif
+	free(job.first);
+	free(job.ends);
+	return job.out;
+}
+
+static void
+decode_batch_task(void *arg, unsigned int t)
+{
+	btw_batch_job *job = (btw_batch_job *)arg;
+	unsigned int i, end = job->first[t + 1];
+	btw_batch_item *item;
+	unsigned long long size = 0;
+	long long *scratch;
+	btw_samples dst;
+	btw_reader br;
+
+	for (i = job->first[t]; i < end; i++) {
+		if (!job->items[i].result
+				&& decode_scratch(&job->items[i].def) > size) {
+			size = decode_scratch(&job->items[i].def);
+		}
+	}
+	scratch = size ? (long long *)malloc(size * sizeof(*scratch)) : NULL;
+
+	for (i = job->first[t]; i < end; i++) {
+		item = job->items + i;
+		if (item->result) {
+			continue;
+		}
+		item->result = BTW_ERR_NOMEM;
+		if (!scratch) {
+			continue;
+		}
+		samples_init(&dst, job->out + job->at[i], NULL, item->fmt, 0);
+		br_init(&br, job->data + item->offset,
+			job->lays[i].data_pos * 8, len_bits(item->len));
+#ifdef BTW_STATS
+		br.stats = job->stats ? job->stats + t : NULL;
+#endif
+		item->result = decode_with(&br, &item->def, job->lays + i, &dst,
+			scratch);
+		if (!item->result) {
+			item->decoded = job->out + job->at[i];
+		}
+	}
+	free(scratch);
+}
+
+void *
+btw_decode_batch(const unsigned char *arena, btw_batch_item *items,
+		unsigned int count, unsigned int threads,
+		const btw_thread_pool *pool)
+{
+	unsigned long long total = 0, size;
+	unsigned int workers, i;
+	btw_batch_job job;
+#ifdef BTW_STATS
+	unsigned int t;
+#endif
+
+	if ((!items || !arena) && count) {
+		return NULL;
+	}
+	memset(&job, 0, sizeof(job));
+	job.items = items;
+	job.data = arena;
+	job.at = (unsigned long long *)malloc((count ? count : 1)
+		* sizeof(*job.at));
+	job.lays = (btw_layout *)malloc((count ? count : 1)
+		* sizeof(*job.lays));
+	if (!job.at || !job.lays) {
+		free(job.at);
+		free(job.lays);
+		return NULL;
+	}
+
+	/* Every item's samples go in one block, each 8-byte aligned */
+	for (i = 0; i < count; i++) {
+		items[i].decoded = NULL;
+		job.at[i] = total;
+		if (items[i].fmt > BTW_FMT_F32) {
+			items[i].result = BTW_ERR_INVALID;
+		} else if (!check_header(arena + items[i].offset, items[i].len,
+				&items[i].def, job.lays + i)
+				|| !check_decode(arena + items[i].offset,
+				items[i].len, &items[i].def, job.lays + i,
+				items[i].fmt)
+				|| !items[i].def.sample_count) {
+			items[i].result = BTW_ERR_CORRUPT;
+		} else if ((size = samples_size(&items[i].def, items[i].fmt,
+				items[i].def.sample_count)) == ~0ULL
+				|| ((size + 7) & ~7ULL)
+				> BTW_MAX_ALLOC - total) {
+			items[i].result = BTW_ERR_NOMEM;
+		} else {
+			items[i].result = BTW_OK;
+			total += (size + 7) & ~7ULL;
+		}
+	}
+
+	workers = threads ? threads : cpu_count();
+	workers = workers < count ? workers : count ? count : 1;
+	job.first = (unsigned int *)malloc((workers + 1) * sizeof(*job.first));
+	job.out = (unsigned char *)malloc(total ? total : 1);
+#ifdef BTW_STATS
+	job.stats = attached_stats ? (btw_stats *)calloc(workers,
+		sizeof(*job.stats)) : NULL;
+#endif
+	if (!job.first || !job.out) {
+		free(job.out);
+		job.out = NULL;
+		goto done;
+	}
+
+	split_batch(items, count, workers, job.first);
+	run_batch(pool, decode_batch_task, &job, workers);
+
+done:
+#ifdef BTW_STATS
+	for (t = 0; job.stats && t < workers; t++) {
+		stats_add(attached_stats, job.stats + t);
+	}
+	free(job.stats);
+#endif
+	free(job.first);
+	free(job.at);
+	free(job.lays);
+	return job.out;
+}
+
+/*
+ * Decode count samples per channel from first_sample of len bytes of data,
+ * ~0 if not known, into out
+ */
+static unsigned long long
+decode_range(const unsigned char *data, unsigned long long len, btw_def *def,
+		unsigned long long first_sample, unsigned long long count,
+		const btw_samples *out)
+{
+	unsigned long long i = 0, end, lo, hi, entry;
+	unsigned char *block_data = NULL;
+	unsigned int cap;
+	long long *scratch;
+	btw_samples block;
+	btw_layout lay;
+	btw_reader br;
+
+	if (!check_header(data, len, def, &lay)) {
+		return 0;
+	}
+
+	if (!check_decode(data, len, def, &lay, out->fmt)
+			|| first_sample >= def->sample_count) {
+		return 0;
+	}
+	if (count > def->sample_count - first_sample) {
+		count = def->sample_count - first_sample;
+	}
+	end = first_sample + count;
+
+	scratch = (long long *)malloc(decode_scratch(def) * sizeof(*scratch));
+	if (!scratch) {
+		return 0;
+	}
+
+	br_init(&br, data, lay.data_pos * 8, len_bits(len));
+	if (lay.seek_interval) {
+		entry = first_sample / def->block_size / lay.seek_interval;
+		br.pos = load_le64(lay.seek_table + entry * 8) * 8;
+		i = entry * lay.seek_interval * def->block_size;
+		/* An entry past the end fails the first read */
+		if (br.pos > br.end) {
+			br.pos = br.end;
+		}
+	}
+
+	while (i < end && !br.error) {
+		if (i >= first_sample && end - i >= def->block_size) {
+			i += decode_block(&br, def, &lay, i, out, scratch, NULL);
+			continue;
+		}
+
+		/* Blocks before the range or only partly in it */
+		if (!block_data) {
+			block_data = (unsigned char *)malloc(samples_size(def,
+				out->fmt, def->block_size));
+			if (!block_data) {
+				free(scratch);
+				return 0;
+			}
+		}
+		samples_init(&block, block_data, NULL, out->fmt, i);
+		cap = decode_block(&br, def, &lay, i, &block, scratch, NULL);
+
+		lo = i > first_sample ? i : first_sample;
+		hi = i + cap < end ? i + cap : end;
+		if (lo < hi) {
+			copy_samples(&block, out, def->channels, lo, hi - lo);
+		}
+		i += cap;
+	}
+
+	free(block_data);
+	free(scratch);
+	return br.error ? 0 : count;
+}
+
+unsigned long long
+btw_decode_range_fmt(const unsigned char *data, btw_format fmt, btw_def *def,
+		unsigned long long first_sample, unsigned long long count,
+		void *out)
+{
+	btw_samples dst;
+
+	if (!def || !data || !out) {
+		return 0;
+	}
+	samples_init(&dst, out, NULL, fmt, first_sample);
+	return decode_range(data, ~0ULL, def, first_sample, count, &dst);
+}
+
+unsigned long long
+btw_decode_range_planar(const unsigned char *data, btw_format fmt,
+		btw_def *def, unsigned long long first_sample,
+		unsigned long long count, void *const *planes)
+{
+	btw_samples dst;
+
+	if (!def || !data || !planes) {
+		return 0;
+	}
+	samples_init(&dst, NULL, planes, fmt, first_sample);
+	return decode_range(data, ~0ULL, def, first_sample, count, &dst);
+}
+
+#ifdef BTW_NATIVE_FMT
+unsigned long long
+btw_decode_range(const unsigned char *data, btw_def *def,
+		unsigned long long first_sample, unsigned long long count,
+		btw_sample_fmt *out)
+{
+	return btw_decode_range_fmt(data, BTW_NATIVE_FMT, def, first_sample,
+		count, out);
+}
+#endif
+
+struct btw_file {
+	const unsigned char *data;
+	unsigned long long size;
+	btw_def def;
+	btw_layout lay;
+#if !defined(BTW_NO_MMAP) && defined(_WIN32)
+	HANDLE file, mapping;
+#endif
+};
+
+/* Point file->data at the contents of the file at path, return 0 on error */
+static int
+map_file(btw_file *file, const char *path)
+{
+#if defined(BTW_NO_MMAP)
+	unsigned char *data;
+	long size;
+	FILE *f;
+
+	if (!(f = fopen(path, "rb"))) {
+		return 0;
+	}
+	if (fseek(f, 0, SEEK_END) || (size = ftell(f)) <= 0
+			|| fseek(f, 0, SEEK_SET)
+			|| !(data = (unsigned char *)malloc(size))) {
+		fclose(f);
+		return 0;
+	}
+	if (fread(data, 1, size, f) != (unsigned long)size) {
+		free(data);
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	file->data = data;
+	file->size = size;
+	return 1;
+#elif defined(_WIN32)
+	LARGE_INTEGER size;
+
+	file->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file->file == INVALID_HANDLE_VALUE) {
+		return 0;
+	}
+	if (!GetFileSizeEx(file->file, &size) || size.QuadPart <= 0
+			|| (unsigned long long)size.QuadPart > (SIZE_T)-1) {
+		CloseHandle(file->file);
+		return 0;
+	}
+	file->mapping = CreateFileMappingA(file->file, NULL, PAGE_READONLY,
+		0, 0, NULL);
+	if (!file->mapping) {
+		CloseHandle(file->file);
+		return 0;
+	}
+	file->data = (const unsigned char *)MapViewOfFile(file->mapping,
+		FILE_MAP_READ, 0, 0, 0);
+	if (!file->data) {
+		CloseHandle(file->mapping);
+		CloseHandle(file->file);
+		return 0;
+	}
+	file->size = size.QuadPart;
+	return 1;
+#else
+	struct stat st;
+	void *data;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return 0;
+	}
+	if (fstat(fd, &st) || st.st_size <= 0
+			|| (unsigned long long)st.st_size > (size_t)-1) {
+		close(fd);
+		return 0;
+	}
+	/* The mapping outlives the descriptor */
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return 0;
+	}
+	file->data = (const unsigned char *)data;
+	file->size = st.st_size;
+	return 1;
+#endif
+}
+
+static void
+unmap_file(btw_file *file)
+{
+#if defined(BTW_NO_MMAP)
+	free((void *)file->data);
+#elif defined(_WIN32)
+	UnmapViewOfFile(file->data);
+	CloseHandle(file->mapping);
+	CloseHandle(file->file);
+#else
+	munmap((void *)file->data, file->size);
+#endif
+}
+
+/* Tell the OS bytes first to end - 1 of file will be read, in order if seq */
+static void
+advise_file(const btw_file *file, unsigned long long first,
+		unsigned long long end, int seq)
+{
+#if !defined(BTW_NO_MMAP) && !defined(_WIN32) && defined(POSIX_MADV_WILLNEED)
+	long page = sysconf(_SC_PAGESIZE);
+
+	/* The address must be page aligned */
+	if (page > 0) {
+		first -= first % page;
+	}
+	if (first < end) {
+		posix_madvise((void *)(file->data + first), end - first,
+			seq ? POSIX_MADV_SEQUENTIAL : POSIX_MADV_WILLNEED);
+	}
+#else
+	(void)file;
+	(void)first;
+	(void)end;
+	(void)seq;
+#endif
+}
+
+btw_file *
+btw_open_file(const char *path, btw_def *def)
+{
+	btw_file *file;
+
+	if (!path || !def) {
+		return NULL;
+	}
+	file = (btw_file *)malloc(sizeof(*file));
+	if (!file) {
+		return NULL;
+	}
+	if (!map_file(file, path)) {
+		free(file);
+		return NULL;
+	}
+
+	if (!check_header(file->data, file->size, &file->def, &file->lay)) {
+		btw_close_file(file);
+		return NULL;
+	}
+	*def = file->def;
+	return file;
+}
+
+const unsigned char *
+btw_map(const btw_file *file, unsigned long long *size)
+{
+	if (!file) {
+		return NULL;
+	}
+	if (size) {
+		*size = file->size;
+	}
+	return file->data;
+}
+
+void *
+btw_file_decode(btw_file *file, btw_format fmt, unsigned long long *out_len)
+{
+	btw_def def;
+
+	if (!file) {
+		return NULL;
+	}
+	advise_file(file, file->lay.data_pos, file->size, 1);
+	return decode_all(file->data, file->size, fmt, 0, &def, out_len);
+}
+
+unsigned long long
+btw_file_decode_range(btw_file *file, btw_format fmt,
+		unsigned long long first_sample, unsigned long long count,
+		void *out)
+{
+	unsigned long long first, end, entry, last;
+	const btw_layout *lay;
+	const btw_def *d;
+	btw_samples dst;
+	btw_def def;
+
+	if (!file || !out || !count
+			|| first_sample >= file->def.sample_count) {
+		return 0;
+	}
+	lay = &file->lay;
+	d = &file->def;
+	if (count > d->sample_count - first_sample) {
+		count = d->sample_count - first_sample;
+	}
+
+	/* From the entry decode_range starts at to the one after the range */
+	first = lay->data_pos;
+	end = file->size;
+	if (lay->seek_interval) {
+		entry = first_sample / d->block_size / lay->seek_interval;
+		last = (first_sample + count - 1) / d->block_size
+			/ lay->seek_interval + 1;
+		first = load_le64(lay->seek_table + entry * 8);
+		if (last < seek_entries(d, lay->seek_interval)) {
+			end = load_le64(lay->seek_table + last * 8);
+		}
+		if (end > file->size) {
+			end = file->size;
+		}
+	}
+	advise_file(file, first, end, 0);
+	samples_init(&dst, out, NULL, fmt, first_sample);
+	return decode_range(file->data, file->size, &def, first_sample, count,
+		&dst);
+}
+
+void
+btw_close_file(btw_file *file)
+{
+	if (file) {
+		unmap_file(file);
+		free(file);
+	}
+}
+
+/* Read up to size bytes from the start of the file at path, -1 on error */
+static long long
+read_file_head(const char *path, unsigned char *buf, unsigned int size)
+{
+#if defined(BTW_NO_MMAP)
+	long long got;
+	FILE *f;
+
+	if (!(f = fopen(path, "rb"))) {
+		return -1;
+	}
+	got = fread(buf, 1, size, f);
+	if (ferror(f)) {
+		got = -1;
+	}
+	fclose(f);
+	return got;
+#elif defined(_WIN32)
+	HANDLE file;
+	DWORD got;
+	BOOL ok;
+
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return -1;
+	}
+	ok = ReadFile(file, buf, size, &got, NULL);
+	CloseHandle(file);
+	return ok ? (long long)got : -1;
+#else
+	unsigned int got = 0;
+	ssize_t r = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return -1;
+	}
+	/* Only the end of the file stops this early */
+	while (got < size && (r = read(fd, buf + got, size - got)) > 0) {
+		got += r;
+	}
+	close(fd);
+	return r < 0 ? -1 : (long long)got;
+#endif
+}
+
+typedef struct {
+	const char *const *paths;
+	btw_def *defs;
+	int *results;
+} btw_probe_job;
+
+static void
+probe_file(void *arg, unsigned int i)
+{
+	btw_probe_job *job = (btw_probe_job *)arg;
+	unsigned char head[BTW_PROBE_SIZE];
+	long long got;
+	int r;
+
+	got = job->paths[i] ? read_file_head(job->paths[i], head,
+		sizeof(head)) : -1;
+	if (got < 0) {
+		memset(job->defs + i, 0, sizeof(*job->defs));
+		r = BTW_ERR_IO;
+	} else {
+		r = btw_probe(head, got, job->defs + i);
+	}
+	job->results[i] = r;
+}
+
+unsigned int
+btw_probe_files(const char *const *paths, unsigned int count,
+		unsigned int threads, btw_def *defs, int *results)
+{
+	btw_probe_job job;
+	unsigned int i, found = 0;
+
+	if (!paths || !defs || !results) {
+		return 0;
+	}
+	job.paths = paths;
+	job.defs = defs;
+	job.results = results;
+	run_tasks(probe_file, &job, count, threads ? threads : cpu_count());
+
+	for (i = 0; i < count; i++) {
+		found += results[i] == BTW_OK;
+	}
+	return found;
+}
+
+/* Samples per channel each transcoding task codes at a time, about */
+#define BTW_WAV_GROUP 65536
+
+#define BTW_WAV_PCM 1
+#define BTW_WAV_EXTENSIBLE 0xfffe
+
+/* Read exactly len bytes, BTW_ERR_CORRUPT if the input ends first */
+static int
+read_full(btw_read_fn read, void *user, unsigned char *buf,
+		unsigned long long len)
+{
+	long long got;
+
+	while (len) {
+		got = read(user, buf, len);
+		if (got < 0) {
+			return BTW_ERR_IO;
+		}
+		if (!got) {
+			return BTW_ERR_CORRUPT;
+		}
+		buf += got;
+		len -= got;
+	}
+	return BTW_OK;
+}
+
+static int
+skip_input(btw_read_fn read, void *user, unsigned long long len)
+{
+	unsigned char buf[256];
+	unsigned long long n;
+	int r;
+
+	for (; len; len -= n) {
+		n = len < sizeof(buf) ? len : sizeof(buf);
+		if ((r = read_full(read, user, buf, n))) {
+			return r;
+		}
+	}
+	return BTW_OK;
+}
+
+/*
+ * Read a WAV header up to the samples into def and the format they are in.
+ * RF64 files take their length from the ds64 chunk, and RIFF files that
+ * leave it unknown come out empty.
+ */
+static int
+read_wav_header(btw_read_fn read, void *user, btw_def *def,
+		btw_format *fmt)
+{
+	static const btw_format formats[] = {
+		BTW_FMT_U8, BTW_FMT_S16, BTW_FMT_S24, BTW_FMT_S32
+	};
+	unsigned long long size, data_size = ~0ULL;
+	unsigned int tag = 0, align = 0, bits = 0, take;
+	unsigned char b[40];
+	int rf64, r;
+
+	memset(def, 0, sizeof(*def));
+	if ((r = read_full(read, user, b, 12))) {
+		return r;
+	}
+	rf64 = !memcmp(b, "RF64", 4);
+	if ((!rf64 && memcmp(b, "RIFF", 4)) || memcmp(b + 8, "WAVE", 4)) {
+		return BTW_ERR_CORRUPT;
+	}
+
+	for (;;) {
+		if ((r = read_full(read, user, b, 8))) {
+			return r;
+		}
+		size = load_le32(b + 4);
+		if (!memcmp(b, "data", 4)) {
+			break;
+		}
+
+		take = 0;
+		if (!memcmp(b, "ds64", 4) && size >= 24) {
+			take = 24;
+			if ((r = read_full(read, user, b, take))) {
+				return r;
+			}
+			data_size = load_le64(b + 8);
+		} else if (!memcmp(b, "fmt ", 4) && size >= 16) {
+			take = size < sizeof(b) ? size : sizeof(b);
+			if ((r = read_full(read, user, b, take))) {
+				return r;
+			}
+			tag = load_le16(b);
+			def->channels = load_le16(b + 2);
+			def->sample_rate = load_le32(b + 4);
+			align = load_le16(b + 12);
+			bits = load_le16(b + 14);
+			/* The real tag starts the subformat */
+			if (tag == BTW_WAV_EXTENSIBLE && take >= 40) {
+				tag = load_le16(b + 24);
+			}
+		}
+		/* Chunks are padded to an even size */
+		if ((r = skip_input(read, user, size - take + (size & 1)))) {
+			return r;
+		}
+	}
+
+	if (size == 0xffffffff) {
+		/* Only RF64 knows the length a streaming writer didn't */
+		size = rf64 ? data_size : 0;
+	}
+	if (tag != BTW_WAV_PCM || !def->channels || !def->sample_rate
+			|| !bits || bits > 32 || bits % 8
+			|| align != def->channels * bits / 8) {
+		return BTW_ERR_CORRUPT;
+	}
+	def->bits_per_sample = bits;
+	def->sample_count = size / align;
+	*fmt = formats[bits / 8 - 1];
+	return BTW_OK;
+}
+
+static unsigned char *
+put_le(unsigned char *p, uint64_t v, unsigned int bytes)
+{
+	for (; bytes; bytes--, v >>= 8) {
+		*p++ = v & 0xff;
+	}
+	return p;
+}
+
+/* Bytes of the longest header wav_header writes */
+#define BTW_WAV_HEADER_SIZE 104
+
+/*
+ * Write the header of a WAV file holding the samples def describes in
+ * pcm_bytes(def) bytes each, return its length
+ */
+static unsigned int
+wav_header(const btw_def *def, unsigned char *h)
+{
+	static const unsigned char pcm_guid[16] = { 1, 0, 0, 0, 0, 0, 0x10,
+		0, 0x80, 0, 0, 0xaa, 0, 0x38, 0x9b, 0x71 };
+	unsigned int bytes = pcm_bytes(def), frame = def->channels * bytes;
+	int ext = def->channels > 2 || def->bits_per_sample != bytes * 8;
+	unsigned int fmt_len = ext ? 40 : 16;
+	unsigned long long data = def->sample_count * frame;
+	unsigned long long riff = 4 + 8 + fmt_len + 8 + data + (data & 1);
+	int rf64 = riff > 0xffffffff;
+	unsigned char *p = h;
+
+	memcpy(p, rf64 ? "RF64" : "RIFF", 4);
+	p = put_le(p + 4, rf64 ? 0xffffffff : riff, 4);
+	memcpy(p, "WAVE", 4);
+	p += 4;
+	if (rf64) {
+		memcpy(p, "ds64", 4);
+		p = put_le(p + 4, 28, 4);
+		p = put_le(p, riff + 36, 8);
+		p = put_le(p, data, 8);
+		p = put_le(p, def->sample_count, 8);
+		p = put_le(p, 0, 4);
+	}
+
+	memcpy(p, "fmt ", 4);
+	p = put_le(p + 4, fmt_len, 4);
+	p = put_le(p, ext ? BTW_WAV_EXTENSIBLE : BTW_WAV_PCM, 2);
+	p = put_le(p, def->channels, 2);
+	p = put_le(p, def->sample_rate, 4);
+	p = put_le(p, (uint64_t)def->sample_rate * frame, 4);
+	p = put_le(p, frame, 2);
+	p = put_le(p, bytes * 8, 2);
+	if (ext) {
+		p = put_le(p, 22, 2);
+		p = put_le(p, def->bits_per_sample, 2);
+		p = put_le(p, 0, 4);
+		memcpy(p, pcm_guid, sizeof(pcm_guid));
+		p += sizeof(pcm_guid);
+	}
+
+	memcpy(p, "data", 4);
+	p = put_le(p + 4, rf64 ? 0xffffffff : data, 4);
+	return p - h;
+}
+
+/* Swap n samples in fmt between little-endian and the host's order */
+static void
+swap_samples(unsigned char *p, unsigned long long n, btw_format fmt)
+{
+#ifdef BTW_LITTLE_ENDIAN
+	(void)p;
+	(void)n;
+	(void)fmt;
+#else
+	unsigned int size = format_size(fmt), b;
+	unsigned char t;
+
+	if (fmt == BTW_FMT_U8 || fmt == BTW_FMT_S24) {
+		return;
+	}
+	for (; n; n--, p += size) {
+		for (b = 0; b < size / 2; b++) {
+			t = p[b];
+			p[b] = p[size - 1 - b];
+			p[size - 1 - b] = t;
+		}
+	}
+#endif
+}
+
+/*
+ * Chunks are split into groups of blocks_per_group blocks, numbered from
+ * the start of the stream. Return the samples per channel in group q.
+ */
+static unsigned long long
+group_samples(const btw_def *def, unsigned long long blocks_per_group,
+		unsigned long long q)
+{
+	unsigned long long size = blocks_per_group * def->block_size;
+
+	if (q * size >= def->sample_count) {
+		return 0;
+	}
+	return def->sample_count - q * size < size
+		? def->sample_count - q * size : size;
+}
+
+/* Blocks per transcoding group, a whole number of seek table entries */
+static unsigned long long
+group_blocks(const btw_def *def, unsigned int seek_interval)
+{
+	unsigned long long blocks = (BTW_WAV_GROUP + def->block_size - 1)
+		/ def->block_size;
+
+	if (seek_interval) {
+		blocks = (blocks + seek_interval - 1) / seek_interval
+			* seek_interval;
+	}
+	return blocks;
+}
+
+/*
+ * Run task 0, the I/O, and one task for each of "groups" groups of a chunk
+ * on their own threads, or on pool
+ */
+static void
+run_round(const btw_thread_pool *pool, btw_task_fn fn, void *arg,
+		unsigned int groups)
+{
+	if (pool) {
+		pool->run(pool->pool, fn, arg, groups + 1);
+	} else {
+		run_tasks(fn, arg, groups + 1, groups + 1);
+	}
+}
+
+/*
+ * Chunk c is encoded in round c, while its previous chunk is written and
+ * its next one read. Each set of buffers alternates between chunks.
+ */
+typedef struct {
+	btw_def def;
+	btw_format fmt;
+	btw_read_fn read;
+	void *in;
+	btw_write_fn write;
+	void *out;
+	unsigned int groups;		/* Per chunk */
+	unsigned long long blocks_per_group, chunks, round;
+	unsigned char *pcm[2];		/* Samples of a chunk */
+	unsigned char **bufs;		/* Output of each group, in two sets */
+	unsigned long long *lens;
+	uint32_t *crcs;
+	long long **scratch;		/* One per group */
+	unsigned char *head;		/* The header and seek table */
+	unsigned long long head_len;
+	unsigned long long pos;		/* Bytes written */
+	uint32_t crc;			/* Of the chunks written */
+	int io_error, failed;
+#ifdef BTW_STATS
+	btw_stats *stats;		/* One per group, NULL for none */
+#endif
+} btw_wav_encode_job;
+
+/* Bytes of WAV samples in chunk c */
+static unsigned long long
+chunk_bytes(const btw_def *def, btw_format fmt, unsigned int groups,
+		unsigned long long blocks_per_group, unsigned long long c)
+{
+	unsigned long long size = blocks_per_group * def->block_size * groups;
+	unsigned long long n = def->sample_count - c * size;
+
+	return (n < size ? n : size) * def->channels * format_size(fmt);
+}
+
+static void
+wav_encode_io(btw_wav_encode_job *job)
+{
+	unsigned long long c = job->round, q, n, bytes, slot;
+#if BTW_SEEK_INTERVAL
+	unsigned long long k, entries = seek_entries(&job->def,
+		BTW_SEEK_INTERVAL);
+	unsigned char *table = job->head + BTW_HEADER_SIZE;
+#endif
+	unsigned int g;
+	int r;
+
+	/* Write out the previous chunk */
+	for (g = 0; c > 0 && g < job->groups; g++) {
+		q = (c - 1) * job->groups + g;
+		slot = ((c - 1) & 1) * job->groups + g;
+		n = group_samples(&job->def, job->blocks_per_group, q);
+		if (!n) {
+			break;
+		}
+		if (job->write(job->out, job->pos, job->bufs[slot],
+				job->lens[slot])) {
+			job->io_error = BTW_ERR_IO;
+			return;
+		}
+#if BTW_SEEK_INTERVAL
+		k = q * job->blocks_per_group / BTW_SEEK_INTERVAL;
+		for (; k < (q + 1) * job->blocks_per_group / BTW_SEEK_INTERVAL
+				&& k < entries; k++) {
+			store_le64(table + k * 8, job->pos
+				+ load_le64(table + k * 8));
+		}
+#endif
+		job->crc = crc32c_combine(job->crc, job->crcs[slot],
+			n * job->def.channels * pcm_bytes(&job->def));
+		job->pos += job->lens[slot];
+	}
+
+	/* And read in the next */
+	if (c + 1 < job->chunks) {
+		bytes = chunk_bytes(&job->def, job->fmt, job->groups,
+			job->blocks_per_group, c + 1);
+		r = read_full(job->read, job->in, job->pcm[(c + 1) & 1], bytes);
+		if (r) {
+			job->io_error = r;
+			return;
+		}
+		swap_samples(job->pcm[(c + 1) & 1],
+			bytes / format_size(job->fmt), job->fmt);
+	}
+}
+
+static void
+wav_encode_task(void *arg, unsigned int task)
+{
+	btw_wav_encode_job *job = (btw_wav_encode_job *)arg;
+	unsigned long long c = job->round, q, size, slot;
+	unsigned int g = task - 1;
+	btw_samples in;
+	btw_writer bw;
+
+	if (!task) {
+		wav_encode_io(job);
+		return;
+	}
+	q = c * job->groups + g;
+	slot = (c & 1) * job->groups + g;
+	size = job->blocks_per_group * job->def.block_size;
+	job->crcs[slot] = 0;
+	if (c >= job->chunks
+			|| !group_samples(&job->def, job->blocks_per_group, q)) {
+		return;
+	}
+
+	samples_init(&in, job->pcm[c & 1], NULL, job->fmt,
+		c * job->groups * size);
+	bw_init(&bw, job->bufs[slot], encoded_bound(&job->def, size), 0);
+#ifdef BTW_STATS
+	bw.stats = job->stats ? job->stats + g : NULL;
+#endif
+	encode_blocks(&in, &job->def, q * job->blocks_per_group,
+		(q + 1) * job->blocks_per_group, &bw,
+		job->head + BTW_HEADER_SIZE, job->scratch[g],
+		job->crcs + slot, BTW_MARK_NONE);
+	job->lens[slot] = bw_finish(&bw);
+	if (bw.overflow) {
+		job->failed = 1;
+	}
+}
+
+int
+btw_wav_encode(btw_read_fn read, void *in, btw_write_fn write, void *out,
+		const btw_def *def, unsigned int threads,
+		const btw_thread_pool *pool)
+{
+	unsigned char check[BTW_FILE_CHECK_BITS / 8];
+	unsigned long long groups, size, table;
+	btw_wav_encode_job job;
+	unsigned int g;
+	btw_writer bw;
+	btw_def d;
+	int r;
+
+	if (!read || !write) {
+		return BTW_ERR_INVALID;
+	}
+	memset(&job, 0, sizeof(job));
+	if ((r = read_wav_header(read, in, &d, &job.fmt))) {
+		return r;
+	}
+	d.block_size = def ? def->block_size : 0;
+	d.min_block_size = def ? def->min_block_size : 0;
+	if (!check_encode(&d, job.fmt, &job.def) || !d.sample_count) {
+		return BTW_ERR_INVALID;
+	}
+	job.read = read;
+	job.in = in;
+	job.write = write;
+	job.out = out;
+
+	/* One group per thread, unless there are fewer in the stream */
+	job.blocks_per_group = group_blocks(&job.def, BTW_SEEK_INTERVAL);
+	size = job.blocks_per_group * job.def.block_size;
+	groups = (job.def.sample_count + size - 1) / size;
+	job.groups = threads ? threads : cpu_count();
+	if (job.groups > groups) {
+		job.groups = groups;
+	}
+	job.chunks = (groups + job.groups - 1) / job.groups;
+
+	table = seek_entries(&job.def, BTW_SEEK_INTERVAL) * 8;
+	job.head_len = BTW_HEADER_SIZE + table;
+	job.head = (unsigned char *)calloc(job.head_len, 1);
+	job.bufs = (unsigned char **)calloc(2 * job.groups, sizeof(*job.bufs));
+	job.lens = (unsigned long long *)calloc(2 * job.groups,
+		sizeof(*job.lens));
+	job.crcs = (uint32_t *)calloc(2 * job.groups, sizeof(*job.crcs));
+	job.scratch = (long long **)calloc(job.groups, sizeof(*job.scratch));
+#ifdef BTW_STATS
+	job.stats = attached_stats ? (btw_stats *)calloc(job.groups,
+		sizeof(*job.stats)) : NULL;
+#endif
+	r = BTW_ERR_NOMEM;
+	if (!job.head || !job.bufs || !job.lens || !job.crcs || !job.scratch) {
+		goto done;
+	}
+	for (g = 0; g < 2; g++) {
+		job.pcm[g] = (unsigned char *)malloc(chunk_bytes(&job.def,
+			job.fmt, job.groups, job.blocks_per_group, 0));
+		if (!job.pcm[g]) {
+			goto done;
+		}
+	}
+	for (g = 0; g < 2 * job.groups; g++) {
+		job.bufs[g] = (unsigned char *)malloc(encoded_bound(&job.def,
+			size));
+		if (!job.bufs[g]) {
+			goto done;
+		}
+	}
+	for (g = 0; g < job.groups; g++) {
+		job.scratch[g] = (long long *)malloc(encode_scratch(&job.def)
+			* sizeof(**job.scratch));
+		if (!job.scratch[g]) {
+			goto done;
+		}
+	}
+
+	/* The seek table is kept in head and written again at the end */
+	bw_init(&bw, job.head, job.head_len, 0);
+	write_header(&bw, &job.def, BTW_SEEK_INTERVAL, write_flags(job.fmt));
+#ifdef BTW_STATS
+	if (bw.stats) {
+		bw.stats->header_bits += bw.pos * 8;
+	}
+#endif
+	r = BTW_ERR_IO;
+	if (write(out, 0, job.head, job.head_len)) {
+		goto done;
+	}
+	job.pos = job.head_len;
+
+	/* The first chunk is read before anything can overlap it */
+	r = read_full(read, in, job.pcm[0], chunk_bytes(&job.def, job.fmt,
+		job.groups, job.blocks_per_group, 0));
+	if (r) {
+		goto done;
+	}
+	swap_samples(job.pcm[0], chunk_bytes(&job.def, job.fmt, job.groups,
+		job.blocks_per_group, 0) / format_size(job.fmt), job.fmt);
+
+	for (job.round = 0; job.round <= job.chunks; job.round++) {
+		run_round(pool, wav_encode_task, &job, job.groups);
+		if (job.io_error || job.failed) {
+			break;
+		}
+	}
+	r = job.io_error ? job.io_error : job.failed ? BTW_ERR_NOMEM : BTW_OK;
+	if (r) {
+		goto done;
+	}
+
+	r = BTW_ERR_IO;
+	if (BTW_WRITE_FLAGS & BTW_FLAG_CRC) {
+		bw_init(&bw, check, sizeof(check), 0);
+		write_file_check(&bw, job.crc);
+		if (write(out, job.pos, check, sizeof(check))) {
+			goto done;
+		}
+	}
+	if (table && write(out, BTW_HEADER_SIZE, job.head + BTW_HEADER_SIZE,
+			table)) {
+		goto done;
+	}
+	r = BTW_OK;
+
+done:
+#ifdef BTW_STATS
+	for (g = 0; job.stats && g < job.groups; g++) {
+		stats_add(attached_stats, job.stats + g);
+	}
+	free(job.stats);
+#endif
+	for (g = 0; job.bufs && g < 2 * job.groups; g++) {
+		free(job.bufs[g]);
+	}
+	for (g = 0; job.scratch && g < job.groups; g++) {
+		free(job.scratch[g]);
+	}
+	free(job.pcm[0]);
+	free(job.pcm[1]);
+	free(job.bufs);
+	free(job.lens);
+	free(job.crcs);
+	free(job.scratch);
+	free(job.head);
+	return r;
+}
+
+/* Like btw_wav_encode_job, with chunk c decoded in round c */
+typedef struct {
+	const unsigned char *data;
+	unsigned long long len;
+	btw_def def;
+	btw_layout lay;
+	btw_format fmt;
+	btw_write_fn write;
+	void *out;
+	unsigned int groups;
+	unsigned long long blocks_per_group, chunks, round;
+	unsigned char *pcm[2];
+	uint32_t *crcs;			/* Of each group, in two sets */
+	long long **scratch;
+	unsigned long long next;	/* Without a seek table, where the
+					   next chunk starts, in bits */
+	unsigned long long end;		/* After the last block, in bits */
+	unsigned long long pos;		/* Bytes written */
+	uint32_t crc;
+	int io_error, failed;
+#ifdef BTW_STATS
+	btw_stats *stats;
+#endif
+} btw_wav_decode_job;
+
+static void
+wav_decode_io(btw_wav_decode_job *job)
+{
+	unsigned long long c = job->round, q, n, bytes, slot;
+	unsigned char *pcm = job->pcm[(c - 1) & 1];
+	unsigned int g;
+
+	if (!c) {
+		return;
+	}
+	bytes = chunk_bytes(&job->def, job->fmt, job->groups,
+		job->blocks_per_group, c - 1);
+	swap_samples(pcm, bytes / format_size(job->fmt), job->fmt);
+	if (job->write(job->out, job->pos, pcm, bytes)) {
+		job->io_error = BTW_ERR_IO;
+		return;
+	}
+	job->pos += bytes;
+
+	for (g = 0; g < job->groups; g++) {
+		q = (c - 1) * job->groups + g;
+		slot = ((c - 1) & 1) * job->groups + g;
+		n = group_samples(&job->def, job->blocks_per_group, q);
+		job->crc = crc32c_combine(job->crc, job->crcs[slot],
+			n * job->def.channels * pcm_bytes(&job->def));
+	}
+}
+
+static void
+wav_decode_task(void *arg, unsigned int task)
+{
+	btw_wav_decode_job *job = (btw_wav_decode_job *)arg;
+	unsigned long long c = job->round, q, i, end, slot, entry;
+	unsigned long long size = job->blocks_per_group * job->def.block_size;
+	unsigned int g = task - 1;
+	btw_samples dst;
+	btw_reader br;
+
+	if (!task) {
+		wav_decode_io(job);
+		return;
+	}
+	q = c * job->groups + g;
+	slot = (c & 1) * job->groups + g;
+	job->crcs[slot] = 0;
+	if (c >= job->chunks
+			|| !group_samples(&job->def, job->blocks_per_group, q)) {
+		return;
+	}
+
+	br_init(&br, job->data, job->next, len_bits(job->len));
+	if (job->lay.seek_interval) {
+		entry = q * job->blocks_per_group / job->lay.seek_interval;
+		br.pos = load_le64(job->lay.seek_table + entry * 8) * 8;
+		/* An entry past the end fails the first read */
+		if (br.pos > br.end) {
+			br.pos = br.end;
+		}
+	}
+#ifdef BTW_STATS
+	br.stats = job->stats ? job->stats + g : NULL;
+#endif
+
+	samples_init(&dst, job->pcm[c & 1], NULL, job->fmt,
+		c * job->groups * size);
+	i = q * size;
+	end = i + size;
+	while (i < end && i < job->def.sample_count && !br.error) {
+		i += decode_block(&br, &job->def, &job->lay, i, &dst,
+			job->scratch[g], job->crcs + slot);
+	}
+	if (br.error) {
+		job->failed = 1;
+		return;
+	}
+	job->next = br.pos;
+	if (i == job->def.sample_count) {
+		job->end = br.pos;
+	}
+}
+
+int
+btw_wav_decode(const unsigned char *data, unsigned long long len,
+		btw_write_fn write, void *out, unsigned int threads,
+		const btw_thread_pool *pool)
+{
+	static const btw_format formats[] = {
+		BTW_FMT_U8, BTW_FMT_S16, BTW_FMT_S24, BTW_FMT_S32
+	};
+	static const unsigned char pad[1] = { 0 };
+	unsigned char head[BTW_WAV_HEADER_SIZE];
+	unsigned long long groups, size;
+	btw_wav_decode_job job;
+	unsigned int g;
+	btw_reader br;
+	int r;
+
+	if (!data || !write) {
+		return BTW_ERR_INVALID;
+	}
+	memset(&job, 0, sizeof(job));
+	if (!check_header(data, len, &job.def, &job.lay)
+			|| !check_decode(data, len, &job.def, &job.lay,
+			BTW_FMT_S32)) {
+		return BTW_ERR_CORRUPT;
+	}
+	job.data = data;
+	job.len = len;
+	job.fmt = formats[pcm_bytes(&job.def) - 1];
+	job.write = write;
+	job.out = out;
+	job.next = job.end = job.lay.data_pos * 8;
+
+	/* Without a seek table the blocks can only be found one by one */
+	job.blocks_per_group = group_blocks(&job.def, job.lay.seek_interval);
+	size = job.blocks_per_group * job.def.block_size;
+	groups = (job.def.sample_count + size - 1) / size;
+	job.groups = !job.lay.seek_interval ? 1 : threads ? threads
+		: cpu_count();
+	if (job.groups > groups) {
+		job.groups = groups;
+	}
+	job.chunks = job.groups ? (groups + job.groups - 1) / job.groups : 0;
+
+	job.crcs = (uint32_t *)calloc(2 * job.groups + 1, sizeof(*job.crcs));
+	job.scratch = (long long **)calloc(job.groups + 1,
+		sizeof(*job.scratch));
+#ifdef BTW_STATS
+	job.stats = attached_stats ? (btw_stats *)calloc(job.groups + 1,
+		sizeof(*job.stats)) : NULL;
+#endif
+	r = BTW_ERR_NOMEM;
+	if (!job.crcs || !job.scratch) {
+		goto done;
+	}
+	for (g = 0; g < 2 && job.groups; g++) {
+		job.pcm[g] = (unsigned char *)malloc(chunk_bytes(&job.def,
+			job.fmt, job.groups, job.blocks_per_group, 0));
+		if (!job.pcm[g]) {
+			goto done;
+		}
+	}
+	for (g = 0; g < job.groups; g++) {
+		job.scratch[g] = (long long *)malloc(decode_scratch(&job.def)
+			* sizeof(**job.scratch));
+		if (!job.scratch[g]) {
+			goto done;
+		}
+	}
+
+	r = BTW_ERR_IO;
+	job.pos = wav_header(&job.def, head);
+	if (write(out, 0, head, job.pos)) {
+		goto done;
+	}
+
+	for (job.round = 0; job.round <= job.chunks; job.round++) {
+		run_round(pool, wav_decode_task, &job, job.groups);
+		if (job.io_error || job.failed) {
+			break;
+		}
+	}
+	r = job.io_error ? job.io_error : job.failed ? BTW_ERR_CORRUPT
+		: BTW_OK;
+	if (r) {
+		goto done;
+	}
+
+	br_init(&br, data, job.end, len_bits(len));
+	if (!job.def.sample_count && job.lay.flags & BTW_FLAG_OPEN
+			&& !job.lay.cut) {
+		decode_block(&br, &job.def, &job.lay, 0, NULL, NULL, NULL);
+	}
+	br_check_file(&br, &job.lay, job.crc);
+	if (br.error) {
+		r = BTW_ERR_CORRUPT;
+	} else if (job.pos & 1 && write(out, job.pos, pad, 1)) {
+		/* The data chunk is padded to an even size */
+		r = BTW_ERR_IO;
+	}
+
+done:
+#ifdef BTW_STATS
+	for (g = 0; job.stats && g < job.groups; g++) {
+		stats_add(attached_stats, job.stats + g);
+	}
+	free(job.stats);
+#endif
+	for (g = 0; job.scratch && g < job.groups; g++) {
+		free(job.scratch[g]);
+	}
+	free(job.pcm[0]);
+	free(job.pcm[1]);
+	free(job.crcs);
+	free(job.scratch);
+	return r;
+}
+
+struct btw_decoder {
+	btw_read_fn read;
+	void *user;
+	btw_def def;
+	btw_layout lay;
+	int have_header;
+	unsigned char *in;
+	unsigned long long in_cap, in_len;	/* Bytes buffered */
+	unsigned long long in_bit;		/* Position in in, in bits */
+	unsigned long long skip;		/* Bytes left to drop */
+	unsigned long long next;		/* First sample of next block */
+	unsigned char *block;
+	btw_format fmt;
+	long long *scratch;
+	unsigned int block_len, block_pos;
+	uint32_t crc;				/* Of the PCM so far */
+	int eof, failed;
+};
+
+btw_decoder *
+btw_decoder_init_fmt(btw_format fmt, btw_read_fn read, void *user)
+{
+	btw_decoder *dec;
+
+	if (fmt > BTW_FMT_F32) {
+		return NULL;
+	}
+	dec = (btw_decoder *)calloc(1, sizeof(*dec));
+	if (dec) {
+		dec->read = read;
+		dec->user = user;
+		dec->fmt = fmt;
+	}
+	return dec;
+}
+
+#ifdef BTW_NATIVE_FMT
+btw_decoder *
+btw_decoder_init(btw_read_fn read, void *user)
+{
+	return btw_decoder_init_fmt(BTW_NATIVE_FMT, read, user);
+}
+#endif
+
+void
+btw_decoder_free(btw_decoder *dec)
+{
+	if (dec) {
+		free(dec->in);
+		free(dec->block);
+		free(dec->scratch);
+		free(dec);
+	}
+}
+
+/* Drop consumed input and make room for at least len more bytes */
+static int
+decoder_reserve(btw_decoder *dec, unsigned long long len)
+{
+	unsigned long long used = dec->in_bit >> 3, cap;
+	unsigned char *in;
+
+	if (used) {
+		memmove(dec->in, dec->in + used, dec->in_len - used);
+		dec->in_len -= used;
+		dec->in_bit &= 7;
+	}
+	if (dec->in_cap - dec->in_len >= len) {
+		return 0;
+	}
+
+	cap = dec->in_cap ? dec->in_cap : 64;
+	while (cap - dec->in_len < len) {
+		cap *= 2;
+	}
+	in = (unsigned char *)realloc(dec->in, cap);
+	if (!in) {
+		return -1;
+	}
+	dec->in = in;
+	dec->in_cap = cap;
+	return 0;
+}
+
+int
+btw_decoder_push(btw_decoder *dec, const unsigned char *data,
+		unsigned long long len)
+{
+	if (!dec || dec->failed) {
+		return -1;
+	}
+	if (!data) {
+		dec->eof = 1;
+		return 0;
+	}
+	if (!len) {
+		return 0;
+	}
+	if (decoder_reserve(dec, len)) {
+		dec->failed = 1;
+		return -1;
+	}
+	memcpy(dec->in + dec->in_len, data, len);
+	dec->in_len += len;
+	return 0;
+}
+
+/* Get more input from the read callback, filling the buffer */
+static int
+decoder_fill(btw_decoder *dec)
+{
+	long long got;
+
+	if (decoder_reserve(dec, 1)) {
+		return -1;
+	}
+	got = dec->read(dec->user, dec->in + dec->in_len,
+		dec->in_cap - dec->in_len);
+	if (got < 0) {
+		return -1;
+	}
+	dec->eof = !got;
+	dec->in_len += got;
+	return 0;
+}
+
+/*
+ * Bits the next block can take at most in a valid stream, with its start,
+ * padding and check and the file check after it, or ~0 when unary runs
+ * aren't escaped and may be too long to bound
+ */
+static unsigned long long
+block_limit(const btw_def *def, const btw_layout *lay)
+{
+	/*
+	 * Every piece holds a sample and every partition one per channel. A
+	 * code is at most a run of ones, a sign and rice_len bits, or the
+	 * escaped magnitude, and verbatim and constant samples are shorter.
+	 */
+	int rice_bits = bits_required(def->bits_per_sample);
+	unsigned long long per_sample = 1 + BTW_STEREO_BITS + def->channels
+		* (BTW_ORDER_BITS + BTW_PARTITION_BITS + rice_bits
+			+ BTW_ESCAPE_RUN + 1 + (1 << rice_bits)
+			+ def->bits_per_sample + 6);
+
+	if (!(lay->flags & BTW_FLAG_ESCAPE)) {
+		return ~0ULL;
+	}
+	return def->block_size * per_sample + 1 + BTW_LAST_BLOCK_BITS + 7
+		+ BTW_BLOCK_CHECK_BITS + BTW_FILE_CHECK_BITS + 7;
+}
+
+/*
+ * Parse the header, drop the seek table or decode the next block. Returns
+ * 1 on progress, 0 when more input is needed and -1 on error.
+ */
+static int
+decoder_step(btw_decoder *dec)
+{
+	unsigned long long avail = dec->in_len - (dec->in_bit >> 3);
+	unsigned int header, cap, n;
+	btw_reader br, peek;
+	btw_samples block;
+	uint32_t crc = dec->crc;
+
+	if (!dec->have_header) {
+		if (avail < 4 || (dec->in[3] != BTW_VERSION_V1
+				&& avail < BTW_HEADER_SIZE_FIXED)) {
+			return 0;
+		}
+		header = header_size(dec->in);
+		if (avail < header) {
+			return 0;
+		}
+		if (!read_header(dec->in, &dec->def, &dec->lay)
+				|| !check_format(&dec->def, dec->fmt)
+				|| (dec->def.sample_count == BTW_UNKNOWN_COUNT
+				&& !(dec->lay.flags & BTW_FLAG_OPEN))) {
+			return -1;
+		}
+
+		dec->block = (unsigned char *)malloc(samples_size(&dec->def,
+			dec->fmt, dec->def.block_size));
+		dec->scratch = (long long *)malloc(decode_scratch(&dec->def)
+			* sizeof(*dec->scratch));
+		if (!dec->block || !dec->scratch || decoder_reserve(dec,
+				encoded_bound(&dec->def, dec->def.block_size))) {
+			return -1;
+		}
+		dec->skip = dec->lay.data_pos;
+		dec->have_header = 1;
+		return 1;
+	}
+
+	if (dec->skip) {
+		if (!avail) {
+			return 0;
+		}
+		avail = avail < dec->skip ? avail : dec->skip;
+		dec->in_bit += avail * 8;
+		dec->skip -= avail;
+		return 1;
+	}
+
+	br_init(&br, dec->in, dec->in_bit, dec->in_len * 8);
+	if (dec->def.sample_count == BTW_UNKNOWN_COUNT) {
+		if (dec->eof && !avail) {
+			/* Cut off after a whole block */
+			dec->def.sample_count = dec->next;
+			dec->lay.cut = 1;
+			return 1;
+		}
+		/* The last block has the length */
+		peek = br;
+		if (br_get_exact(&peek, 1)) {
+			n = br_get_exact(&peek, BTW_LAST_BLOCK_BITS);
+			if (!peek.error) {
+				dec->def.sample_count = dec->next + n;
+			}
+		}
+	}
+	samples_init(&block, dec->block, NULL, dec->fmt, dec->next);
+	cap = decode_block(&br, &dec->def, &dec->lay, dec->next, &block,
+		dec->scratch, &crc);
+	if (!br.error && dec->next + cap == dec->def.sample_count
+			&& dec->lay.flags & BTW_FLAG_CRC) {
+		if (br_get_exact(&br, BTW_FILE_CHECK_BITS) != crc && !br.error) {
+			return -1;
+		}
+	}
+	if (br.error) {
+		/* A block that had all the input it could need is corrupt */
+		if (!cap || dec->in_len * 8 - dec->in_bit
+				>= block_limit(&dec->def, &dec->lay)) {
+			return -1;
+		}
+		/* Try again with more input, with room for a bigger block */
+		if (dec->in_len == dec->in_cap
+				&& decoder_reserve(dec, dec->in_cap)) {
+			return -1;
+		}
+		return 0;
+	}
+
+	dec->in_bit = br.pos;
+	dec->crc = crc;
+	dec->next += cap;
+	dec->block_len = cap;
+	dec->block_pos = 0;
+	return 1;
+}
+
+/* Run steps until one makes progress, reading input if there is a callback */
+static int
+decoder_advance(btw_decoder *dec)
+{
+	int r;
+
+	for (;;) {
+		r = dec->failed ? -1 : decoder_step(dec);
+		if (r) {
+			break;
+		}
+		if (dec->eof) {
+			/* The stream ended early */
+			r = -1;
+			break;
+		}
+		if (!dec->read) {
+			return 0;
+		}
+		if (decoder_fill(dec)) {
+			r = -1;
+			break;
+		}
+	}
+	if (r < 0) {
+		dec->failed = 1;
+	}
+	return r;
+}
+
+int
+btw_decoder_info(btw_decoder *dec, btw_def *def)
+{
+	int r;
+
+	if (!dec) {
+		return -1;
+	}
+	while (!dec->have_header) {
+		r = decoder_advance(dec);
+		if (r <= 0) {
+			return r ? -1 : 1;
+		}
+	}
+	if (def) {
+		*def = dec->def;
+	}
+	return 0;
+}
+
+long long
+btw_decoder_read(btw_decoder *dec, btw_sample_fmt *out,
+		unsigned long long frames)
+{
+	unsigned char *dst = (unsigned char *)out;
+	unsigned long long written = 0, n, frame;
+	int r;
+
+	if (!dec || (!out && frames)) {
+		return -1;
+	}
+
+	while (written < frames) {
+		if (dec->block_pos < dec->block_len) {
+			frame = dec->def.channels * format_size(dec->fmt);
+			n = dec->block_len - dec->block_pos;
+			n = n < frames - written ? n : frames - written;
+			memcpy(dst + written * frame,
+				dec->block + dec->block_pos * frame, n * frame);
+			dec->block_pos += n;
+			written += n;
+			continue;
+		}
+		if (dec->have_header && dec->next == dec->def.sample_count) {
+			break;
+		}
+
+		r = decoder_advance(dec);
+		if (r < 0) {
+			return written ? (long long)written : -1;
+		}
+		if (!r) {
+			break;
+		}
+	}
+	return written;
 }
 #endif
@@ -0,0 +1,322 @@
+/*
+ * btw - transcode WAV files to BTW and back with btw_wav_encode and
+ * btw_wav_decode.
+ *
+ *   btw [-f] [-t threads] [-B block_size] [-m min_block_size] [-o out]
+ *       file...
+ *
+ * Files ending in .wav are encoded to the same name ending in .btw, any
+ * other file is decoded to .wav. -o names the output when there is one
+ * input. An output that exists is left alone and its input fails unless
+ * -f is given. A file that fails is reported and its output removed unless
+ * it was there before, and the exit status is then 1. Rates are in MB of
+ * WAV per second.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+
+#define BTW_IMPLEMENTATION
+#include "../btw.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef _WIN32
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#endif
+
+/* stdio buffer of each file, large enough for a chunk's writes */
+#define CLI_BUFFER (1 << 20)
+
+typedef struct {
+	FILE *f;
+	unsigned long long at;	/* Where the next write goes without a seek */
+	int err;		/* errno of the first failed call, or 0 */
+} cli_file;
+
+/* Remember why f or a call on it failed, return -1 */
+static int
+fail(cli_file *f)
+{
+	if (!f->err) {
+		f->err = errno ? errno : EIO;
+	}
+	return -1;
+}
+
+static long long
+read_file(void *user, unsigned char *buf, unsigned long long len)
+{
+	cli_file *in = (cli_file *)user;
+	size_t got = fread(buf, 1, len, in->f);
+
+	return got || !ferror(in->f) ? (long long)got : fail(in);
+}
+
+static int
+write_file(void *user, unsigned long long offset, const unsigned char *data,
+		unsigned long long len)
+{
+	cli_file *out = (cli_file *)user;
+
+	if (offset != out->at && fseeko(out->f, offset, SEEK_SET)) {
+		return fail(out);
+	}
+	if (fwrite(data, 1, len, out->f) != len) {
+		return fail(out);
+	}
+	out->at = offset + len;
+	return 0;
+}
+
+static double
+now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*
+ * Why transcoding to out failed with r, the block sizes being checked
+ * already. The result may be overwritten by the next call.
+ */
+static const char *
+error_name(int r, int encode, const cli_file *in, const cli_file *dst,
+		const char *out)
+{
+	static char msg[256];
+
+	switch (r) {
+	case BTW_ERR_INVALID:
+		return encode ? "WAV data size is 0, or unknown as 0xffffffff"
+			: "not a BTW file";
+	case BTW_ERR_NOMEM:
+		return "out of memory";
+	case BTW_ERR_CORRUPT:
+		return encode ? "not a WAV file of 8, 16, 24 or 32-bit PCM, "
+			"or truncated" : "corrupt or truncated BTW file";
+	case BTW_ERR_IO:
+		if (dst->err) {
+			snprintf(msg, sizeof(msg), "%s: %s", out,
+				strerror(dst->err));
+			return msg;
+		}
+		return in->err ? strerror(in->err) : "read failed";
+	}
+	return "failed";
+}
+
+/* Whether path ends in ext, ignoring case */
+static int
+has_ext(const char *path, const char *ext)
+{
+	size_t n = strlen(path), e = strlen(ext), i;
+
+	if (n < e) {
+		return 0;
+	}
+	for (i = 0; i < e; i++) {
+		char c = path[n - e + i];
+
+		if ((c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c) != ext[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* path with its extension, if it has one, replaced by ext, to free */
+static char *
+out_path(const char *path, const char *ext)
+{
+	const char *dot = strrchr(path, '.'), *slash = strrchr(path, '/');
+	size_t n = dot && (!slash || dot > slash) ? (size_t)(dot - path)
+		: strlen(path);
+	char *out = (char *)malloc(n + strlen(ext) + 1);
+
+	if (out) {
+		memcpy(out, path, n);
+		strcpy(out + n, ext);
+	}
+	return out;
+}
+
+/*
+ * Transcode the file at path to out, which must not exist unless force is
+ * set. Return NULL or why it failed, with the output removed if it was
+ * made here.
+ */
+static const char *
+transcode(const char *path, const char *out, const btw_def *def,
+		int force, unsigned int threads, unsigned long long *in_len,
+		unsigned long long *out_len)
+{
+	int encode = has_ext(path, ".wav"), made = 1, r;
+	cli_file in = { NULL, 0, 0 }, dst = { NULL, 0, 0 };
+	static char msg[256];
+	const unsigned char *data;
+	const char *err = NULL;
+	btw_file *file = NULL;
+	btw_def info;
+
+	if (!(in.f = fopen(path, "rb"))) {
+		return strerror(errno);
+	}
+	if (!encode) {
+		fclose(in.f);
+		in.f = NULL;
+		if (!(file = btw_open_file(path, &info))) {
+			return "not a BTW file";
+		}
+	}
+	/*
+	 * "x" fails on a file that is there instead of truncating it. What
+	 * -f writes over, maybe a device, isn't removed on failure.
+	 */
+	if (force && (dst.f = fopen(out, "rb"))) {
+		fclose(dst.f);
+		made = 0;
+	}
+	if (!(dst.f = fopen(out, force ? "wb" : "wbx"))) {
+		snprintf(msg, sizeof(msg), "%s: %s", out, errno == EEXIST
+			? "exists, -f overwrites it" : strerror(errno));
+		err = msg;
+		goto done;
+	}
+	if (in.f) {
+		setvbuf(in.f, NULL, _IOFBF, CLI_BUFFER);
+	}
+	setvbuf(dst.f, NULL, _IOFBF, CLI_BUFFER);
+
+	if (encode) {
+		r = btw_wav_encode(read_file, &in, write_file, &dst, def,
+			threads, NULL);
+		if (!r && fseeko(in.f, 0, SEEK_END)) {
+			fail(&in);
+			r = BTW_ERR_IO;
+		}
+		*in_len = ftello(in.f);
+	} else {
+		data = btw_map(file, in_len);
+		r = btw_wav_decode(data, *in_len, write_file, &dst, threads,
+			NULL);
+	}
+	if (fseeko(dst.f, 0, SEEK_END) || (*out_len = ftello(dst.f),
+			fclose(dst.f))) {
+		fail(&dst);
+		r = r ? r : BTW_ERR_IO;
+	}
+	dst.f = NULL;
+	if (r) {
+		err = error_name(r, encode, &in, &dst, out);
+		if (made) {
+			remove(out);
+		}
+	}
+
+done:
+	if (dst.f) {
+		fclose(dst.f);
+	}
+	if (in.f) {
+		fclose(in.f);
+	}
+	if (file) {
+		btw_close_file(file);
+	}
+	return err;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: btw [-f] [-t threads] [-B block_size] "
+		"[-m min_block_size] [-o out] file...\n"
+		"files ending in .wav are encoded to .btw, others decoded "
+		"to .wav, -f overwrites outputs that exist\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned long long in_len = 0, out_len = 0;
+	const char *output = NULL;
+	unsigned int threads = 0;
+	int failed = 0, force = 0, i;
+	const char *err;
+	btw_def def, check;
+	double start;
+	char *out;
+
+	memset(&def, 0, sizeof(def));
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (!argv[i][1] || argv[i][2]) {
+			usage();
+		}
+		if (argv[i][1] == 'f') {
+			force = 1;
+			continue;
+		}
+		if (i + 1 == argc) {
+			usage();
+		}
+		switch (argv[i++][1]) {
+		case 't':
+			threads = strtoul(argv[i], NULL, 10);
+			break;
+		case 'B':
+			def.block_size = strtoul(argv[i], NULL, 10);
+			break;
+		case 'm':
+			def.min_block_size = strtoul(argv[i], NULL, 10);
+			break;
+		case 'o':
+			output = argv[i];
+			break;
+		default:
+			usage();
+		}
+	}
+	if (i == argc || (output && i + 1 != argc)) {
+		usage();
+	}
+	/* Any stream shows whether the block sizes can be encoded */
+	check = def;
+	check.channels = 1;
+	check.sample_rate = 1;
+	check.bits_per_sample = 16;
+	check.sample_count = 1;
+	if (!btw_max_encoded_size(&check)) {
+		fprintf(stderr, "btw: bad block sizes\n");
+		return 2;
+	}
+
+	for (; i < argc; i++) {
+		out = output ? NULL : out_path(argv[i],
+			has_ext(argv[i], ".wav") ? ".btw" : ".wav");
+		if (!output && !out) {
+			fprintf(stderr, "btw: out of memory\n");
+			return 1;
+		}
+		start = now();
+		err = transcode(argv[i], output ? output : out, &def, force,
+			threads, &in_len, &out_len);
+		if (err) {
+			fprintf(stderr, "btw: %s: %s\n", argv[i], err);
+			failed = 1;
+		} else {
+			printf("%s -> %s: %llu -> %llu bytes, %.1f MB/s\n",
+				argv[i], output ? output : out, in_len, out_len,
+				(has_ext(argv[i], ".wav") ? in_len : out_len)
+				/ 1e6 / (now() - start + 1e-9));
+		}
+		free(out);
+	}
+	return failed;
+}
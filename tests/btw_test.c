@@ -0,0 +1,871 @@
+/*
+ * btw_test - check that btw.h gives back what it encodes and fails cleanly
+ * on everything else.
+ *
+ *   btw_test
+ *
+ * Round trips every format through each way to encode and decode, then
+ * feeds the decoders truncated, bit-flipped and hostile input. Each failed
+ * check is printed, and the exit status is then 1. Build it with
+ * -fsanitize=address,undefined to catch reads past the input too.
+ */
+
+#define BTW_IMPLEMENTATION
+#include "../btw.h"
+
+#include <math.h>
+#include <stdio.h>
+
+static unsigned int failures;
+
+#define CHECK(cond) check(cond, #cond, __LINE__)
+
+static int
+check(int ok, const char *what, int line)
+{
+	if (!ok) {
+		fprintf(stderr, "btw_test.c:%d: %s\n", line, what);
+		failures++;
+	}
+	return ok;
+}
+
+static uint32_t seed = 1;
+
+/* xorshift32, so every run sees the same samples */
+static uint32_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+enum { SINE, NOISE, SILENCE, STEPS, SPIKES, KINDS };
+
+static unsigned int
+format_bytes(btw_format fmt)
+{
+	static const unsigned int bytes[] = { 1, 2, 3, 4 };
+
+	return bytes[fmt];
+}
+
+/* n samples of kind fitting in bits bits, stored as fmt, to free */
+static unsigned char *
+make_samples(btw_format fmt, unsigned int bits, unsigned long long n,
+		int kind)
+{
+	unsigned int size = format_bytes(fmt);
+	unsigned char *s = (unsigned char *)malloc(n * size + 1);
+	long long lo = -(1LL << (bits - 1)), hi = (1LL << (bits - 1)) - 1;
+	unsigned long long i;
+	long long v = 0;
+
+	for (i = 0; i < n; i++) {
+		switch (kind) {
+		case SINE:
+			v = (long long)(sin(i * 0.01) * (hi / 2))
+				+ (long long)(rnd() % 64) - 32;
+			break;
+		case NOISE:
+			v = lo + (long long)((((uint64_t)rnd() << 32) | rnd())
+				% (uint64_t)(hi - lo + 1));
+			break;
+		case SILENCE:
+			v = hi / 3;
+			break;
+		case STEPS:
+			v = (i / 700) % 2 ? lo : hi;
+			break;
+		case SPIKES:
+			/* Runs just past the escape, near verbatim in size */
+			v = (long long)(rnd() % 4) - 2;
+			if (rnd() % 4 == 0) {
+				v = (1LL << (bits - 2))
+					- (long long)(rnd() % (1U << (bits - 3)));
+				v = rnd() % 2 ? v : -v;
+			}
+			break;
+		}
+		v = v < lo ? lo : v > hi ? hi : v;
+		switch (fmt) {
+		case BTW_FMT_U8:
+			s[i] = (unsigned char)(v - lo);
+			break;
+		case BTW_FMT_S16:
+			((int16_t *)s)[i] = (int16_t)v;
+			break;
+		case BTW_FMT_S24:
+			s[i * 3] = v & 0xff;
+			s[i * 3 + 1] = (v >> 8) & 0xff;
+			s[i * 3 + 2] = (v >> 16) & 0xff;
+			break;
+		default:
+			((int32_t *)s)[i] = (int32_t)v;
+			break;
+		}
+	}
+	return s;
+}
+
+static btw_def
+make_def(unsigned int channels, unsigned int bits, unsigned long long count,
+		unsigned int block_size, unsigned int min_block_size)
+{
+	btw_def def;
+
+	memset(&def, 0, sizeof(def));
+	def.channels = channels;
+	def.bits_per_sample = bits;
+	def.sample_rate = 44100;
+	def.sample_count = count;
+	def.block_size = block_size;
+	def.min_block_size = min_block_size;
+	return def;
+}
+
+/* A growing output for btw_write_fn and input for btw_read_fn */
+typedef struct {
+	unsigned char *data;
+	unsigned long long len, cap;
+	unsigned long long at;		/* Where reading goes on */
+	unsigned int step;		/* Most a read returns, 0 for all */
+	int forward;			/* Whether writes going back fail */
+} buffer;
+
+static int
+write_buffer(void *user, unsigned long long offset, const unsigned char *data,
+		unsigned long long len)
+{
+	buffer *b = (buffer *)user;
+
+	if (b->forward && offset < b->len) {
+		return -1;
+	}
+	if (offset + len > b->cap) {
+		b->cap = (offset + len) * 2;
+		b->data = (unsigned char *)realloc(b->data, b->cap);
+	}
+	memcpy(b->data + offset, data, len);
+	if (offset + len > b->len) {
+		b->len = offset + len;
+	}
+	return 0;
+}
+
+static long long
+read_buffer(void *user, unsigned char *buf, unsigned long long len)
+{
+	buffer *b = (buffer *)user;
+	unsigned long long n = b->len - b->at;
+
+	if (b->step && n > b->step) {
+		n = 1 + rnd() % b->step;
+	}
+	n = n < len ? n : len;
+	memcpy(buf, b->data + b->at, n);
+	b->at += n;
+	return (long long)n;
+}
+
+/*
+ * Decode len bytes of data with a streaming decoder, pushed in random
+ * pieces or pulled through read_buffer, into out. Return the samples per
+ * channel or -1 on error.
+ */
+static long long
+stream_decode(const unsigned char *data, unsigned long long len,
+		btw_format fmt, int pull, void *out, btw_def *def)
+{
+	buffer in;
+	btw_decoder *dec;
+	unsigned long long at = 0, got = 0, n;
+	unsigned int frame = 0;
+	int ended = pull, info;
+	long long r;
+
+	memset(&in, 0, sizeof(in));
+	in.data = (unsigned char *)data;
+	in.len = len;
+	in.step = 300;
+	dec = btw_decoder_init_fmt(fmt, pull ? read_buffer : NULL, &in);
+	if (!CHECK(dec != NULL)) {
+		return -1;
+	}
+	for (;;) {
+		if (!ended) {
+			n = rnd() % 700;
+			n = n < len - at ? n : len - at;
+			btw_decoder_push(dec, data + at, n);
+			if ((ended = (at += n) == len)) {
+				btw_decoder_push(dec, NULL, 0);
+			}
+		}
+		if (!frame) {
+			/* A header still missing at the end is an error */
+			if ((info = btw_decoder_info(dec, def)) && (info < 0
+					|| ended)) {
+				break;
+			}
+			frame = info ? 0 : def->channels * format_bytes(fmt);
+			continue;
+		}
+		r = btw_decoder_read(dec, (unsigned char *)out + got * frame,
+			1 + rnd() % 5000);
+		if (r < 0) {
+			break;
+		}
+		got += r;
+		if (!r && ended) {
+			btw_decoder_info(dec, def);
+			btw_decoder_free(dec);
+			return (long long)got;
+		}
+	}
+	btw_decoder_free(dec);
+	return -1;
+}
+
+/* Encode with the streaming encoder, fed in random pieces */
+static unsigned char *
+stream_encode(const unsigned char *samples, btw_format fmt,
+		const btw_def *def, int forward, unsigned long long *out_len)
+{
+	unsigned long long count = def->sample_count, fed, n;
+	unsigned int frame = def->channels * format_bytes(fmt);
+	btw_encoder *enc;
+	buffer out;
+
+	memset(&out, 0, sizeof(out));
+	out.forward = forward;
+	if (!count) {
+		count = *out_len;
+	}
+	enc = btw_encoder_init_fmt(def, fmt, write_buffer, &out);
+	if (!CHECK(enc != NULL)) {
+		return NULL;
+	}
+	for (fed = 0; fed < count; fed += n) {
+		n = rnd() % 3000;
+		n = n < count - fed ? n : count - fed;
+		CHECK(btw_encoder_feed(enc, samples + fed * frame, n) == 0);
+	}
+	CHECK(btw_encoder_finish(enc, out_len) == 0);
+	CHECK(*out_len == out.len);
+	return out.data;
+}
+
+static void
+test_round_trip(btw_format fmt, unsigned int bits, unsigned int channels,
+		unsigned long long count, unsigned int block_size,
+		unsigned int min_block_size, int kind)
+{
+	btw_def def = make_def(channels, bits, count, block_size,
+		min_block_size), got;
+	unsigned long long n = count * channels, size = n * format_bytes(fmt);
+	unsigned long long len, len2, out_len, bound, first, part;
+	unsigned char *samples = make_samples(fmt, bits, n, kind);
+	unsigned char *data, *data2, *out;
+	int pull;
+
+	data = btw_encode_fmt(samples, fmt, &def, &len);
+	if (!CHECK(data != NULL)) {
+		free(samples);
+		return;
+	}
+	bound = btw_max_encoded_size(&def);
+	CHECK(len <= bound);
+
+	out = (unsigned char *)btw_decode_fmt(data, fmt, &got, &out_len);
+	CHECK(out && out_len == n && !memcmp(out, samples, size));
+	CHECK(got.channels == channels && got.bits_per_sample == bits
+		&& got.sample_rate == 44100 && got.sample_count == count);
+	free(out);
+
+	out = (unsigned char *)btw_decode_n(data, len, fmt, &got, &out_len);
+	CHECK(out && out_len == n && !memcmp(out, samples, size));
+	free(out);
+	CHECK(btw_verify_n(data, len) == BTW_OK);
+
+	out = (unsigned char *)malloc(size + 1);
+	CHECK(btw_decode_into_n(data, len, fmt, &got, out, size, &out_len,
+		NULL) == BTW_OK && out_len == n && !memcmp(out, samples, size));
+	CHECK(btw_decode_into_n(data, len, fmt, &got, out, size - 1,
+		&out_len, NULL) == BTW_ERR_SPACE);
+
+	first = count / 3;
+	part = count - first < 1000 ? count - first : 1000;
+	CHECK(btw_decode_range_fmt(data, fmt, &got, first, part, out) == part
+		&& !memcmp(out, samples + first * channels * format_bytes(fmt),
+		part * channels * format_bytes(fmt)));
+	free(out);
+
+	data2 = (unsigned char *)malloc(bound);
+	CHECK(btw_encode_into(samples, fmt, &def, data2, bound, &len2, NULL)
+		== BTW_OK && len2 == len && !memcmp(data2, data, len));
+	free(data2);
+
+	data2 = btw_encode_mt_fmt(samples, fmt, &def, 3, NULL, &len2);
+	CHECK(data2 && len2 == len && !memcmp(data2, data, len));
+	free(data2);
+	out = (unsigned char *)btw_decode_mt_fmt(data, fmt, &got, 3, NULL,
+		&out_len);
+	CHECK(out && out_len == n && !memcmp(out, samples, size));
+	free(out);
+
+	/* Streams of known and unknown length, decoded as they come */
+	data2 = stream_encode(samples, fmt, &def, 0, &len2);
+	CHECK(data2 && len2 == len && !memcmp(data2, data, len));
+	free(data2);
+	def.sample_count = 0;
+	len2 = count;
+	data2 = stream_encode(samples, fmt, &def, 1, &len2);
+	def.sample_count = count;
+	out = (unsigned char *)malloc(size + 1);
+	for (pull = 0; data2 && pull < 2; pull++) {
+		CHECK(stream_decode(data2, len2, fmt, pull, out, &got)
+			== (long long)count && !memcmp(out, samples, size));
+		CHECK(got.sample_count == count);
+		CHECK(stream_decode(data, len, fmt, pull, out, &got)
+			== (long long)count && !memcmp(out, samples, size));
+	}
+	free(out);
+	if (data2) {
+		out = (unsigned char *)btw_decode_n(data2, len2, fmt, &got,
+			&out_len);
+		CHECK(out && out_len == n && !memcmp(out, samples, size));
+		CHECK(btw_verify_n(data2, len2) == BTW_OK);
+		free(out);
+	}
+
+	free(data2);
+	free(data);
+	free(samples);
+}
+
+static void
+test_round_trips(void)
+{
+	static const struct {
+		btw_format fmt;
+		unsigned int bits;
+	} formats[] = {
+		{ BTW_FMT_U8, 8 }, { BTW_FMT_S16, 16 }, { BTW_FMT_S16, 12 },
+		{ BTW_FMT_S24, 24 }, { BTW_FMT_S24, 20 }, { BTW_FMT_S32, 32 },
+		{ BTW_FMT_S32, 28 }
+	};
+	static const unsigned int blocks[][2] = {
+		{ 0, 0 }, { 16, 16 }, { 4096, 64 }
+	};
+	static const unsigned long long counts[] = { 1, 17, 513, 9000 };
+	static const unsigned int channels[] = { 1, 2, 5 };
+	unsigned int f, b, c, n;
+	int kind;
+
+	for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+	for (b = 0; b < sizeof(blocks) / sizeof(blocks[0]); b++)
+	for (c = 0; c < sizeof(channels) / sizeof(channels[0]); c++)
+	for (n = 0; n < sizeof(counts) / sizeof(counts[0]); n++)
+	for (kind = 0; kind < KINDS; kind++) {
+		test_round_trip(formats[f].fmt, formats[f].bits, channels[c],
+			counts[n], blocks[b][0], blocks[b][1], kind);
+	}
+}
+
+/* Whether out is NULL or holds the first samples of samples */
+static int
+is_prefix(const unsigned char *out, unsigned long long out_len,
+		const unsigned char *samples, unsigned long long n)
+{
+	return !out || (out_len <= n && !memcmp(out, samples, out_len * 2));
+}
+
+/* Every cut of a stream fails, or is a prefix for cut open streams */
+static void
+test_truncated(void)
+{
+	btw_def def = make_def(2, 16, 3000, 256, 32), got;
+	unsigned char *samples = make_samples(BTW_FMT_S16, 16, 6000, SINE);
+	unsigned char *data, *open, *out;
+	unsigned long long len, open_len = 3000, cut, out_len;
+	long long r;
+
+	data = btw_encode_fmt(samples, BTW_FMT_S16, &def, &len);
+	def.sample_count = 0;
+	open = stream_encode(samples, BTW_FMT_S16, &def, 0, &open_len);
+	if (!CHECK(data && open)) {
+		return;
+	}
+	out = (unsigned char *)malloc(6000 * 2);
+	for (cut = 0; cut < len; cut++) {
+		CHECK(btw_decode_n(data, cut, BTW_FMT_S16, &got, &out_len)
+			== NULL);
+		CHECK(btw_verify_n(data, cut) == BTW_ERR_CORRUPT);
+		CHECK(btw_decode_into_n(data, cut, BTW_FMT_S16, &got, out,
+			6000 * 2, &out_len, NULL) == BTW_ERR_CORRUPT);
+		if (cut % 7 == 0) {
+			CHECK(stream_decode(data, cut, BTW_FMT_S16, cut % 2,
+				out, &got) < 0);
+		}
+	}
+
+	/* Open streams cut after a whole block end there */
+	for (cut = 0; cut < open_len; cut++) {
+		unsigned char *dec = (unsigned char *)btw_decode_n(open, cut,
+			BTW_FMT_S16, &got, &out_len);
+
+		CHECK(is_prefix(dec, out_len, samples, 6000));
+		CHECK(!dec || out_len % 512 == 0);
+		free(dec);
+		if (cut % 7 == 0) {
+			r = stream_decode(open, cut, BTW_FMT_S16, cut % 2, out,
+				&got);
+			CHECK(r < 0 || (r % 256 == 0 && is_prefix(out, r * 2,
+				samples, 6000)));
+		}
+	}
+	free(out);
+	free(open);
+	free(data);
+	free(samples);
+}
+
+/*
+ * Every flipped bit in the blocks is caught by a decoder or checksum. The
+ * header and the seek table's one entry take 36 bytes, where the rate and
+ * flags no block relies on may change unnoticed, but not the samples.
+ */
+static void
+test_bit_flips(void)
+{
+	btw_def def = make_def(2, 16, 2000, 256, 32), got;
+	unsigned char *samples = make_samples(BTW_FMT_S16, 16, 4000, SINE);
+	unsigned char *data, *out;
+	unsigned long long len, bit, out_len;
+
+	data = btw_encode_fmt(samples, BTW_FMT_S16, &def, &len);
+	if (!CHECK(data != NULL)) {
+		return;
+	}
+	for (bit = 0; bit < len * 8; bit++) {
+		data[bit / 8] ^= 1 << bit % 8;
+		out = (unsigned char *)btw_decode_n(data, len, BTW_FMT_S16,
+			&got, &out_len);
+		if (bit < 36 * 8) {
+			CHECK(!out || !memcmp(out, samples, 4000 * 2));
+		} else {
+			CHECK(out == NULL);
+			CHECK(btw_verify_n(data, len) != BTW_OK);
+		}
+		free(out);
+		data[bit / 8] ^= 1 << bit % 8;
+	}
+	free(data);
+	free(samples);
+}
+
+/* Corruption fails the streaming decoder even as garbage keeps coming */
+static void
+test_stream_corrupt(void)
+{
+	btw_def def = make_def(2, 16, 20000, 0, 0);
+	unsigned char *samples = make_samples(BTW_FMT_S16, 16, 40000, NOISE);
+	unsigned char *data, *out, ones[4096];
+	unsigned long long len, at, got;
+	btw_decoder *dec;
+	unsigned int t, k, flip;
+	long long r;
+
+	data = btw_encode_fmt(samples, BTW_FMT_S16, &def, &len);
+	if (!CHECK(data != NULL)) {
+		return;
+	}
+	memset(ones, 0xff, sizeof(ones));
+	out = (unsigned char *)malloc(40000 * 2);
+	for (t = 0; t < 100; t++) {
+		at = 100 + rnd() % (len - 100);
+		flip = 1 << rnd() % 8;
+		data[at] ^= flip;
+		dec = btw_decoder_init_fmt(BTW_FMT_S16, NULL, NULL);
+		btw_decoder_push(dec, data, len);
+		for (got = 0, r = 0, k = 0; k < 32 && got < 20000; k++) {
+			if ((r = btw_decoder_read(dec, out, 20000)) < 0) {
+				break;
+			}
+			got += r;
+			btw_decoder_push(dec, ones, sizeof(ones));
+		}
+		CHECK(r < 0);
+		btw_decoder_free(dec);
+		data[at] ^= flip;
+	}
+	free(out);
+	free(data);
+	free(samples);
+}
+
+static void
+store_le(unsigned char *p, uint64_t v, unsigned int bytes)
+{
+	for (; bytes; bytes--, v >>= 8) {
+		*p++ = v & 0xff;
+	}
+}
+
+/* Headers claiming impossible sizes fail without allocating them */
+static void
+test_hostile_headers(void)
+{
+	static const uint64_t counts[] = { 1ULL << 62, 0xfffffffffffULL,
+		1ULL << 40, 5000000 };
+	btw_def def = make_def(2, 16, 1000, 0, 0), got;
+	unsigned char *samples = make_samples(BTW_FMT_S16, 16, 2000, SINE);
+	unsigned char *data, *h, out[64];
+	unsigned long long len, out_len;
+	btw_batch_item item;
+	unsigned int i;
+	void *arena;
+
+	data = btw_encode_fmt(samples, BTW_FMT_S16, &def, &len);
+	if (!CHECK(data != NULL)) {
+		return;
+	}
+	h = (unsigned char *)malloc(len);
+	for (i = 0; i < 10; i++) {
+		memcpy(h, data, len);
+		if (i < 4) {
+			store_le(h + 4, counts[i], 8);
+		} else if (i < 6) {
+			store_le(h + 12, i == 4 ? 0 : 0xffff, 2);
+		} else if (i < 8) {
+			store_le(h + 14, i == 6 ? 0 : 33, 2);
+		} else if (i == 8) {
+			store_le(h + 20, 0xffff, 2);
+		} else {
+			memset(h, 0xff, len);
+		}
+		CHECK(btw_decode_n(h, len, BTW_FMT_S32, &got, &out_len)
+			== NULL);
+		CHECK(btw_verify_n(h, len) != BTW_OK);
+		CHECK(btw_decode_into_n(h, len, BTW_FMT_S16, &got, out,
+			sizeof(out), &out_len, NULL) != BTW_OK);
+		CHECK(stream_decode(h, len, BTW_FMT_S16, 0, samples, &got)
+			< 0);
+
+		memset(&item, 0, sizeof(item));
+		item.fmt = BTW_FMT_S32;
+		item.len = len;
+		arena = btw_decode_batch(h, &item, 1, 1, NULL);
+		CHECK(item.result != BTW_OK);
+		free(arena);
+	}
+	free(h);
+	free(data);
+	free(samples);
+}
+
+#define SPIKE_CLIPS 48
+
+/*
+ * Noise of a few steps with one sample in 5 to 7 in 20 a spike of 1024 to
+ * 1535, which escapes just past BTW_ESCAPE_RUN and costs near verbatim,
+ * still fits btw_max_encoded_size however it is encoded
+ */
+static void
+test_spikes(void)
+{
+	unsigned long long n = 4096, len, len2, out_len, bound, arena_len;
+	unsigned char *samples[SPIKE_CLIPS], *data, *into, *stream, *out, *arena;
+	btw_batch_item items[SPIKE_CLIPS];
+	unsigned int i, j, bits, channels, odds;
+	btw_def def, got;
+	void *decoded;
+	int16_t *s, v;
+
+	memset(items, 0, sizeof(items));
+	for (i = 0; i < SPIKE_CLIPS; i++) {
+		bits = 11 + i % 6;
+		channels = 1 + i / 6 % 2;
+		odds = 20 + i / 12 * 5;
+		s = (int16_t *)malloc(n * channels * 2);
+		for (j = 0; j < n * channels; j++) {
+			s[j] = (int16_t)(rnd() % 4) - 2;
+			if (rnd() % 100 < odds) {
+				v = (int16_t)(1024 + rnd() % 512);
+				v = v < 1 << (bits - 1) ? v : (1 << (bits - 1)) - 1;
+				s[j] = rnd() % 2 ? v : -v;
+			}
+		}
+		samples[i] = (unsigned char *)s;
+		def = make_def(channels, bits, n, 0, 0);
+		items[i].samples = s;
+		items[i].fmt = BTW_FMT_S16;
+		items[i].def = def;
+
+		data = btw_encode_fmt(s, BTW_FMT_S16, &def, &len);
+		bound = btw_max_encoded_size(&def);
+		if (!CHECK(data && len <= bound)) {
+			free(data);
+			continue;
+		}
+		/* Exactly the bound, so a write past it is caught */
+		into = (unsigned char *)malloc(bound);
+		CHECK(btw_encode_into(s, BTW_FMT_S16, &def, into, bound, &len2,
+			NULL) == BTW_OK && len2 == len
+			&& !memcmp(into, data, len));
+		free(into);
+		stream = stream_encode(samples[i], BTW_FMT_S16, &def, 0, &len2);
+		CHECK(stream && len2 == len && !memcmp(stream, data, len));
+		free(stream);
+		out = (unsigned char *)btw_decode_n(data, len, BTW_FMT_S16,
+			&got, &out_len);
+		CHECK(out && !memcmp(out, s, n * channels * 2));
+		free(out);
+		free(data);
+	}
+
+	arena = btw_encode_batch(items, SPIKE_CLIPS, 3, NULL, &arena_len);
+	if (!CHECK(arena != NULL)) {
+		return;
+	}
+	decoded = btw_decode_batch(arena, items, SPIKE_CLIPS, 3, NULL);
+	for (i = 0; decoded && i < SPIKE_CLIPS; i++) {
+		CHECK(items[i].result == BTW_OK && !memcmp(items[i].decoded,
+			samples[i], n * items[i].def.channels * 2));
+	}
+	free(decoded);
+	free(arena);
+	for (i = 0; i < SPIKE_CLIPS; i++) {
+		free(samples[i]);
+	}
+}
+
+/*
+ * U8 blocks coded as one value, verbatim and as Rice codes all decode to
+ * the same 0 to 255 in formats wider than U8
+ */
+static void
+test_unsigned(void)
+{
+	unsigned long long n = 3 * 512, len, out_len, i;
+	unsigned char *samples, *data;
+	unsigned int channels;
+	btw_def def, got;
+	int16_t *out;
+
+	for (channels = 1; channels <= 2; channels++) {
+		samples = (unsigned char *)malloc(n * channels);
+		for (i = 0; i < n * channels; i++) {
+			if (i < 512 * channels) {
+				samples[i] = 200;
+			} else if (i < 1024 * channels) {
+				samples[i] = rnd() % 256;
+			} else {
+				samples[i] = 128 + rnd() % 8;
+			}
+		}
+		def = make_def(channels, 8, n, 512, 512);
+		data = btw_encode_fmt(samples, BTW_FMT_U8, &def, &len);
+		out = (int16_t *)btw_decode_n(data, len, BTW_FMT_S16, &got,
+			&out_len);
+		if (CHECK(data && out && out_len == n * channels)) {
+			for (i = 0; i < n * channels && out[i] == samples[i];
+					i++) {
+			}
+			CHECK(i == n * channels);
+		}
+		free(out);
+		free(data);
+		free(samples);
+	}
+}
+
+/* Clips of any format share an arena, a bad one failing on its own */
+static void
+test_batch(void)
+{
+	btw_batch_item items[6];
+	unsigned char *samples[6], *arena;
+	unsigned long long arena_len;
+	unsigned int i, bits;
+	void *decoded;
+
+	memset(items, 0, sizeof(items));
+	for (i = 0; i < 6; i++) {
+		items[i].fmt = (btw_format)(i % 4);
+		bits = format_bytes(items[i].fmt) * 8;
+		items[i].def = make_def(1 + i % 3, bits, 100 + i * 3000, 0,
+			0);
+		samples[i] = make_samples(items[i].fmt, bits,
+			items[i].def.sample_count * items[i].def.channels,
+			i % KINDS);
+		items[i].samples = samples[i];
+	}
+	items[4].def.block_size = 100;
+
+	arena = btw_encode_batch(items, 6, 3, NULL, &arena_len);
+	if (!CHECK(arena != NULL)) {
+		return;
+	}
+	CHECK(items[4].result == BTW_ERR_INVALID && items[4].len == 0);
+	decoded = btw_decode_batch(arena, items, 6, 3, NULL);
+	CHECK(decoded != NULL);
+	for (i = 0; decoded && i < 6; i++) {
+		if (i == 4) {
+			CHECK(items[i].result != BTW_OK);
+			continue;
+		}
+		CHECK(items[i].result == BTW_OK && !memcmp(items[i].decoded,
+			samples[i], items[i].def.sample_count
+			* items[i].def.channels * format_bytes(items[i].fmt)));
+	}
+	free(decoded);
+	free(arena);
+	for (i = 0; i < 6; i++) {
+		free(samples[i]);
+	}
+}
+
+/*
+ * A WAV file of pcm_len bytes of pcm, RF64 when rf64 is set, with a junk
+ * chunk first when junk is set and a data size of size, taken from pcm_len
+ * when it is ~0
+ */
+static buffer
+make_wav(const unsigned char *pcm, unsigned long long pcm_len,
+		unsigned int channels, unsigned int bits, int rf64, int junk,
+		unsigned long long size)
+{
+	unsigned char h[96], *p = h;
+	unsigned int align = channels * bits / 8;
+	buffer b;
+
+	memset(&b, 0, sizeof(b));
+	if (size == ~0ULL) {
+		size = rf64 ? 0xffffffff : pcm_len;
+	}
+	memcpy(p, rf64 ? "RF64" : "RIFF", 4);
+	store_le(p + 4, rf64 ? 0xffffffff : 36 + pcm_len, 4);
+	memcpy(p + 8, "WAVE", 4);
+	p += 12;
+	if (rf64) {
+		memcpy(p, "ds64", 4);
+		store_le(p + 4, 28, 4);
+		store_le(p + 8, 36 + pcm_len, 8);
+		store_le(p + 16, pcm_len, 8);
+		store_le(p + 24, pcm_len / align, 8);
+		store_le(p + 32, 0, 4);
+		p += 36;
+	}
+	if (junk) {
+		memcpy(p, "LIST", 4);
+		store_le(p + 4, 3, 4);
+		memcpy(p + 8, "abc", 4);
+		p += 12;
+	}
+	memcpy(p, "fmt ", 4);
+	store_le(p + 4, 16, 4);
+	store_le(p + 8, 1, 2);
+	store_le(p + 10, channels, 2);
+	store_le(p + 12, 48000, 4);
+	store_le(p + 16, 48000 * align, 4);
+	store_le(p + 20, align, 2);
+	store_le(p + 22, bits, 2);
+	memcpy(p + 24, "data", 4);
+	store_le(p + 28, size, 4);
+	p += 32;
+	write_buffer(&b, 0, h, p - h);
+	write_buffer(&b, b.len, pcm, pcm_len);
+	return b;
+}
+
+/* WAV files, RIFF or RF64, transcode to BTW and back to the same PCM */
+static void
+test_wav(void)
+{
+	static const btw_format formats[] = { BTW_FMT_U8, BTW_FMT_S16,
+		BTW_FMT_S24, BTW_FMT_S32 };
+	unsigned long long count = 70000, pcm_len;
+	unsigned int f, bits, channels;
+	unsigned char *pcm;
+	buffer wav, enc, dec;
+	int rf64, junk;
+
+	for (f = 0; f < 4; f++)
+	for (rf64 = 0; rf64 < 2; rf64++)
+	for (junk = 0; junk < 2; junk++) {
+		bits = format_bytes(formats[f]) * 8;
+		channels = 1 + (f + junk) % 2;
+		pcm_len = count * channels * format_bytes(formats[f]);
+		pcm = make_samples(formats[f], bits, count * channels, SINE);
+		wav = make_wav(pcm, pcm_len, channels, bits, rf64, junk, ~0ULL);
+		wav.step = 5000;
+		memset(&enc, 0, sizeof(enc));
+		memset(&dec, 0, sizeof(dec));
+		CHECK(btw_wav_encode(read_buffer, &wav, write_buffer, &enc,
+			NULL, 3, NULL) == BTW_OK);
+		CHECK(btw_verify_n(enc.data, enc.len) == BTW_OK);
+		CHECK(btw_wav_decode(enc.data, enc.len, write_buffer, &dec, 3,
+			NULL) == BTW_OK);
+		CHECK(dec.len >= pcm_len && !memcmp(dec.data + dec.len
+			- pcm_len, pcm, pcm_len));
+		if (!rf64 && !junk) {
+			CHECK(dec.len == wav.len
+				&& !memcmp(dec.data, wav.data, wav.len));
+		}
+		free(dec.data);
+		free(enc.data);
+
+		/*
+		 * Cut short, with a data size of 0 or the 0xffffffff of
+		 * streaming writers, and not WAV at all
+		 */
+		wav.at = 0;
+		wav.len -= 1000;
+		memset(&enc, 0, sizeof(enc));
+		CHECK(btw_wav_encode(read_buffer, &wav, write_buffer, &enc,
+			NULL, 3, NULL) == BTW_ERR_CORRUPT);
+		free(enc.data);
+		free(wav.data);
+		if (!rf64) {
+			unsigned long long size = junk ? 0 : 0xffffffff;
+
+			wav = make_wav(pcm, pcm_len, channels, bits, 0, 0,
+				size);
+			memset(&enc, 0, sizeof(enc));
+			CHECK(btw_wav_encode(read_buffer, &wav, write_buffer,
+				&enc, NULL, 3, NULL) == BTW_ERR_INVALID);
+			free(enc.data);
+			wav.at = 0;
+			memcpy(wav.data + 8, "WAVX", 4);
+			memset(&enc, 0, sizeof(enc));
+			CHECK(btw_wav_encode(read_buffer, &wav, write_buffer,
+				&enc, NULL, 3, NULL) == BTW_ERR_CORRUPT);
+			free(enc.data);
+			free(wav.data);
+		}
+		free(pcm);
+	}
+}
+
+int
+main(void)
+{
+	test_round_trips();
+	test_truncated();
+	test_bit_flips();
+	test_stream_corrupt();
+	test_hostile_headers();
+	test_spikes();
+	test_unsigned();
+	test_batch();
+	test_wav();
+	if (failures) {
+		fprintf(stderr, "%u checks failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}